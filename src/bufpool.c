@@ -0,0 +1,240 @@
+#include "bufpool.h"
+
+#include "wire_wait.h"
+#include "wire_fd.h"
+#include "wire_log.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+
+// Free buffers kept around per class, beyond that they go back to malloc
+#define BUFPOOL_CACHE_MAX 16
+
+// A thread with no buffers out has nothing to wait on, it polls the budget
+#define BUFPOOL_RETRY_MSEC 10
+
+typedef struct bufpool_hdr {
+	union {
+		struct {
+			struct bufpool_hdr *next;
+			unsigned cls;
+		};
+		max_align_t align;
+	};
+} bufpool_hdr_t;
+
+typedef struct bufpool_class {
+	size_t size;
+	bufpool_hdr_t *free;
+	unsigned free_count;
+} bufpool_class_t;
+
+typedef struct bufpool_waiter {
+	struct bufpool_waiter *next;
+	wire_wait_t wait;
+} bufpool_waiter_t;
+
+/* Every wire thread has a pool of its own, the waiters are wires of that
+ * thread and can't be woken from another one.
+ */
+static __thread bufpool_class_t classes[] = {
+	{ BUFPOOL_SMALL, NULL, 0 },
+	{ BUFPOOL_MEDIUM, NULL, 0 },
+	{ BUFPOOL_LARGE, NULL, 0 },
+};
+#define NUM_CLASSES (sizeof(classes) / sizeof(classes[0]))
+
+static __thread size_t thread_out;
+static __thread size_t thread_cached;
+static __thread unsigned waits;
+static __thread bufpool_waiter_t *waiters_head;
+static __thread bufpool_waiter_t *waiters_tail;
+
+/* The memory cap is for the whole process, all the threads take their
+ * buffers, cached ones included, out of the same budget. The caches together
+ * are kept to a quarter of it so idle threads can't starve the busy ones.
+ */
+static size_t mem_max;
+static size_t cache_max;
+static size_t mem_used;
+static size_t mem_peak;
+
+void bufpool_init(size_t max, unsigned num_threads)
+{
+	mem_max = max;
+	cache_max = max / 4 / (num_threads ? num_threads : 1);
+}
+
+static int bufpool_reserve(size_t size)
+{
+	size_t used = __atomic_add_fetch(&mem_used, size, __ATOMIC_RELAXED);
+	size_t peak = __atomic_load_n(&mem_peak, __ATOMIC_RELAXED);
+
+	if (used > mem_max) {
+		__atomic_sub_fetch(&mem_used, size, __ATOMIC_RELAXED);
+		return -1;
+	}
+
+	while (used > peak && !__atomic_compare_exchange_n(&mem_peak, &peak, used, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+	return 0;
+}
+
+static void bufpool_release(size_t size)
+{
+	__atomic_sub_fetch(&mem_used, size, __ATOMIC_RELAXED);
+}
+
+// Give back the cached buffers of the other classes to make room
+static int bufpool_trim(unsigned except)
+{
+	bufpool_hdr_t *hdr;
+	unsigned i;
+	int freed = 0;
+
+	for (i = 0; i < NUM_CLASSES; i++) {
+		if (i == except)
+			continue;
+
+		while (classes[i].free) {
+			hdr = classes[i].free;
+			classes[i].free = hdr->next;
+			classes[i].free_count--;
+			thread_cached -= sizeof(*hdr) + classes[i].size;
+			bufpool_release(sizeof(*hdr) + classes[i].size);
+			free(hdr);
+			freed = 1;
+		}
+	}
+
+	return freed;
+}
+
+static void bufpool_wait(void)
+{
+	bufpool_waiter_t waiter;
+
+	waits++;
+
+	// The budget is held by other threads, none of ours will come back
+	if (thread_out == 0) {
+		wire_fd_wait_msec(BUFPOOL_RETRY_MSEC);
+		return;
+	}
+
+	waiter.next = NULL;
+	wire_wait_init(&waiter.wait);
+	if (waiters_tail)
+		waiters_tail->next = &waiter;
+	else
+		waiters_head = &waiter;
+	waiters_tail = &waiter;
+
+	wire_wait_single(&waiter.wait);
+}
+
+static void bufpool_wake(void)
+{
+	bufpool_waiter_t *waiter = waiters_head;
+
+	if (!waiter)
+		return;
+
+	waiters_head = waiter->next;
+	if (!waiters_head)
+		waiters_tail = NULL;
+	wire_wait_resume(&waiter->wait);
+}
+
+void *bufpool_get(size_t size)
+{
+	bufpool_class_t *c = NULL;
+	bufpool_hdr_t *hdr;
+	size_t alloc_size;
+	unsigned i;
+
+	for (i = 0; i < NUM_CLASSES; i++) {
+		if (size <= classes[i].size) {
+			c = &classes[i];
+			break;
+		}
+	}
+
+	if (!c) {
+		wire_log(WLOG_ERR, "Buffer of %zu bytes is over the largest class", size);
+		return NULL;
+	}
+
+	alloc_size = sizeof(*hdr) + c->size;
+
+	while (1) {
+		if (c->free) {
+			hdr = c->free;
+			c->free = hdr->next;
+			c->free_count--;
+			thread_cached -= alloc_size;
+			break;
+		}
+
+		if (bufpool_reserve(alloc_size) == 0) {
+			hdr = malloc(alloc_size);
+			if (!hdr) {
+				bufpool_release(alloc_size);
+				return NULL;
+			}
+
+			hdr->cls = i;
+			break;
+		}
+
+		if (!bufpool_trim(i))
+			bufpool_wait();
+	}
+
+	thread_out += alloc_size;
+
+	// Let the next one in line try too, there may be room for both
+	if (waiters_head && (c->free || __atomic_load_n(&mem_used, __ATOMIC_RELAXED) + alloc_size <= mem_max))
+		bufpool_wake();
+
+	return hdr + 1;
+}
+
+void bufpool_put(void *buf)
+{
+	bufpool_hdr_t *hdr;
+	bufpool_class_t *c;
+
+	if (!buf)
+		return;
+
+	hdr = (bufpool_hdr_t *)buf - 1;
+	c = &classes[hdr->cls];
+	thread_out -= sizeof(*hdr) + c->size;
+
+	if (c->free_count < BUFPOOL_CACHE_MAX && thread_cached + sizeof(*hdr) + c->size <= cache_max) {
+		hdr->next = c->free;
+		c->free = hdr;
+		c->free_count++;
+		thread_cached += sizeof(*hdr) + c->size;
+	} else {
+		bufpool_release(sizeof(*hdr) + c->size);
+		free(hdr);
+	}
+
+	bufpool_wake();
+}
+
+size_t bufpool_size(const void *buf)
+{
+	const bufpool_hdr_t *hdr = (const bufpool_hdr_t *)buf - 1;
+
+	return classes[hdr->cls].size;
+}
+
+void bufpool_usage(size_t *used, size_t *peak, unsigned *num_waits)
+{
+	*used = __atomic_load_n(&mem_used, __ATOMIC_RELAXED);
+	*peak = __atomic_load_n(&mem_peak, __ATOMIC_RELAXED);
+	*num_waits = waits;
+}
@@ -0,0 +1,23 @@
+#ifndef DOCKET_BUFPOOL_H
+#define DOCKET_BUFPOOL_H
+
+#include <stddef.h>
+
+/* Shared I/O buffers for the collectors so their wires can run on small
+ * stacks. Buffers come in a few size classes, freed buffers are kept for
+ * reuse and the total memory is capped, a wire that would go over the cap
+ * waits until another one returns a buffer. Each wire thread has its own
+ * pool and a buffer must be returned on the thread that got it, the cap is
+ * shared by all of them. Set it once before the wire threads start.
+ */
+#define BUFPOOL_SMALL (64*1024)
+#define BUFPOOL_MEDIUM (256*1024)
+#define BUFPOOL_LARGE (1024*1024)
+
+void bufpool_init(size_t mem_max, unsigned num_threads);
+void *bufpool_get(size_t size);
+void bufpool_put(void *buf);
+size_t bufpool_size(const void *buf);
+void bufpool_usage(size_t *used, size_t *peak, unsigned *waits);
+
+#endif
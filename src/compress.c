@@ -0,0 +1,466 @@
+#include "compress.h"
+
+#include "wire.h"
+#include "wire_fd.h"
+#include "wire_pool.h"
+#include "wire_stack.h"
+#include "wire_log.h"
+#include "macros.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/eventfd.h>
+
+#define COMPRESS_BUF_SIZE (64*1024)
+#define COMPRESS_BLOCK_SIZE (256*1024)
+#define COMPRESS_WRITER_STACK (32*1024)
+#define COMPRESS_MAX_SESSIONS 32
+
+// A partial block that waited this long goes out with the next write
+#define COMPRESS_BLOCK_MAX_MSEC 100
+
+// 15 bits of window and 16 to ask zlib for a gzip wrapper
+#define GZIP_WINDOW_BITS (15 + 16)
+
+struct compress_job {
+	compress_job_t *next;
+	compress_job_t *work_next;
+	compress_t *c;
+	compress_job_t **done_list;
+	int done_fd;
+	int level;
+	int done;
+	int failed;
+	unsigned char *in;
+	size_t in_len;
+	unsigned char *out;
+	size_t out_len;
+};
+
+static unsigned num_workers;
+static unsigned max_inflight;
+
+// Shared with the worker threads, protected by work_lock
+static pthread_mutex_t work_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+static compress_job_t *work_head;
+static compress_job_t *work_tail;
+
+/* Finished jobs go back to the wire thread that submitted them, each one has
+ * its own done list, also protected by work_lock.
+ */
+static __thread compress_job_t *done_list;
+static __thread int done_fd = -1;
+
+static __thread wire_t completion_wire;
+static __thread wire_pool_t writer_pool;
+
+static uint64_t compress_now_msec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void compress_job_run(z_stream *strm, compress_job_t *job)
+{
+	int ret;
+
+	ret = deflateParams(strm, job->level, Z_DEFAULT_STRATEGY);
+	if (ret != Z_OK) {
+		job->failed = 1;
+		return;
+	}
+
+	job->out_len = deflateBound(strm, job->in_len);
+	job->out = malloc(job->out_len);
+	if (!job->out) {
+		job->failed = 1;
+		return;
+	}
+
+	strm->next_in = job->in;
+	strm->avail_in = job->in_len;
+	strm->next_out = job->out;
+	strm->avail_out = job->out_len;
+
+	ret = deflate(strm, Z_FINISH);
+	if (ret != Z_STREAM_END)
+		job->failed = 1;
+	job->out_len -= strm->avail_out;
+}
+
+static void *compress_worker(void *arg)
+{
+	z_stream strm;
+	compress_job_t *job;
+	uint64_t one = 1;
+	int ret;
+
+	UNUSED(arg);
+
+	memset(&strm, 0, sizeof(strm));
+	ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, GZIP_WINDOW_BITS, 8, Z_DEFAULT_STRATEGY);
+	if (ret != Z_OK)
+		return NULL;
+
+	while (1) {
+		pthread_mutex_lock(&work_lock);
+		while (work_head == NULL)
+			pthread_cond_wait(&work_cond, &work_lock);
+		job = work_head;
+		work_head = job->work_next;
+		if (!work_head)
+			work_tail = NULL;
+		pthread_mutex_unlock(&work_lock);
+
+		compress_job_run(&strm, job);
+		deflateReset(&strm);
+
+		free(job->in);
+		job->in = NULL;
+
+		pthread_mutex_lock(&work_lock);
+		job->work_next = *job->done_list;
+		*job->done_list = job;
+		pthread_mutex_unlock(&work_lock);
+
+		ret = write(job->done_fd, &one, sizeof(one));
+	}
+
+	return NULL;
+}
+
+/* Runs on the wire thread, hands the jobs finished by the workers back to
+ * the writer wires of their sessions.
+ */
+static void compress_completion(void *arg)
+{
+	wire_fd_state_t fd_state;
+	compress_job_t *job;
+	compress_job_t *next;
+	uint64_t count;
+	ssize_t ret;
+
+	UNUSED(arg);
+
+	wire_fd_mode_init(&fd_state, done_fd);
+	wire_fd_mode_read(&fd_state);
+
+	while (1) {
+		wire_fd_wait(&fd_state);
+
+		ret = read(done_fd, &count, sizeof(count));
+		if (ret < 0)
+			continue;
+
+		pthread_mutex_lock(&work_lock);
+		job = done_list;
+		done_list = NULL;
+		pthread_mutex_unlock(&work_lock);
+
+		for (; job; job = next) {
+			next = job->work_next;
+			job->done = 1;
+			wire_wait_resume(&job->c->wait);
+		}
+	}
+}
+
+int compress_workers_init(unsigned max_threads)
+{
+	pthread_t thread;
+	long ncpus;
+	unsigned i;
+
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	num_workers = ncpus > 0 && ncpus < max_threads ? ncpus : max_threads;
+	if (num_workers == 0)
+		num_workers = 1;
+	max_inflight = num_workers * 2;
+
+	for (i = 0; i < num_workers; i++) {
+		if (pthread_create(&thread, NULL, compress_worker, NULL) != 0) {
+			wire_log(WLOG_ERR, "Failed to start compression worker %u: %m", i);
+			break;
+		}
+		pthread_detach(thread);
+	}
+
+	if (i == 0) {
+		num_workers = 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+int compress_thread_init(void)
+{
+	if (num_workers == 0)
+		return -1;
+
+	done_fd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+	if (done_fd < 0) {
+		wire_log(WLOG_ERR, "Failed to create compression eventfd: %m");
+		return -1;
+	}
+
+	wire_pool_init(&writer_pool, NULL, COMPRESS_MAX_SESSIONS, COMPRESS_WRITER_STACK);
+	wire_init(&completion_wire, "compress completion", compress_completion, NULL, WIRE_STACK_ALLOC(4096));
+	return 0;
+}
+
+/* Writes the finished members of a session in order, exits once the session
+ * is finished and everything was written.
+ */
+static void compress_writer(void *arg)
+{
+	compress_t *c = arg;
+	compress_job_t *job;
+	size_t nsent;
+	int ret;
+
+	while (1) {
+		wire_wait_reset(&c->wait);
+
+		job = c->head;
+		if (job && job->done) {
+			c->head = job->next;
+			if (!c->head)
+				c->tail = NULL;
+			c->inflight--;
+
+			if (job->failed) {
+				wire_log(WLOG_ERR, "Compression failed");
+				c->failed = 1;
+			} else if (!c->failed) {
+				ret = wire_net_write(c->net, job->out, job->out_len, &nsent);
+				if (ret < 0 || nsent != job->out_len)
+					c->failed = 1;
+			}
+
+			free(job->out);
+			free(job);
+			wire_wait_resume(&c->space_wait);
+			continue;
+		}
+
+		if (!job && c->finishing)
+			break;
+
+		wire_wait_single(&c->wait);
+	}
+
+	wire_wait_resume(&c->done_wait);
+}
+
+int compress_init(compress_t *c, wire_net_t *net, int level)
+{
+	memset(c, 0, sizeof(*c));
+	c->net = net;
+	c->level = level;
+	wire_wait_init(&c->wait);
+	wire_wait_init(&c->space_wait);
+	wire_wait_init(&c->done_wait);
+
+	if (done_fd < 0) {
+		wire_log(WLOG_ERR, "Compression workers are not running");
+		return -1;
+	}
+
+	if (!wire_pool_alloc(&writer_pool, "compress writer", compress_writer, c)) {
+		wire_log(WLOG_ERR, "Too many compressed sessions");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void compress_submit(compress_t *c)
+{
+	compress_job_t *job;
+
+	if (c->block_len == 0)
+		return;
+
+	// Don't let a fast producer run away from the workers and the socket
+	while (c->inflight >= max_inflight) {
+		wire_wait_reset(&c->space_wait);
+		wire_wait_single(&c->space_wait);
+	}
+
+	job = calloc(1, sizeof(*job));
+	if (!job) {
+		wire_log(WLOG_ERR, "Out of memory for a compression job");
+		c->failed = 1;
+		c->block_len = 0;
+		return;
+	}
+
+	job->c = c;
+	job->done_list = &done_list;
+	job->done_fd = done_fd;
+	job->level = c->level;
+	job->in = c->block;
+	job->in_len = c->block_len;
+	c->block = NULL;
+	c->block_len = 0;
+
+	if (c->tail)
+		c->tail->next = job;
+	else
+		c->head = job;
+	c->tail = job;
+	c->inflight++;
+
+	pthread_mutex_lock(&work_lock);
+	if (work_tail)
+		work_tail->work_next = job;
+	else
+		work_head = job;
+	work_tail = job;
+	pthread_cond_signal(&work_cond);
+	pthread_mutex_unlock(&work_lock);
+}
+
+int compress_write(compress_t *c, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+
+	while (len > 0) {
+		size_t space;
+
+		if (!c->block) {
+			c->block = malloc(COMPRESS_BLOCK_SIZE);
+			if (!c->block) {
+				wire_log(WLOG_ERR, "Out of memory for a compression block");
+				c->failed = 1;
+				return -1;
+			}
+		}
+
+		if (c->block_len == 0)
+			c->block_msec = compress_now_msec();
+
+		space = COMPRESS_BLOCK_SIZE - c->block_len;
+		if (space > len)
+			space = len;
+		memcpy(c->block + c->block_len, p, space);
+		c->block_len += space;
+		p += space;
+		len -= space;
+
+		if (c->block_len == COMPRESS_BLOCK_SIZE)
+			compress_submit(c);
+	}
+
+	// Slow writers still get their data out in a bounded time
+	if (compress_pending_msec(c) >= COMPRESS_BLOCK_MAX_MSEC)
+		compress_submit(c);
+
+	return c->failed ? -1 : 0;
+}
+
+unsigned compress_pending_msec(compress_t *c)
+{
+	if (c->block_len == 0)
+		return 0;
+	return compress_now_msec() - c->block_msec;
+}
+
+int compress_flush(compress_t *c)
+{
+	compress_submit(c);
+	return c->failed ? -1 : 0;
+}
+
+int compress_finish(compress_t *c)
+{
+	compress_submit(c);
+
+	c->finishing = 1;
+	wire_wait_resume(&c->wait);
+	wire_wait_single(&c->done_wait);
+
+	free(c->block);
+	c->block = NULL;
+	return c->failed ? -1 : 0;
+}
+
+int decompress_init(decompress_t *d, wire_net_t *net)
+{
+	int ret;
+
+	memset(d, 0, sizeof(*d));
+	d->net = net;
+
+	d->in = malloc(COMPRESS_BUF_SIZE);
+	if (!d->in)
+		return -1;
+
+	ret = inflateInit2(&d->strm, GZIP_WINDOW_BITS);
+	if (ret != Z_OK) {
+		wire_log(WLOG_ERR, "Failed to initialize decompression: %d", ret);
+		free(d->in);
+		d->in = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+int decompress_read_full(decompress_t *d, void *buf, size_t len, size_t *nrcvd)
+{
+	size_t nread;
+	int ret;
+
+	d->strm.next_out = buf;
+	d->strm.avail_out = len;
+
+	while (d->strm.avail_out > 0) {
+		if (d->strm.avail_in == 0) {
+			if (d->eof)
+				break;
+
+			ret = wire_net_read_any(d->net, d->in, COMPRESS_BUF_SIZE, &nread);
+			if (ret < 0 || nread == 0) {
+				d->eof = 1;
+				break;
+			}
+
+			d->strm.next_in = d->in;
+			d->strm.avail_in = nread;
+		}
+
+		ret = inflate(&d->strm, Z_NO_FLUSH);
+		if (ret == Z_STREAM_END) {
+			// Another gzip member may follow
+			inflateReset(&d->strm);
+		} else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+			wire_log(WLOG_ERR, "Decompression failed: %d", ret);
+			d->eof = 1;
+			break;
+		}
+	}
+
+	*nrcvd = len - d->strm.avail_out;
+	if (*nrcvd != len) {
+		errno = ENODATA;
+		return -1;
+	}
+	return 0;
+}
+
+void decompress_end(decompress_t *d)
+{
+	inflateEnd(&d->strm);
+	free(d->in);
+	d->in = NULL;
+}
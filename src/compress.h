@@ -0,0 +1,57 @@
+#ifndef DOCKET_COMPRESS_H
+#define DOCKET_COMPRESS_H
+
+#include "wire_net.h"
+#include "wire_wait.h"
+
+#include <stdint.h>
+#include <zlib.h>
+
+/* Streaming gzip over a wire_net socket. The data is cut into blocks that are
+ * compressed as independent gzip members by a pool of worker threads, a writer
+ * wire sends the finished members in order so the wire thread never does the
+ * heavy lifting. The reading side handles the multiple members transparently.
+ */
+typedef struct compress_job compress_job_t;
+
+typedef struct compress {
+	wire_net_t *net;
+	int level;
+	int failed;
+	int finishing;
+	unsigned char *block;
+	size_t block_len;
+	uint64_t block_msec;
+	compress_job_t *head;
+	compress_job_t *tail;
+	unsigned inflight;
+	wire_wait_t wait;
+	wire_wait_t space_wait;
+	wire_wait_t done_wait;
+} compress_t;
+
+typedef struct decompress {
+	z_stream strm;
+	wire_net_t *net;
+	unsigned char *in;
+	int eof;
+} decompress_t;
+
+/* The workers are shared by the whole process, every wire thread that
+ * compresses then sets up the completion of its own sessions.
+ */
+int compress_workers_init(unsigned max_threads);
+int compress_thread_init(void);
+
+int compress_init(compress_t *c, wire_net_t *net, int level);
+int compress_write(compress_t *c, const void *buf, size_t len);
+int compress_flush(compress_t *c);
+// How long the data in the current partial block has been waiting
+unsigned compress_pending_msec(compress_t *c);
+int compress_finish(compress_t *c);
+
+int decompress_init(decompress_t *d, wire_net_t *net);
+int decompress_read_full(decompress_t *d, void *buf, size_t len, size_t *nrcvd);
+void decompress_end(decompress_t *d);
+
+#endif
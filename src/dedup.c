@@ -0,0 +1,89 @@
+#include "dedup.h"
+#include "hash.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define DEDUP_INIT_BUCKETS 4096
+
+// The first copy of every content is kept to compare against, up to this much
+#define DEDUP_MEM_MAX (256*1024*1024)
+
+typedef struct dedup_entry {
+	struct dedup_entry *next;
+	uint64_t hash;
+	unsigned size;
+	char *data;
+	char name[];
+} dedup_entry_t;
+
+static dedup_entry_t **buckets;
+static unsigned num_buckets;
+static unsigned count;
+static size_t mem_used;
+
+static void dedup_grow(void)
+{
+	dedup_entry_t **new_buckets;
+	dedup_entry_t *e;
+	dedup_entry_t *next;
+	unsigned new_num = num_buckets ? num_buckets * 2 : DEDUP_INIT_BUCKETS;
+	unsigned i;
+
+	new_buckets = calloc(new_num, sizeof(*new_buckets));
+	if (!new_buckets)
+		return;
+
+	for (i = 0; i < num_buckets; i++) {
+		for (e = buckets[i]; e; e = next) {
+			next = e->next;
+			e->next = new_buckets[e->hash % new_num];
+			new_buckets[e->hash % new_num] = e;
+		}
+	}
+
+	free(buckets);
+	buckets = new_buckets;
+	num_buckets = new_num;
+}
+
+const char *dedup_find_or_add(const void *data, unsigned size, const char *name)
+{
+	uint64_t hash = hash_buf(HASH_INIT, data, size);
+	dedup_entry_t *e;
+
+	if (count >= num_buckets * 2)
+		dedup_grow();
+	if (!buckets)
+		return NULL;
+
+	// The hash is not collision proof, only the same bytes make a link
+	for (e = buckets[hash % num_buckets]; e; e = e->next) {
+		if (e->hash == hash && e->size == size && memcmp(e->data, data, size) == 0)
+			return e->name;
+	}
+
+	// Past the cap new contents are written out but not remembered
+	if (mem_used + size > DEDUP_MEM_MAX)
+		return NULL;
+
+	e = malloc(sizeof(*e) + strlen(name) + 1);
+	if (!e)
+		return NULL;
+
+	e->data = malloc(size);
+	if (!e->data) {
+		free(e);
+		return NULL;
+	}
+
+	e->hash = hash;
+	e->size = size;
+	memcpy(e->data, data, size);
+	strcpy(e->name, name);
+	mem_used += size;
+	e->next = buckets[hash % num_buckets];
+	buckets[hash % num_buckets] = e;
+	count++;
+	return NULL;
+}
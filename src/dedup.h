@@ -0,0 +1,12 @@
+#ifndef DOCKET_DEDUP_H
+#define DOCKET_DEDUP_H
+
+#include <stdint.h>
+
+/* Remembers the content of the entries written to the output archive. Returns
+ * the name of an earlier entry with the same bytes, or NULL after adding this
+ * one as the first with its content.
+ */
+const char *dedup_find_or_add(const void *data, unsigned size, const char *name);
+
+#endif
@@ -0,0 +1,447 @@
+#include "dev_map.h"
+#include "hash.h"
+
+#include "wire.h"
+#include "wire_fd.h"
+#include "wire_stack.h"
+#include "wire_log.h"
+#include "macros.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/inotify.h>
+
+#define DEV_ROOT "/dev"
+#define DEV_MAP_BUCKETS 1024
+#define DEV_WATCH_BUCKETS 64
+#define DEV_NAME_MAX 128
+
+// Without inotify the map is rebuilt every so often instead
+#define DEV_RESCAN_MSEC (10*1000)
+
+#define DEV_WATCH_MASK (IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO|IN_ATTRIB|IN_ONLYDIR)
+
+typedef struct dev_node {
+	struct dev_node *num_next;
+	struct dev_node *name_next;
+	unsigned major;
+	unsigned minor;
+	int is_blk;
+	time_t mtime;
+	char name[DEV_NAME_MAX];
+} dev_node_t;
+
+typedef struct dev_map {
+	dev_node_t *by_num[DEV_MAP_BUCKETS];
+	dev_node_t *by_name[DEV_MAP_BUCKETS];
+	unsigned count;
+} dev_map_t;
+
+typedef struct dev_watch {
+	struct dev_watch *next;
+	int wd;
+	char path[DEV_NAME_MAX];
+} dev_watch_t;
+
+// Lookups come from all the wire threads, changes only from the watcher
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static dev_map_t *map;
+
+// Only used by the watcher after init
+static int inotify_fd = -1;
+static dev_t root_dev;
+static dev_watch_t *watches[DEV_WATCH_BUCKETS];
+static wire_t watch_wire;
+
+static unsigned num_bucket(unsigned major, unsigned minor, int is_blk)
+{
+	unsigned key[3] = { major, minor, is_blk };
+
+	return hash_buf(HASH_INIT, key, sizeof(key)) % DEV_MAP_BUCKETS;
+}
+
+static unsigned name_bucket(const char *name)
+{
+	return hash_buf(HASH_INIT, name, strlen(name)) % DEV_MAP_BUCKETS;
+}
+
+static void dev_map_unlink(dev_map_t *m, dev_node_t *n)
+{
+	dev_node_t **pn;
+
+	for (pn = &m->by_num[num_bucket(n->major, n->minor, n->is_blk)]; *pn; pn = &(*pn)->num_next) {
+		if (*pn == n) {
+			*pn = n->num_next;
+			break;
+		}
+	}
+
+	for (pn = &m->by_name[name_bucket(n->name)]; *pn; pn = &(*pn)->name_next) {
+		if (*pn == n) {
+			*pn = n->name_next;
+			break;
+		}
+	}
+
+	m->count--;
+	free(n);
+}
+
+static dev_node_t *dev_map_lookup_name(dev_map_t *m, const char *name)
+{
+	dev_node_t *n;
+
+	for (n = m->by_name[name_bucket(name)]; n; n = n->name_next) {
+		if (strcmp(n->name, name) == 0)
+			return n;
+	}
+
+	return NULL;
+}
+
+static void dev_map_remove(dev_map_t *m, const char *name)
+{
+	dev_node_t *n;
+
+	pthread_mutex_lock(&lock);
+	n = dev_map_lookup_name(m, name);
+	if (n)
+		dev_map_unlink(m, n);
+	pthread_mutex_unlock(&lock);
+}
+
+// A directory went away or was moved, drop everything under it
+static void dev_map_remove_dir(dev_map_t *m, const char *dir)
+{
+	size_t dir_len = strlen(dir);
+	dev_node_t *n;
+	dev_node_t *next;
+	unsigned i;
+
+	pthread_mutex_lock(&lock);
+	for (i = 0; i < DEV_MAP_BUCKETS; i++) {
+		for (n = m->by_name[i]; n; n = next) {
+			next = n->name_next;
+			if (strncmp(n->name, dir, dir_len) == 0 && n->name[dir_len] == '/')
+				dev_map_unlink(m, n);
+		}
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+static void dev_map_add(dev_map_t *m, const char *name, const struct stat *st)
+{
+	dev_node_t *n;
+	unsigned bucket;
+
+	n = malloc(sizeof(*n));
+	if (!n) {
+		wire_log(WLOG_ERR, "Out of memory for device node %s", name);
+		return;
+	}
+
+	n->major = major(st->st_rdev);
+	n->minor = minor(st->st_rdev);
+	n->is_blk = S_ISBLK(st->st_mode);
+	n->mtime = st->st_mtime;
+	snprintf(n->name, sizeof(n->name), "%s", name);
+
+	pthread_mutex_lock(&lock);
+	dev_node_t *old = dev_map_lookup_name(m, n->name);
+	if (old)
+		dev_map_unlink(m, old);
+
+	bucket = num_bucket(n->major, n->minor, n->is_blk);
+	n->num_next = m->by_num[bucket];
+	m->by_num[bucket] = n;
+
+	bucket = name_bucket(n->name);
+	n->name_next = m->by_name[bucket];
+	m->by_name[bucket] = n;
+	m->count++;
+	pthread_mutex_unlock(&lock);
+}
+
+static void dev_map_free(dev_map_t *m)
+{
+	dev_node_t *n;
+	dev_node_t *next;
+	unsigned i;
+
+	if (!m)
+		return;
+
+	for (i = 0; i < DEV_MAP_BUCKETS; i++) {
+		for (n = m->by_name[i]; n; n = next) {
+			next = n->name_next;
+			free(n);
+		}
+	}
+
+	free(m);
+}
+
+static dev_watch_t *dev_watch_find(int wd)
+{
+	dev_watch_t *w;
+
+	for (w = watches[wd % DEV_WATCH_BUCKETS]; w; w = w->next) {
+		if (w->wd == wd)
+			return w;
+	}
+
+	return NULL;
+}
+
+static void dev_watch_add(const char *path)
+{
+	dev_watch_t *w;
+	int wd;
+
+	if (inotify_fd < 0)
+		return;
+
+	wd = inotify_add_watch(inotify_fd, path, DEV_WATCH_MASK);
+	if (wd < 0) {
+		wire_log(WLOG_WARNING, "Failed to watch %s for device changes: %m", path);
+		return;
+	}
+
+	// Watching a directory again gives back the same descriptor
+	w = dev_watch_find(wd);
+	if (!w) {
+		w = malloc(sizeof(*w));
+		if (!w) {
+			inotify_rm_watch(inotify_fd, wd);
+			return;
+		}
+		w->wd = wd;
+		w->next = watches[wd % DEV_WATCH_BUCKETS];
+		watches[wd % DEV_WATCH_BUCKETS] = w;
+	}
+
+	snprintf(w->path, sizeof(w->path), "%s", path);
+}
+
+static void dev_watch_remove(dev_watch_t *w)
+{
+	dev_watch_t **pw;
+
+	for (pw = &watches[w->wd % DEV_WATCH_BUCKETS]; *pw; pw = &(*pw)->next) {
+		if (*pw == w) {
+			*pw = w->next;
+			free(w);
+			return;
+		}
+	}
+}
+
+/* Walk a directory of /dev into the map and watch it. /dev lives in memory so
+ * the walk doesn't go through the I/O threads.
+ */
+static void dev_map_scan(dev_map_t *m, const char *path)
+{
+	char child[DEV_NAME_MAX];
+	struct dirent *de;
+	struct stat st;
+	DIR *dir;
+
+	dir = opendir(path);
+	if (!dir)
+		return;
+
+	dev_watch_add(path);
+
+	while ((de = readdir(dir)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+
+		if (snprintf(child, sizeof(child), "%s/%s", path, de->d_name) >= sizeof(child))
+			continue;
+
+		if (fstatat(dirfd(dir), de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+			continue;
+
+		if (S_ISDIR(st.st_mode)) {
+			// Stay out of the mounts under /dev like /dev/pts and /dev/shm
+			if (st.st_dev == root_dev)
+				dev_map_scan(m, child);
+		} else if (S_ISBLK(st.st_mode) || S_ISCHR(st.st_mode)) {
+			dev_map_add(m, child, &st);
+		}
+	}
+
+	closedir(dir);
+}
+
+static void dev_map_rescan(void)
+{
+	dev_map_t *new_map;
+	dev_map_t *old_map;
+
+	new_map = calloc(1, sizeof(*new_map));
+	if (!new_map) {
+		wire_log(WLOG_ERR, "Out of memory to rebuild the device map");
+		return;
+	}
+
+	dev_map_scan(new_map, DEV_ROOT);
+
+	pthread_mutex_lock(&lock);
+	old_map = map;
+	map = new_map;
+	pthread_mutex_unlock(&lock);
+
+	dev_map_free(old_map);
+}
+
+static void dev_map_event(const struct inotify_event *ev)
+{
+	char path[DEV_NAME_MAX];
+	dev_watch_t *w;
+	struct stat st;
+
+	if (ev->mask & IN_Q_OVERFLOW) {
+		wire_log(WLOG_INFO, "Device events overflowed, rebuilding the device map");
+		dev_map_rescan();
+		return;
+	}
+
+	w = dev_watch_find(ev->wd);
+	if (!w)
+		return;
+
+	if (ev->mask & IN_IGNORED) {
+		dev_watch_remove(w);
+		return;
+	}
+
+	if (ev->len == 0)
+		return;
+
+	if (snprintf(path, sizeof(path), "%s/%s", w->path, ev->name) >= sizeof(path))
+		return;
+
+	if (ev->mask & (IN_DELETE|IN_MOVED_FROM)) {
+		if (ev->mask & IN_ISDIR)
+			dev_map_remove_dir(map, path);
+		else
+			dev_map_remove(map, path);
+		return;
+	}
+
+	if (lstat(path, &st) < 0)
+		return;
+
+	if (S_ISDIR(st.st_mode)) {
+		if ((ev->mask & (IN_CREATE|IN_MOVED_TO)) && st.st_dev == root_dev)
+			dev_map_scan(map, path);
+	} else if (S_ISBLK(st.st_mode) || S_ISCHR(st.st_mode)) {
+		dev_map_add(map, path, &st);
+	} else {
+		dev_map_remove(map, path);
+	}
+}
+
+static void dev_map_watch(void *arg)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	wire_fd_state_t fd_state;
+	ssize_t len;
+	char *p;
+
+	UNUSED(arg);
+
+	if (inotify_fd < 0) {
+		while (1) {
+			wire_fd_wait_msec(DEV_RESCAN_MSEC);
+			dev_map_rescan();
+		}
+	}
+
+	wire_fd_mode_init(&fd_state, inotify_fd);
+	wire_fd_mode_read(&fd_state);
+
+	while (1) {
+		wire_fd_wait(&fd_state);
+
+		len = read(inotify_fd, buf, sizeof(buf));
+		if (len < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			wire_log(WLOG_ERR, "Failed to read device events: %m");
+			break;
+		}
+
+		for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *)p;
+			dev_map_event(ev);
+		}
+	}
+
+	wire_fd_mode_none(&fd_state);
+}
+
+int dev_map_init(void)
+{
+	struct stat st;
+
+	if (stat(DEV_ROOT, &st) < 0) {
+		wire_log(WLOG_ERR, "Failed to stat " DEV_ROOT ": %m");
+		return -1;
+	}
+	root_dev = st.st_dev;
+
+	inotify_fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+	if (inotify_fd < 0)
+		wire_log(WLOG_WARNING, "No inotify for " DEV_ROOT " (%m), the device map will be rebuilt periodically");
+
+	map = calloc(1, sizeof(*map));
+	if (!map) {
+		wire_log(WLOG_ERR, "Out of memory for the device map");
+		return -1;
+	}
+
+	dev_map_scan(map, DEV_ROOT);
+	wire_log(WLOG_INFO, "Device map has %u nodes", map->count);
+	return 0;
+}
+
+void dev_map_watch_start(void)
+{
+	wire_init(&watch_wire, "dev map watch", dev_map_watch, NULL, WIRE_STACK_ALLOC(32*1024));
+}
+
+int dev_map_find(unsigned major, unsigned minor, int is_blk, char *path, size_t path_size)
+{
+	dev_node_t *found = NULL;
+	dev_node_t *n;
+	int ret = -1;
+
+	pthread_mutex_lock(&lock);
+	if (map) {
+		for (n = map->by_num[num_bucket(major, minor, is_blk)]; n; n = n->num_next) {
+			if (n->major != major || n->minor != minor || n->is_blk != is_blk)
+				continue;
+			if (!found || n->mtime > found->mtime)
+				found = n;
+		}
+	}
+
+	if (found) {
+		snprintf(path, path_size, "%s", found->name);
+		ret = 0;
+	}
+	pthread_mutex_unlock(&lock);
+
+	return ret;
+}
@@ -0,0 +1,20 @@
+#ifndef DOCKET_DEV_MAP_H
+#define DOCKET_DEV_MAP_H
+
+#include <stddef.h>
+
+/* The device nodes in /dev indexed by their device number. The map is built
+ * once at startup and then kept up to date from inotify events on /dev, it is
+ * shared by all the wire threads.
+ */
+int dev_map_init(void);
+
+// Run the watcher on the current wire thread, only one thread should do it
+void dev_map_watch_start(void);
+
+/* Find the node of a device, the newest one when there are several. Returns
+ * 0 and fills path or -1 if there is no such node.
+ */
+int dev_map_find(unsigned major, unsigned minor, int is_blk, char *path, size_t path_size);
+
+#endif
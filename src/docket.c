@@ -1,10 +1,14 @@
 #include "docket.h"
 #include "tar.h"
+#include "compress.h"
+#include "dedup.h"
+#include "spool.h"
 
 #include "wire.h"
 #include "wire_pool.h"
 #include "wire_io.h"
-#include "wire_lock.h"
+#include "wire_wait.h"
+#include "macros.h"
 #include "wire_net.h"
 #include "wire_log.h"
 #include "wire_stack.h"
@@ -13,12 +17,116 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <memory.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/resource.h>
+#include <time.h>
 
 static wire_thread_t wire_main;
 static wire_pool_t docket_pool;
-static wire_lock_t out_lock;
 static wire_net_t out_net;
 static wire_t stdin_wire;
+static wire_t writer_wire;
+static wire_t tuner_wire;
+static int opt_compress;
+static int opt_dedup = 1;
+static int opt_conn_max = 256;
+static int opt_deadline;
+static int opt_straggler;
+static int opt_retries = 3;
+
+// Entries up to this size are kept in memory so they can be deduplicated
+#define DEDUP_MAX_SIZE (1024*1024)
+
+// Memory for staged entries, beyond that entries are spooled to disk
+#define STAGE_MEM_MAX (256*1024*1024)
+#define STAGE_ENTRY_MEM_MAX (512 + DEDUP_MAX_SIZE)
+
+// Concurrency starts low and adapts to the output throughput
+#define CONN_MIN 16
+#define CONN_START 32
+
+/* Once most nodes are done the rest are stragglers, with -S they get that
+ * many times the average collection time of the others and are then cut short.
+ */
+#define STRAGGLER_QUORUM 90
+#define STRAGGLER_MIN_MSEC (30*1000)
+
+// The timeout for a single read from a node
+#define READ_TIMEOUT_MSEC (120*1000)
+
+/* Connections never write to the output directly, every tar entry is staged
+ * until it is complete and then queued for the writer wire. This way a slow
+ * connection never holds back the others. Small entries are kept in memory,
+ * large ones are spooled to a temporary file.
+ */
+typedef struct docket_entry {
+	struct docket_entry *next;
+	const char *ip;
+	uint32_t stream;
+	int failed;
+	char *data;
+	size_t len;
+	size_t size;
+	int spool_fd;
+	off_t spool_len;
+	size_t meta_len;
+	uint64_t data_len;
+	size_t hdr_len;
+	char hdr[TAR_HEADER_MAX];
+} docket_entry_t;
+
+/* A node being collected, kept in the active list so that the tuner can cut
+ * it short when it runs past its deadline.
+ */
+typedef struct docket_node {
+	struct docket_node *next;
+	struct docket_node **pprev;
+	const char *ip;
+	wire_net_t *net;
+	uint64_t start;
+	uint64_t connected;
+	uint64_t deadline;
+	// Why the node was cut short, NULL while it wasn't
+	const char *cut_short;
+} docket_node_t;
+
+typedef struct docket_conn {
+	wire_net_t *net;
+	docket_node_t *node;
+	const char *ip;
+	int compressed;
+	decompress_t decompress;
+	docket_entry_t *pending;
+} docket_conn_t;
+
+static docket_entry_t *ready_head;
+static docket_entry_t *ready_tail;
+static wire_wait_t writer_wait;
+static size_t staged_mem;
+static int collectors;
+static int stdin_done;
+static const char *spool_dir;
+
+static docket_node_t *nodes_active;
+static wire_wait_t slot_wait;
+static int slot_waiting;
+static int conn_limit = CONN_START;
+static int conn_active;
+static int nodes_started;
+static int nodes_done;
+static uint64_t nodes_done_msec;
+static uint64_t out_bytes;
+static uint64_t ttfb_avg;
+static uint64_t ttfb_min;
+
+static uint64_t now_msec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
 static int docket_send_collection(wire_net_t *net, const char *ip, const char *name, const char *listfile)
 {
@@ -29,7 +137,7 @@ static int docket_send_collection(wire_net_t *net, const char *ip, const char *n
 	int fd;
 	char buf[48*1024];
 
-	ret = snprintf(buf, sizeof(buf), "PREFIX|%s\n", name);
+	ret = snprintf(buf, sizeof(buf), "PROTO|%d\n%sPREFIX|%s\n", DOCKET_PROTO_V2, opt_compress ? "COMPRESS|gzip\n" : "", name);
 	nrcvd = ret;
 	ret = wire_net_write(net, buf, nrcvd, &nsent);
 	if (ret < 0 || nrcvd != nsent) {
@@ -69,91 +177,652 @@ static int docket_send_collection(wire_net_t *net, const char *ip, const char *n
 	return res;
 }
 
-static int docket_collect_tar(wire_net_t *net, const char *ip)
+static void out_write(const void *buf, size_t len)
 {
-	int ret;
-	int i;
-	size_t nrcvd;
 	size_t nsent;
-	char buf[48*1024];
-	unsigned file_len = 0;
-	struct tar *tar;
+	int ret;
+
+	ret = wire_net_write(&out_net, buf, len, &nsent);
+	if (ret < 0 || nsent != len) {
+		wire_log(WLOG_FATAL, "Error writing tar data, it will get mixed up, aborting.");
+		wire_fd_wait_msec(100);
+		abort();
+	}
+	out_bytes += len;
+}
+
+static int conn_read_full(docket_conn_t *conn, void *buf, size_t len, size_t *nrcvd)
+{
+	if (conn->compressed)
+		return decompress_read_full(&conn->decompress, buf, len, nrcvd);
+	return wire_net_read_full(conn->net, buf, len, nrcvd);
+}
+
+static docket_entry_t *entry_new(const char *ip, uint32_t stream)
+{
+	docket_entry_t *e;
+
+	e = calloc(1, sizeof(*e));
+	if (!e) {
+		wire_log(WLOG_FATAL, "Out of memory buffering data from %s, aborting.", ip);
+		wire_fd_wait_msec(100);
+		abort();
+	}
+
+	e->ip = ip;
+	e->stream = stream;
+	e->spool_fd = -1;
+	return e;
+}
+
+static void entry_free(docket_entry_t *e)
+{
+	if (e->data) {
+		free(e->data);
+		staged_mem -= e->size;
+	}
+	if (e->spool_fd >= 0)
+		wio_close(e->spool_fd);
+	free(e);
+}
+
+static uint64_t entry_expected_len(docket_entry_t *e)
+{
+	return e->meta_len + tar_padded(e->data_len);
+}
+
+// The ustar header, after the PAX header if there is one
+static const char *entry_name(docket_entry_t *e)
+{
+	return e->meta_len ? e->hdr + e->meta_len - 512 : e->hdr;
+}
 
-	wire_timeout_reset(&net->tout, 120*1000);
+static uint64_t entry_len(docket_entry_t *e)
+{
+	return e->spool_fd >= 0 ? e->spool_len : e->len;
+}
+
+static int entry_spill(docket_entry_t *e)
+{
+	e->spool_fd = spool_open(spool_dir);
+	if (e->spool_fd < 0) {
+		wire_log(WLOG_ERR, "Failed to create a spool file in %s: %m", spool_dir);
+		return -1;
+	}
 
-	ret = wire_net_read_full(net, buf, 512, &nrcvd);
-	if (ret < 0 || nrcvd != 512) {
-		wire_log(WLOG_ERR, "Error receiving tar header ret=%d errno=%d (%m)", ret, errno);
+	if (spool_write(e->spool_fd, e->data, e->len, 0) < 0) {
+		wire_log(WLOG_ERR, "Failed to write to the spool file: %m");
 		return -1;
 	}
 
-	tar = (struct tar *)buf;
+	e->spool_len = e->len;
+	free(e->data);
+	staged_mem -= e->size;
+	e->data = NULL;
+	e->len = 0;
+	e->size = 0;
+	return 0;
+}
+
+static int entry_grow(docket_entry_t *e, size_t len)
+{
+	size_t new_size = e->size ? e->size * 2 : 4096;
+	char *data;
+
+	while (new_size < e->len + len)
+		new_size *= 2;
+
+	data = realloc(e->data, new_size);
+	if (!data)
+		return -1;
+
+	staged_mem += new_size - e->size;
+	e->data = data;
+	e->size = new_size;
+	return 0;
+}
+
+static void entry_append(docket_entry_t *e, const char *buf, size_t len)
+{
+	if (e->failed || len == 0)
+		return;
+
+	if (e->meta_len == 0) {
+		size_t hdr_len = sizeof(e->hdr) - e->hdr_len;
+		ssize_t ret;
 
-	for (i = 0; i < sizeof(tar->filesize) && tar->filesize[i]; i++) {
-		unsigned digit = tar->filesize[i] - '0';
-		file_len *= 8;
-		file_len += digit;
+		if (hdr_len > len)
+			hdr_len = len;
+		memcpy(e->hdr + e->hdr_len, buf, hdr_len);
+		e->hdr_len += hdr_len;
+
+		ret = tar_entry_header_len(e->hdr, e->hdr_len, &e->data_len);
+		if (ret > 0) {
+			e->meta_len = ret;
+		} else if (ret < 0 || e->hdr_len == sizeof(e->hdr)) {
+			wire_log(WLOG_ERR, "Invalid tar header from %s", e->ip);
+			e->failed = 1;
+			return;
+		}
 	}
 
-	wire_lock_take(&out_lock);
+	if (e->spool_fd < 0 && e->len + len > e->size) {
+		if (e->len + len > STAGE_ENTRY_MEM_MAX || staged_mem + len > STAGE_MEM_MAX || entry_grow(e, len) < 0) {
+			if (entry_spill(e) < 0) {
+				e->failed = 1;
+				return;
+			}
+		}
+	}
 
-	wire_log(WLOG_DEBUG, "tar header for %s file size %s decimal %u", tar->filename, tar->filesize, file_len);
+	if (e->spool_fd >= 0) {
+		if (spool_write(e->spool_fd, buf, len, e->spool_len) < 0) {
+			wire_log(WLOG_ERR, "Failed to write to the spool file: %m");
+			e->failed = 1;
+			return;
+		}
+		e->spool_len += len;
+	} else {
+		memcpy(e->data + e->len, buf, len);
+		e->len += len;
+	}
+}
 
-	if (file_len % 512 != 0)
-		file_len += 512 - (file_len % 512);
+static void entry_ready(docket_entry_t *e)
+{
+	if (e->failed) {
+		wire_log(WLOG_ERR, "Dropping entry %.100s from %s since it couldn't be staged", entry_name(e), e->ip);
+		entry_free(e);
+		return;
+	}
 
-	wire_log(WLOG_DEBUG, "rounded tar file size %u", file_len);
+	e->next = NULL;
+	if (ready_tail)
+		ready_tail->next = e;
+	else
+		ready_head = e;
+	ready_tail = e;
 
-	ret = wire_net_write(&out_net, buf, 512, &nsent);
-	if (ret < 0 || nsent != 512) {
-		wire_log(WLOG_FATAL, "Error writing tar data, it will get mixed up, aborting.");
-		wire_fd_wait_msec(100);
-		abort();
+	wire_wait_resume(&writer_wait);
+}
+
+/* The connection broke in the middle of the entry, fill it up with zeroes so
+ * that whatever we got is still usable.
+ */
+static void entry_truncated(docket_entry_t *e)
+{
+	char zeros[4096];
+	uint64_t expected_len;
+
+	if (e->meta_len == 0) {
+		wire_log(WLOG_ERR, "Dropping entry with incomplete header from %s", e->ip);
+		entry_free(e);
+		return;
 	}
 
-	while (file_len > 0) {
-		wire_timeout_reset(&net->tout, 120*1000);
+	wire_log(WLOG_ERR, "Entry %.100s from %s is truncated, filling with zeroes", entry_name(e), e->ip);
+
+	expected_len = entry_expected_len(e);
+	memset(zeros, 0, sizeof(zeros));
+	while (!e->failed && entry_len(e) < expected_len) {
+		uint64_t len = expected_len - entry_len(e);
+		if (len > sizeof(zeros))
+			len = sizeof(zeros);
+		entry_append(e, zeros, len);
+	}
+
+	entry_ready(e);
+}
+
+/* Write a complete tar entry to the output. If another entry, typically from
+ * another node, already had the same content a hard link to it is written
+ * instead of the data.
+ */
+static void out_write_entry(docket_entry_t *e)
+{
+	const char *data = e->data;
+	size_t len = e->len;
+	const struct tar *hdr = (const struct tar *)data;
+	uint64_t file_len;
+	const char *target;
+	char name[sizeof(hdr->filename) + 1];
+	struct tar link;
+
+	// Entries with a PAX header keep their data, the link would lose it
+	if (!opt_dedup || e->meta_len != sizeof(*hdr) || hdr->filetype != TAR_NORMAL)
+		goto Write;
+
+	file_len = e->data_len;
+	if (file_len == 0 || file_len > len - sizeof(*hdr))
+		goto Write;
+
+	memcpy(name, hdr->filename, sizeof(hdr->filename));
+	name[sizeof(hdr->filename)] = 0;
+
+	target = dedup_find_or_add(data + sizeof(*hdr), file_len, name);
+	if (!target)
+		goto Write;
+
+	memcpy(&link, hdr, sizeof(link));
+	if (tar_set_hardlink(&link, target) < 0)
+		goto Write;
+
+	wire_log(WLOG_DEBUG, "Entry %s is the same as %s, writing a link", name, target);
+	out_write(&link, sizeof(link));
+	return;
+
+Write:
+	out_write(data, len);
+}
+
+static void out_write_spooled(docket_entry_t *e)
+{
+	char buf[32*1024];
+	off_t offset = 0;
+	ssize_t ret;
+
+	while (offset < e->spool_len) {
+		size_t toread = e->spool_len - offset > sizeof(buf) ? sizeof(buf) : e->spool_len - offset;
 
-		size_t toread = file_len > sizeof(buf) ? sizeof(buf) : file_len;
-		ret = wire_net_read_full(net, buf, toread, &nrcvd);
-		if ((ret < 0 && errno != ENODATA) || nrcvd != toread) {
-			// TODO: Can improve things by filling up with zeroes as needed, at least other sources will succeed to be collected
-			wire_log(WLOG_FATAL, "Error reading buffer data, it will get mixed up, aborting. ret=%d nrcvd=%u toread=%u errno=%d (%m)", ret, nrcvd, toread, errno);
+		ret = wio_pread(e->spool_fd, buf, toread, offset);
+		if (ret <= 0) {
+			wire_log(WLOG_FATAL, "Error reading back the spool file, it will get mixed up, aborting.");
 			wire_fd_wait_msec(100);
 			abort();
 		}
 
-		ret = wire_net_write(&out_net, buf, toread, &nsent);
-		if (ret < 0 || nsent != toread) {
-			wire_log(WLOG_FATAL, "Error writing buffer data, it will get mixed up, aborting.");
-			wire_fd_wait_msec(100);
-			abort();
+		out_write(buf, ret);
+		offset += ret;
+	}
+}
+
+/* The only writer of the output, it writes the entries in the order they
+ * were completed and finishes the archive once all connections are done.
+ */
+static void out_writer(void *arg)
+{
+	docket_entry_t *e;
+	char zeros[2*512];
+
+	UNUSED(arg);
+
+	while (1) {
+		wire_wait_reset(&writer_wait);
+
+		e = ready_head;
+		if (e) {
+			ready_head = e->next;
+			if (!ready_head)
+				ready_tail = NULL;
+
+			if (e->spool_fd >= 0)
+				out_write_spooled(e);
+			else
+				out_write_entry(e);
+			entry_free(e);
+			continue;
 		}
 
-		file_len -= toread;
+		if (stdin_done && collectors == 0)
+			break;
+
+		wire_wait_single(&writer_wait);
+	}
+
+	// Two empty blocks mark the end of the archive
+	memset(zeros, 0, sizeof(zeros));
+	out_write(zeros, sizeof(zeros));
+	wire_log(WLOG_INFO, "Output done");
+}
+
+static int conn_read_entry(docket_conn_t *conn, docket_entry_t *e, size_t len)
+{
+	char buf[16*1024];
+	size_t nrcvd;
+	int ret;
+
+	while (len > 0) {
+		size_t toread = len > sizeof(buf) ? sizeof(buf) : len;
+
+		wire_timeout_reset(&conn->net->tout, READ_TIMEOUT_MSEC);
+
+		ret = conn_read_full(conn, buf, toread, &nrcvd);
+		if (nrcvd > 0)
+			entry_append(e, buf, nrcvd);
+		if ((ret < 0 && errno != ENODATA) || nrcvd != toread)
+			return -1;
+		len -= toread;
 	}
 
-	wire_lock_release(&out_lock);
 	return 0;
 }
 
-static void docket_collect_stream(wire_net_t *net, const char *ip)
+static void conn_entry_add(docket_conn_t *conn, docket_entry_t *e)
+{
+	e->next = conn->pending;
+	conn->pending = e;
+}
+
+static docket_entry_t *conn_entry_find(docket_conn_t *conn, uint32_t stream)
+{
+	docket_entry_t *e;
+
+	for (e = conn->pending; e; e = e->next) {
+		if (e->stream == stream)
+			return e;
+	}
+
+	return NULL;
+}
+
+static void conn_entry_remove(docket_conn_t *conn, docket_entry_t *e)
+{
+	docket_entry_t **pe;
+
+	for (pe = &conn->pending; *pe; pe = &(*pe)->next) {
+		if (*pe == e) {
+			*pe = e->next;
+			break;
+		}
+	}
+}
+
+static void conn_abort_pending(docket_conn_t *conn)
+{
+	docket_entry_t *e;
+
+	while (conn->pending) {
+		e = conn->pending;
+		conn->pending = e->next;
+		entry_truncated(e);
+	}
+}
+
+static int docket_collect_tar(docket_conn_t *conn, const void *head, size_t head_len)
 {
-	while (docket_collect_tar(net, ip) == 0) {
-		// Let other sources write their output too for fairness
+	docket_entry_t *e;
+	uint64_t expected_len;
+
+	e = entry_new(conn->ip, 0);
+	entry_append(e, head, head_len);
+	conn_entry_add(conn, e);
+
+	if (conn_read_entry(conn, e, 512 - head_len) < 0) {
+		if (e->hdr_len == 0) {
+			// A clean end of the stream
+			conn_entry_remove(conn, e);
+			entry_free(e);
+		}
+		return -1;
+	}
+
+	// A PAX header and its records come before the ustar header
+	while (e->meta_len == 0 && !e->failed) {
+		if (conn_read_entry(conn, e, 512) < 0)
+			return -1;
+	}
+	if (e->failed)
+		return -1;
+
+	expected_len = entry_expected_len(e);
+	wire_log(WLOG_DEBUG, "tar header for %.100s from %s entry size %llu", entry_name(e), conn->ip, (unsigned long long)expected_len);
+
+	if (conn_read_entry(conn, e, expected_len - entry_len(e)) < 0)
+		return -1;
+
+	conn_entry_remove(conn, e);
+	entry_ready(e);
+	return 0;
+}
+
+static void docket_collect_tars(docket_conn_t *conn, const void *head, size_t head_len)
+{
+	if (docket_collect_tar(conn, head, head_len) != 0)
+		return;
+
+	do {
+		// Let other sources get their share too
+		wire_yield();
+	} while (docket_collect_tar(conn, NULL, 0) == 0);
+}
+
+static int docket_collect_frame(docket_conn_t *conn)
+{
+	struct docket_frame frame;
+	docket_entry_t *e;
+	uint32_t stream;
+	uint32_t len;
+	uint32_t flags;
+	size_t nrcvd;
+	int ret;
+
+	wire_timeout_reset(&conn->net->tout, READ_TIMEOUT_MSEC);
+
+	ret = conn_read_full(conn, &frame, sizeof(frame), &nrcvd);
+	if (ret < 0 || nrcvd != sizeof(frame)) {
+		if (nrcvd != 0)
+			wire_log(WLOG_ERR, "Error receiving frame header from %s ret=%d errno=%d (%m)", conn->ip, ret, errno);
+		return -1;
+	}
+
+	stream = ntohl(frame.stream);
+	len = ntohl(frame.len);
+	flags = ntohl(frame.flags);
+
+	if (len > DOCKET_FRAME_MAX) {
+		wire_log(WLOG_ERR, "Frame from %s is too large: %u", conn->ip, len);
+		return -1;
+	}
+
+	e = conn_entry_find(conn, stream);
+	if (!e) {
+		e = entry_new(conn->ip, stream);
+		conn_entry_add(conn, e);
+	}
+
+	if (conn_read_entry(conn, e, len) < 0)
+		return -1;
+
+	if (flags & DOCKET_FRAME_END) {
+		conn_entry_remove(conn, e);
+		entry_ready(e);
+	}
+
+	return 0;
+}
+
+static void docket_collect_frames(docket_conn_t *conn)
+{
+	while (docket_collect_frame(conn) == 0) {
+		// Let other sources get their share too
 		wire_yield();
 	}
 }
 
-static void docket_collect(void *arg)
+static void node_first_data(docket_node_t *node)
+{
+	uint64_t ttfb = now_msec() - node->connected;
+
+	ttfb_avg = ttfb_avg ? (ttfb_avg * 7 + ttfb) / 8 : ttfb;
+	if (ttfb_min == 0 || ttfb < ttfb_min)
+		ttfb_min = ttfb ? ttfb : 1;
+}
+
+static void docket_collect_stream(docket_node_t *node)
+{
+	struct docket_hello hello;
+	docket_conn_t conn;
+	wire_net_t *net = node->net;
+	const char *ip = node->ip;
+	uint32_t flags;
+	size_t nrcvd;
+	int ret;
+
+	memset(&conn, 0, sizeof(conn));
+	conn.net = net;
+	conn.node = node;
+	conn.ip = ip;
+
+	wire_timeout_reset(&net->tout, READ_TIMEOUT_MSEC);
+
+	ret = wire_net_read_full(net, &hello, sizeof(hello), &nrcvd);
+	if (ret < 0 || nrcvd != sizeof(hello)) {
+		wire_log(WLOG_ERR, "Error receiving data from %s ret=%d errno=%d (%m)", ip, ret, errno);
+		return;
+	}
+
+	node_first_data(node);
+
+	if (memcmp(hello.magic, DOCKET_HELLO_MAGIC, sizeof(hello.magic)) != 0) {
+		// An old daemon ignored the negotiation, this is already the tar stream
+		docket_collect_tars(&conn, &hello, sizeof(hello));
+		conn_abort_pending(&conn);
+		return;
+	}
+
+	flags = ntohl(hello.flags);
+	if (flags & DOCKET_HELLO_GZIP) {
+		if (decompress_init(&conn.decompress, net) < 0) {
+			wire_log(WLOG_ERR, "Failed to setup decompression for %s", ip);
+			return;
+		}
+		conn.compressed = 1;
+	}
+
+	switch (ntohl(hello.version)) {
+		case DOCKET_PROTO_V1:
+			docket_collect_tars(&conn, NULL, 0);
+			break;
+		case DOCKET_PROTO_V2:
+			docket_collect_frames(&conn);
+			break;
+		default:
+			wire_log(WLOG_ERR, "Unknown protocol version %u from %s", ntohl(hello.version), ip);
+			break;
+	}
+
+	conn_abort_pending(&conn);
+
+	if (conn.compressed)
+		decompress_end(&conn.decompress);
+}
+
+static void node_add(docket_node_t *node)
+{
+	node->next = nodes_active;
+	if (nodes_active)
+		nodes_active->pprev = &node->next;
+	node->pprev = &nodes_active;
+	nodes_active = node;
+	nodes_started++;
+}
+
+static void node_remove(docket_node_t *node)
+{
+	*node->pprev = node->next;
+	if (node->next)
+		node->next->pprev = node->pprev;
+
+	nodes_done++;
+	nodes_done_msec += now_msec() - node->start;
+}
+
+static void slot_take(void)
+{
+	while (1) {
+		wire_wait_reset(&slot_wait);
+		if (conn_active < conn_limit)
+			break;
+
+		slot_waiting = 1;
+		wire_wait_single(&slot_wait);
+		slot_waiting = 0;
+	}
+
+	conn_active++;
+}
+
+static void slot_release(void)
+{
+	conn_active--;
+	if (slot_waiting)
+		wire_wait_resume(&slot_wait);
+}
+
+/* Connect to the node, retrying with an exponential backoff. While backing off
+ * the node doesn't count against the concurrency limit, we may go a bit over
+ * the limit when it gets back.
+ */
+static int node_connect(docket_node_t *node, wire_net_t *net)
+{
+	int backoff = 1000;
+	int attempt;
+	int ret;
+
+	for (attempt = 0; ; attempt++) {
+		ret = wire_net_init_tcp_connected(net, node->ip, "7000", 10*1000, NULL, NULL);
+		if (ret == 0)
+			return 0;
+
+		if (attempt >= opt_retries)
+			break;
+
+		backoff += rand() % (backoff / 2);
+		if (node->deadline && now_msec() + backoff >= node->deadline)
+			break;
+
+		wire_log(WLOG_INFO, "Error connecting to %s: %d (%m), retrying in %d msec", node->ip, errno, backoff);
+
+		slot_release();
+		wire_fd_wait_msec(backoff);
+		conn_active++;
+
+		backoff *= 2;
+	}
+
+	wire_log(WLOG_ERR, "Error connecting to %s: %d (%m)", node->ip, errno);
+	return -1;
+}
+
+/* A node that was cut short gets an entry saying so next to what it sent, so
+ * its collection isn't taken for a complete one.
+ */
+static void node_mark_cut_short(docket_node_t *node, const char *name)
+{
+	char hdr[TAR_HEADER_MAX];
+	char prefix[128];
+	char msg[256];
+	char zeros[512];
+	struct timespec now;
+	docket_entry_t *e;
+	size_t hdr_len;
+	int len;
+
+	len = snprintf(msg, sizeof(msg), "Collection from %s was cut short at %s after %llu seconds, entries may be missing or truncated\n",
+			node->ip, node->cut_short, (unsigned long long)(now_msec() - node->start) / 1000);
+
+	// Same as the daemon does with the prefix
+	snprintf(prefix, sizeof(prefix), "%s", name);
+	clock_gettime(CLOCK_REALTIME, &now);
+	hdr_len = tar_build_header(hdr, sizeof(hdr), prefix, ".", "docket.cut_short", len, &now);
+
+	memset(zeros, 0, sizeof(zeros));
+	e = entry_new(node->ip, 0);
+	entry_append(e, hdr, hdr_len);
+	entry_append(e, msg, len);
+	entry_append(e, zeros, tar_padded(len) - len);
+	entry_ready(e);
+}
+
+static void docket_collect_line(char *line)
 {
-	char *line = arg;
 	char *ip;
 	char *name;
 	char *listfile;
 	char *saveptr;
 	int ret;
 	wire_net_t net;
+	docket_node_t node;
 
 	ip = strtok_r(line, " \t", &saveptr);
 	if (!ip) {
@@ -175,29 +844,51 @@ static void docket_collect(void *arg)
 	name = strdup(name);
 	listfile = strdup(listfile);
 
+	memset(&node, 0, sizeof(node));
+	node.ip = ip;
+	node.start = now_msec();
+	if (opt_deadline)
+		node.deadline = node.start + opt_deadline * 1000ULL;
+	node_add(&node);
+
 	wire_log(WLOG_INFO, "Connecting to %s", ip);
 
-	ret = wire_net_init_tcp_connected(&net, ip, "7000", 10*1000, NULL, NULL);
+	ret = node_connect(&node, &net);
 	if (ret == 0) {
+		node.connected = now_msec();
+		node.net = &net;
 		ret = docket_send_collection(&net, ip, name, listfile);
 		if (ret == 0) {
 			wire_log(WLOG_INFO, "Waiting for data from %s", ip);
-			docket_collect_stream(&net, ip);
+			docket_collect_stream(&node);
 		} else {
 			wire_log(WLOG_ERR, "Error writing orders to %s", ip);
 		}
+		node.net = NULL;
 		wire_net_close(&net);
-	} else {
-		wire_log(WLOG_ERR, "Error connecting to %s: %d (%m)", ip, errno);
 	}
 
+	if (node.cut_short) {
+		wire_log(WLOG_ERR, "Collection from %s was cut short at %s, keeping what we got", ip, node.cut_short);
+		node_mark_cut_short(&node, name);
+	}
 	wire_log(WLOG_INFO, "Connection to %s finished", ip);
 
+	node_remove(&node);
 	free(ip);
 	free(name);
 	free(listfile);
 }
 
+static void docket_collect(void *arg)
+{
+	docket_collect_line(arg);
+
+	slot_release();
+	collectors--;
+	wire_wait_resume(&writer_wait);
+}
+
 static size_t process_stdin(char *buf, size_t buf_len)
 {
 	char *eol;
@@ -216,7 +907,14 @@ static size_t process_stdin(char *buf, size_t buf_len)
 		if (line[0] == '#')
 			continue;
 
-		wire_pool_alloc_block(&docket_pool, "collect", docket_collect, line);
+		slot_take();
+
+		// Counted before the wire runs so the writer never sees a gap
+		collectors++;
+		if (!wire_pool_alloc_block(&docket_pool, "collect", docket_collect, line)) {
+			collectors--;
+			slot_release();
+		}
 	}
 	// Let all the new wires copy their argument from our stack
 	wire_yield();
@@ -258,20 +956,166 @@ static void stdin_processor(void *arg)
 
 	process_stdin(buf, buf_len);
 	wire_log(WLOG_INFO, "stdin processing done");
+
+	stdin_done = 1;
+	wire_wait_resume(&writer_wait);
+}
+
+static uint64_t straggler_msec(void)
+{
+	uint64_t msec;
+
+	if (!opt_straggler || !stdin_done || nodes_done == 0 || nodes_done * 100 < nodes_started * STRAGGLER_QUORUM)
+		return 0;
+
+	msec = opt_straggler * nodes_done_msec / nodes_done;
+	return msec < STRAGGLER_MIN_MSEC ? STRAGGLER_MIN_MSEC : msec;
 }
 
-int main()
+/* Cut the nodes that ran past their deadline short, shutting down the socket
+ * fails their reads and whatever they sent so far is kept.
+ */
+static void nodes_expire(uint64_t now)
 {
+	uint64_t straggler = straggler_msec();
+	docket_node_t *node;
+
+	for (node = nodes_active; node; node = node->next) {
+		if (node->cut_short || !node->net)
+			continue;
+
+		if (node->deadline && now >= node->deadline)
+			node->cut_short = "its deadline";
+		else if (straggler && now >= node->start + straggler)
+			node->cut_short = "the straggler cut-off";
+		else
+			continue;
+
+		wire_log(WLOG_INFO, "Node %s is past %s, cutting it short", node->ip, node->cut_short);
+		shutdown(node->net->fd_state.fd, SHUT_RDWR);
+	}
+}
+
+/* Adapt the number of concurrent nodes once a second. When the output keeps up
+ * and there are nodes waiting the limit goes up. When entries pile up in the
+ * staging area or the nodes get slower to answer than they were we are
+ * overloaded and the limit goes down.
+ */
+static void conn_limit_adapt(uint64_t bytes, uint64_t last_bytes)
+{
+	int limit = conn_limit;
+
+	if (staged_mem > STAGE_MEM_MAX / 2 || (ttfb_avg > 1000 && ttfb_avg > 4 * ttfb_min)) {
+		limit -= limit / 4;
+		if (limit < CONN_MIN)
+			limit = CONN_MIN < opt_conn_max ? CONN_MIN : opt_conn_max;
+	} else if (slot_waiting && conn_active >= conn_limit && bytes >= last_bytes * 9 / 10) {
+		limit += limit / 4 > 0 ? limit / 4 : 1;
+		if (limit > opt_conn_max)
+			limit = opt_conn_max;
+	}
+
+	if (limit != conn_limit) {
+		wire_log(WLOG_DEBUG, "Concurrency limit %d -> %d (%llu bytes/sec, %d active)", conn_limit, limit, (unsigned long long)bytes, conn_active);
+		conn_limit = limit;
+		wire_wait_resume(&slot_wait);
+	}
+}
+
+static void tuner(void *arg)
+{
+	uint64_t last_out = 0;
+	uint64_t last_bytes = 0;
+
+	UNUSED(arg);
+
+	while (!stdin_done || collectors > 0) {
+		wire_fd_wait_msec(1000);
+
+		conn_limit_adapt(out_bytes - last_out, last_bytes);
+		last_bytes = out_bytes - last_out;
+		last_out = out_bytes;
+
+		nodes_expire(now_msec());
+	}
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-z] [-D] [-c max nodes] [-T deadline] [-S straggler factor] [-r retries]\n", prog);
+	fprintf(stderr, "  -z  Ask the daemons to compress the data they send\n");
+	fprintf(stderr, "  -D  Don't replace entries with the same content by hard links\n");
+	fprintf(stderr, "  -c  Maximum number of nodes to collect from at once (default %d)\n", opt_conn_max);
+	fprintf(stderr, "  -T  Seconds to collect from a node before cutting it short, 0 for none (default %d)\n", opt_deadline);
+	fprintf(stderr, "  -S  Once %d%% of the nodes are done, cut short those running this many times\n", STRAGGLER_QUORUM);
+	fprintf(stderr, "      their average, at least %d seconds, 0 for never (default %d)\n", STRAGGLER_MIN_MSEC / 1000, opt_straggler);
+	fprintf(stderr, "  -r  Connection retries for a node (default %d)\n", opt_retries);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+
+	while ((opt = getopt(argc, argv, "zDc:T:S:r:")) != -1) {
+		switch (opt) {
+			case 'z':
+				opt_compress = 1;
+				break;
+			case 'D':
+				opt_dedup = 0;
+				break;
+			case 'c':
+				opt_conn_max = atoi(optarg);
+				if (opt_conn_max < 1)
+					usage(argv[0]);
+				break;
+			case 'T':
+				opt_deadline = atoi(optarg);
+				if (opt_deadline < 0)
+					usage(argv[0]);
+				break;
+			case 'S':
+				opt_straggler = atoi(optarg);
+				if (opt_straggler < 0)
+					usage(argv[0]);
+				break;
+			case 'r':
+				opt_retries = atoi(optarg);
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+
 	signal(SIGPIPE, SIG_IGN);
 
+	// Spooled entries each take a file descriptor
+	struct rlimit rlim;
+	if (getrlimit(RLIMIT_NOFILE, &rlim) == 0 && rlim.rlim_cur < rlim.rlim_max) {
+		rlim.rlim_cur = rlim.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rlim);
+	}
+
+	spool_dir = getenv("TMPDIR");
+	if (!spool_dir || !spool_dir[0])
+		spool_dir = "/tmp";
+
 	wire_thread_init(&wire_main);
 	wire_fd_init();
 	wire_io_init(2);
 	wire_log_init_stderr();
-	wire_pool_init(&docket_pool, NULL, 64, 64*1024);
-	wire_lock_init(&out_lock);
+	if (conn_limit > opt_conn_max)
+		conn_limit = opt_conn_max;
+	srand(getpid());
+
+	wire_pool_init(&docket_pool, NULL, opt_conn_max, 64*1024);
 	wire_net_init(&out_net, 1);
+	wire_wait_init(&writer_wait);
+	wire_wait_init(&slot_wait);
+	wire_init(&writer_wire, "output writer", out_writer, NULL, WIRE_STACK_ALLOC(64*1024));
 	wire_init(&stdin_wire, "stdin processor", stdin_processor, NULL, WIRE_STACK_ALLOC(64*1024));
+	wire_init(&tuner_wire, "tuner", tuner, NULL, WIRE_STACK_ALLOC(16*1024));
 	wire_thread_run();
 	return 0;
 }
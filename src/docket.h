@@ -1,6 +1,43 @@
 #ifndef DOCKET_H
 #define DOCKET_H
 
+#include <stdint.h>
+
 #define DOCKET_PORT (7000)
 
+/* Protocol negotiation, a client that wants the framed protocol sends
+ * "PROTO|2" as the first line of the collection list. The daemon then answers
+ * with a docket_hello before any other data. A daemon that doesn't know about
+ * it will just send a plain tar stream so the client must handle both.
+ */
+#define DOCKET_PROTO_V1 1
+#define DOCKET_PROTO_V2 2
+
+#define DOCKET_HELLO_MAGIC "DOCKET\n"
+
+struct docket_hello {
+	char magic[8];
+	uint32_t version;
+	uint32_t flags;
+};
+
+/* Everything after the hello is a gzip stream, asked for with "COMPRESS|gzip" */
+#define DOCKET_HELLO_GZIP 1
+
+/* In the v2 protocol every tar entry is sent as a stream of frames, frames of
+ * different entries are interleaved on the socket. The payload of all frames
+ * of a stream concatenated is the tar entry (header, data and padding). The
+ * last frame of a stream has DOCKET_FRAME_END set, it may be empty.
+ *
+ * All fields are in network byte order.
+ */
+struct docket_frame {
+	uint32_t stream;
+	uint32_t len;
+	uint32_t flags;
+};
+
+#define DOCKET_FRAME_END 1
+#define DOCKET_FRAME_MAX (64*1024)
+
 #endif
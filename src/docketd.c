@@ -1,7 +1,17 @@
 #include "docket.h"
 #include "tar.h"
 #include "special_arg.h"
-#include "dev_list.h"
+#include "dev_map.h"
+#include "compress.h"
+#include "manifest.h"
+#include "hash.h"
+#include "spool.h"
+#include "bufpool.h"
+#include "walk.h"
+#include "find.h"
+#include "uring.h"
+#include "plan.h"
+#include "profile.h"
 
 #include "wire.h"
 #include "wire_fd.h"
@@ -13,6 +23,7 @@
 #include "wire_log.h"
 #include "macros.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <memory.h>
@@ -24,13 +35,72 @@
 #include <assert.h>
 #include <stdarg.h>
 #include <signal.h>
-
-#define MAX_ARGS 20
-
-static wire_thread_t wire_main;
-static wire_t task_accept;
-static wire_pool_t docket_pool;
-static wire_pool_t exec_pool;
+#include <ctype.h>
+#include <limits.h>
+#include <arpa/inet.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <pthread.h>
+
+#define MAX_ARGS PLAN_ARGS_MAX
+
+/* Flattened paths leave room in the entry name for the prefix, the directory
+ * and a suffix.
+ */
+#define FLAT_PATH_MAX (TAR_PATH_MAX - 512)
+
+// Line processors running at once per session, the rest wait in priority order
+#define SESSION_COLLECTORS_MAX 8
+
+// PROFILE lines in one session
+#define SESSION_PROFILES_MAX 8
+
+// Runs of one EXEC line with all the combinations of its special arguments
+#define EXEC_RUNS_MAX 1024
+
+// Files of a GLOB line collected at once
+#define GLOB_PARALLEL_DEFAULT 8
+#define GLOB_PARALLEL_MAX 64
+
+// I/O buffers come from the buffer pool so wires can run on small stacks
+#define DOCKET_STACK_SIZE (64*1024)
+#define DOCKET_WIRES_MAX 256
+#define BUFPOOL_MEM_MAX (256*1024*1024)
+
+// One wire thread per core by default, each accepts on its own listener
+#define DOCKET_THREADS_MAX 64
+
+/* Blocking I/O threads for all the wire threads together, split between them.
+ * The wio and wire_fd state of libwire is per thread, every wire thread inits
+ * its own.
+ */
+#define DOCKET_IO_THREADS 8
+
+// The session log grows in chunks as needed up to a cap
+#define LOG_CHUNK_SIZE (64*1024)
+#define LOG_MEM_MAX (32*1024*1024)
+#define LOG_LINE_MAX 2048
+#define DOCKET_STATE_DIR "/var/lib/docket"
+#define SEND_FILE_CHUNK_MAX (1024*1024*1024)
+
+// sendfile is only used for ranges of up to this size found in the page cache
+#define SENDFILE_CACHED_MAX (1024*1024)
+
+// A closing entry flushes a compressed block that has waited this long
+#define STREAM_FLUSH_MSEC 50
+
+// Output of unknown length beyond the collector buffer goes to a tmpfs spool
+#define DOCKET_SPOOL_DIR "/dev/shm"
+#define SPOOL_MAX (4ULL*1024*1024*1024)
+
+/* Sessions stay on the wire thread that accepted them, all of their wires
+ * come from the pools of that thread.
+ */
+static __thread wire_thread_t wire_main;
+static __thread wire_t task_accept;
+static __thread wire_pool_t docket_pool;
+static __thread wire_pool_t exec_pool;
+static unsigned num_threads;
 
 typedef struct docket_state {
 	wire_net_t write_net;
@@ -38,12 +108,83 @@ typedef struct docket_state {
 	wire_lock_t write_lock;
 	int remaining;
 	int auto_close;
+	int proto;
+	int hello;
+	int started;
+	int compress_level;
+	int compressing;
+	int send_failed;
+	compress_t compress;
+	int open_streams;
+	uint32_t next_stream;
+	manifest_t *since;
+	manifest_t *sent;
+	char manifest_name[64];
+	manifest_t *cursors;
+	char cursor_name[64];
+	struct relay *relays;
+	char *list;
+	size_t list_len;
+	size_t list_size;
 	char prefix[128];
-	char *line;
-	unsigned log_len;
-	char log[512*1024];
+	struct queued_line *queue;
+	int running;
+	int dispatch_waiting;
+	uint64_t deadline;
+	unsigned next_collector_id;
+	struct log_chunk *log_head;
+	struct log_chunk *log_tail;
+	size_t log_size;
+	unsigned log_dropped;
+	struct log_binding *log_bindings;
+	special_arg_cache_t specials;
+	profile_t *profiles[SESSION_PROFILES_MAX];
+	unsigned num_profiles;
+	manifest_t *collected;
 } docket_state_t;
 
+typedef struct log_chunk {
+	struct log_chunk *next;
+	size_t len;
+	char data[LOG_CHUNK_SIZE];
+} log_chunk_t;
+
+/* Tells which collector the current wire works for, log records carry its id.
+ * Wires bind themselves for as long as they run, the binding is on their stack.
+ */
+typedef struct log_binding {
+	struct log_binding *next;
+	wire_t *wire;
+	unsigned id;
+} log_binding_t;
+
+static uint64_t now_msec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int session_deadline_passed(docket_state_t *state)
+{
+	return state->deadline && now_msec() >= state->deadline;
+}
+
+// Cap a timeout so it doesn't run past the deadline of the session
+static int session_timeout_msec(docket_state_t *state, int timeout_msec)
+{
+	uint64_t now;
+
+	if (!state->deadline)
+		return timeout_msec;
+
+	now = now_msec();
+	if (now >= state->deadline)
+		return 1;
+	return state->deadline - now < timeout_msec ? state->deadline - now : timeout_msec;
+}
+
 static void set_nonblock(int fd)
 {
 	int ret = fcntl(fd, F_GETFL);
@@ -57,11 +198,41 @@ static void set_reuse(int fd)
 {
 	int so_reuseaddr = 1;
 	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &so_reuseaddr, sizeof(so_reuseaddr));
+
+	// Every wire thread binds its own listener, the kernel spreads the connections
+	int so_reuseport = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &so_reuseport, sizeof(so_reuseport));
 }
 
+/* Listen on IPv6 with IPv4 mapped into it, hosts without IPv6 get a plain
+ * IPv4 listener.
+ */
 static int socket_setup(unsigned short port)
 {
-	int fd = socket(AF_INET, SOCK_CLOEXEC|SOCK_STREAM, 0);
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+
+	memset(&addr, 0, sizeof(addr));
+
+	int fd = socket(AF_INET6, SOCK_CLOEXEC|SOCK_STREAM, 0);
+	if (fd >= 0) {
+		struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)&addr;
+		int v6only = 0;
+
+		setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only));
+		addr6->sin6_family = AF_INET6;
+		addr6->sin6_addr = in6addr_any;
+		addr6->sin6_port = htons(port);
+		addr_len = sizeof(*addr6);
+	} else if (errno == EAFNOSUPPORT) {
+		struct sockaddr_in *addr4 = (struct sockaddr_in *)&addr;
+
+		fd = socket(AF_INET, SOCK_CLOEXEC|SOCK_STREAM, 0);
+		addr4->sin_family = AF_INET;
+		addr4->sin_port = htons(port);
+		addr_len = sizeof(*addr4);
+	}
+
 	if (fd < 0) {
 		wire_log(WLOG_ERR, "Failed to create socket: %m");
 		return -1;
@@ -70,12 +241,7 @@ static int socket_setup(unsigned short port)
 	set_nonblock(fd);
 	set_reuse(fd);
 
-	struct sockaddr_in addr;
-	memset(&addr, 0, sizeof(addr));
-	addr.sin_family = AF_INET;
-	addr.sin_port = htons(port);
-
-	int ret = bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+	int ret = bind(fd, (struct sockaddr*)&addr, addr_len);
 	if (ret < 0) {
 		wire_log(WLOG_ERR, "Failed to bind to socket on port %hd: %m", port);
 		wio_close(fd);
@@ -92,27 +258,117 @@ static int socket_setup(unsigned short port)
 	return fd;
 }
 
+static void log_bind(docket_state_t *state, log_binding_t *binding, unsigned id)
+{
+	binding->wire = wire_get_current();
+	binding->id = id;
+	binding->next = state->log_bindings;
+	state->log_bindings = binding;
+}
+
+static void log_unbind(docket_state_t *state, log_binding_t *binding)
+{
+	log_binding_t **pb;
+
+	for (pb = &state->log_bindings; *pb; pb = &(*pb)->next) {
+		if (*pb == binding) {
+			*pb = binding->next;
+			break;
+		}
+	}
+}
+
+// The collector the current wire works for, 0 for the session itself
+static unsigned log_current_id(docket_state_t *state)
+{
+	wire_t *wire = wire_get_current();
+	log_binding_t *b;
+
+	for (b = state->log_bindings; b; b = b->next) {
+		if (b->wire == wire)
+			return b->id;
+	}
+
+	return 0;
+}
+
+static void log_append(docket_state_t *state, const char *line, size_t len)
+{
+	log_chunk_t *chunk = state->log_tail;
+
+	if (!chunk || chunk->len + len > sizeof(chunk->data)) {
+		if (state->log_size + sizeof(*chunk) > LOG_MEM_MAX) {
+			state->log_dropped++;
+			return;
+		}
+
+		chunk = malloc(sizeof(*chunk));
+		if (!chunk) {
+			state->log_dropped++;
+			return;
+		}
+
+		chunk->next = NULL;
+		chunk->len = 0;
+		if (state->log_tail)
+			state->log_tail->next = chunk;
+		else
+			state->log_head = chunk;
+		state->log_tail = chunk;
+		state->log_size += sizeof(*chunk);
+	}
+
+	memcpy(chunk->data + chunk->len, line, len);
+	chunk->len += len;
+}
+
 static void docket_log(docket_state_t *state, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
 static void docket_log(docket_state_t *state, const char *fmt, ...)
 {
+	char line[LOG_LINE_MAX];
+	struct timespec ts;
+	struct tm tm;
 	va_list ap;
+	int len;
 	int written;
-	size_t space = sizeof(state->log) - state->log_len;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	localtime_r(&ts.tv_sec, &tm);
+	len = strftime(line, sizeof(line), "%Y-%m-%d %H:%M:%S", &tm);
+	len += snprintf(line + len, sizeof(line) - len, ".%03ld [%u] ", ts.tv_nsec / 1000000, log_current_id(state));
 
 	va_start(ap, fmt);
-	written = vsnprintf(state->log + state->log_len, space, fmt, ap);
+	written = vsnprintf(line + len, sizeof(line) - len - 1, fmt, ap);
 	va_end(ap);
 
-	if (written > 0 && written <= space) {
-		state->log_len += written;
-		if (state->log_len < sizeof(state->log)) {
-			state->log[state->log_len++] = '\n';
-		}
-	}
+	if (written < 0)
+		return;
+
+	// Long records are cut short
+	len += written;
+	if (len > sizeof(line) - 2)
+		len = sizeof(line) - 2;
+	line[len++] = '\n';
+
+	log_append(state, line, len);
 
 	//TODO: wire_logv(WLOG_INFO, fmt, ap);
 }
 
+static void log_free(docket_state_t *state)
+{
+	log_chunk_t *chunk;
+
+	while (state->log_head) {
+		chunk = state->log_head;
+		state->log_head = chunk->next;
+		free(chunk);
+	}
+
+	state->log_tail = NULL;
+	state->log_size = 0;
+}
+
 static void remaining_dec(docket_state_t *state)
 {
 	state->remaining--;
@@ -123,13 +379,121 @@ static void remaining_dec(docket_state_t *state)
 	}
 }
 
-static void send_buf(docket_state_t *state, const char *buf, unsigned buf_len)
+/* An output stream carries a single tar entry. With the v1 protocol the entry
+ * is written as is and the stream holds the write lock for its whole
+ * duration. With the v2 protocol the data is cut into frames tagged with the
+ * stream id and the lock is only held per frame so that entries of different
+ * collectors are interleaved on the socket.
+ */
+typedef struct docket_stream {
+	docket_state_t *state;
+	uint32_t id;
+} docket_stream_t;
+
+/* All writes of the session data go through here, the caller must hold the
+ * write lock since the compression state is shared. A failed send is
+ * remembered so nothing is saved as sent at the end.
+ */
+static void state_write(docket_state_t *state, const void *buf, size_t len)
 {
 	size_t sent;
-	wire_net_write(&state->write_net, buf, buf_len, &sent);
+	int ret;
+
+	if (state->compressing)
+		ret = compress_write(&state->compress, buf, len);
+	else
+		ret = wire_net_write(&state->write_net, buf, len, &sent);
+
+	if (ret < 0)
+		state->send_failed = 1;
+}
+
+static void state_flush(docket_state_t *state)
+{
+	if (state->compressing)
+		compress_flush(&state->compress);
+}
+
+static void frame_begin(docket_state_t *state, uint32_t id, unsigned len, uint32_t flags)
+{
+	struct docket_frame frame;
+
+	frame.stream = htonl(id);
+	frame.len = htonl(len);
+	frame.flags = htonl(flags);
+
+	wire_lock_take(&state->write_lock);
+	state_write(state, &frame, sizeof(frame));
+}
+
+static void frame_end(docket_state_t *state)
+{
+	wire_lock_release(&state->write_lock);
+}
+
+static void send_frame(docket_state_t *state, uint32_t id, const char *buf, unsigned buf_len, uint32_t flags)
+{
+	frame_begin(state, id, buf_len, flags);
+	if (buf_len > 0)
+		state_write(state, buf, buf_len);
+	frame_end(state);
+}
+
+static void stream_open(docket_state_t *state, docket_stream_t *stream)
+{
+	stream->state = state;
+	state->open_streams++;
+
+	if (state->proto == DOCKET_PROTO_V2) {
+		stream->id = ++state->next_stream;
+	} else {
+		stream->id = 0;
+		wire_lock_take(&state->write_lock);
+	}
+}
+
+static void stream_close(docket_stream_t *stream)
+{
+	docket_state_t *state = stream->state;
+	int flush = --state->open_streams == 0;
+
+	// A compressed stream holds finished entries in the partial block until
+	// it fills up. Flush when the last open entry is done, or when the block
+	// already waited a while, the entries still open may be stuck on a slow
+	// collector and write nothing for a long time.
+	if (state->compressing && compress_pending_msec(&state->compress) >= STREAM_FLUSH_MSEC)
+		flush = 1;
+
+	if (state->proto == DOCKET_PROTO_V2) {
+		frame_begin(state, stream->id, 0, DOCKET_FRAME_END);
+		if (flush)
+			state_flush(state);
+		frame_end(state);
+	} else {
+		if (flush)
+			state_flush(state);
+		wire_lock_release(&state->write_lock);
+	}
+}
+
+static void send_buf(docket_stream_t *stream, const char *buf, unsigned buf_len)
+{
+	docket_state_t *state = stream->state;
+
+	if (state->proto != DOCKET_PROTO_V2) {
+		state_write(state, buf, buf_len);
+		return;
+	}
+
+	while (buf_len > 0) {
+		unsigned chunk = buf_len > DOCKET_FRAME_MAX ? DOCKET_FRAME_MAX : buf_len;
+		send_frame(state, stream->id, buf, chunk, 0);
+		buf += chunk;
+		buf_len -= chunk;
+	}
 }
 
-static unsigned send_buf_zeros(docket_state_t *state, char *buf, unsigned buf_size, unsigned sendbytes)
+static unsigned send_buf_zeros(docket_stream_t *stream, char *buf, unsigned buf_size, unsigned sendbytes)
 {
 	unsigned sent = 0;
 
@@ -140,14 +504,14 @@ static unsigned send_buf_zeros(docket_state_t *state, char *buf, unsigned buf_si
 	while (sent < sendbytes) {
 		unsigned remaining = sendbytes - sent;
 		unsigned tosend = remaining < buf_size ? remaining : buf_size;
-		send_buf(state, buf, tosend);
+		send_buf(stream, buf, tosend);
 		sent += tosend;
 	}
 
 	return sent;
 }
 
-static void send_tar_pad(docket_state_t *state, char *buf, unsigned buf_size, unsigned filesize)
+static void send_tar_pad(docket_stream_t *stream, char *buf, unsigned buf_size, uint64_t filesize)
 {
 	filesize %= 512;
 
@@ -155,30 +519,299 @@ static void send_tar_pad(docket_state_t *state, char *buf, unsigned buf_size, un
 		return;
 
 	filesize = 512 - filesize; // Pad to 512 bytes
-	send_buf_zeros(state, buf, buf_size, filesize);
+	send_buf_zeros(stream, buf, buf_size, filesize);
 }
 
-static void send_tar_header(docket_state_t *state, const char *dir, char *filename, unsigned file_size)
+/* Entries without a file behind them are stamped with the collection time */
+static void send_tar_header(docket_stream_t *stream, const char *dir, char *filename, uint64_t file_size, const struct timespec *mtime)
 {
-	struct tar hdr;
-	size_t sent;
+	char hdr[TAR_HEADER_MAX];
+	struct timespec now;
+	size_t hdr_len;
+
+	if (!mtime) {
+		clock_gettime(CLOCK_REALTIME, &now);
+		mtime = &now;
+	}
 
-	tar_set_header(&hdr, state->prefix, dir, filename, file_size, time(NULL));
-	wire_net_write(&state->write_net, &hdr, sizeof(hdr), &sent);
+	hdr_len = tar_build_header(hdr, sizeof(hdr), stream->state->prefix, dir, filename, file_size, mtime);
+	send_buf(stream, hdr, hdr_len);
 }
 
 static void send_all(docket_state_t *state, char *dir, char *filename, char *buf, int buf_len, size_t buf_sz)
 {
-	wire_lock_take(&state->write_lock);
-	send_tar_header(state, dir, filename, buf_len);
-	send_buf(state, buf, buf_len);
-	send_tar_pad(state, buf, buf_sz, buf_len);
-	wire_lock_release(&state->write_lock);
+	docket_stream_t stream;
+
+	stream_open(state, &stream);
+	send_tar_header(&stream, dir, filename, buf_len, NULL);
+	send_buf(&stream, buf, buf_len);
+	send_tar_pad(&stream, buf, buf_sz, buf_len);
+	stream_close(&stream);
+}
+
+/* Send file data straight from the page cache to the socket. Returns the
+ * number of bytes sent, which is short if the file got truncated under us, or
+ * -1 if sendfile can't be used for this file at all.
+ */
+static ssize_t sendfile_full(docket_state_t *state, int fd, off_t offset, size_t len)
+{
+	wire_fd_state_t *fd_state = &state->write_net.fd_state;
+	size_t sent = 0;
+	ssize_t ret;
+
+	while (sent < len) {
+		ret = sendfile(fd_state->fd, fd, &offset, len - sent);
+		if (ret > 0) {
+			sent += ret;
+		} else if (ret == 0) {
+			break; // File was truncated
+		} else if (errno == EAGAIN) {
+			wire_fd_mode_write(fd_state);
+			wire_fd_wait(fd_state);
+			wire_fd_mode_none(fd_state);
+		} else if (errno != EINTR) {
+			if (sent == 0 && (errno == EINVAL || errno == ENOSYS))
+				return -1;
+			state->send_failed = 1;
+			break;
+		}
+	}
+
+	return sent;
+}
+
+/* sendfile reads the file on the wire thread, a range that is not all in the
+ * page cache would stall every session of the thread on the disk.
+ */
+static int file_range_cached(int fd, off_t offset, size_t len)
+{
+	unsigned char vec[SENDFILE_CACHED_MAX / 4096 + 2];
+	long page_size = sysconf(_SC_PAGESIZE);
+	off_t start = offset - offset % page_size;
+	size_t map_len = len + (offset - start);
+	size_t pages = (map_len + page_size - 1) / page_size;
+	size_t i;
+	void *map;
+	int ret;
+
+	if (pages > sizeof(vec))
+		return 0;
+
+	// Mapping the file doesn't read it, mincore only looks at the page cache
+	map = mmap(NULL, map_len, PROT_READ, MAP_SHARED, fd, start);
+	if (map == MAP_FAILED)
+		return 0;
+	ret = mincore(map, map_len, vec);
+	munmap(map, map_len);
+	if (ret < 0)
+		return 0;
+
+	for (i = 0; i < pages; i++) {
+		if (!(vec[i] & 1))
+			return 0;
+	}
+
+	return 1;
+}
+
+/* Send exactly len bytes of the file from offset, the caller holds the write
+ * lock. What is in the page cache goes out with sendfile, the rest is read
+ * through buf on the I/O threads and whatever the file doesn't have anymore is
+ * filled with zeroes. Once the deadline passed the rest is zeroes as well,
+ * returns how many bytes that was.
+ */
+static size_t send_file_chunk(docket_state_t *state, int fd, char *buf, unsigned buf_size, off_t offset, size_t len, int *use_sendfile)
+{
+	size_t nsent = 0;
+	size_t zeroed = 0;
+	ssize_t ret;
+
+	while (nsent < len) {
+		size_t toread = len - nsent > buf_size ? buf_size : len - nsent;
+
+		if (session_deadline_passed(state)) {
+			if (zeroed == 0)
+				memset(buf, 0, buf_size);
+			state_write(state, buf, toread);
+			nsent += toread;
+			zeroed += toread;
+			continue;
+		}
+
+		if (*use_sendfile && toread <= SENDFILE_CACHED_MAX && file_range_cached(fd, offset + nsent, toread)) {
+			ret = sendfile_full(state, fd, offset + nsent, toread);
+			if (ret < 0) {
+				*use_sendfile = 0;
+			} else {
+				if (state->send_failed)
+					return zeroed;
+				nsent += ret;
+				if (ret == toread)
+					continue;
+				// Truncated under us, the rest is zero filled below
+				toread = len - nsent > buf_size ? buf_size : len - nsent;
+			}
+		}
+
+		ret = wio_pread(fd, buf, toread, offset + nsent);
+		if (ret <= 0) {
+			toread = len - nsent > buf_size ? buf_size : len - nsent;
+			memset(buf, 0, toread);
+		} else {
+			toread = ret;
+		}
+		state_write(state, buf, toread);
+		nsent += toread;
+	}
+
+	return zeroed;
+}
+
+static void send_file(docket_stream_t *stream, int fd, char *buf, unsigned buf_size, off_t offset, uint64_t len)
+{
+	docket_state_t *state = stream->state;
+	int use_sendfile = !state->compressing;
+	uint64_t zeroed = 0;
+
+	while (len > 0) {
+		size_t chunk = len > SEND_FILE_CHUNK_MAX ? SEND_FILE_CHUNK_MAX : len;
+
+		if (state->proto == DOCKET_PROTO_V2) {
+			if (chunk > DOCKET_FRAME_MAX)
+				chunk = DOCKET_FRAME_MAX;
+			frame_begin(state, stream->id, chunk, 0);
+		}
+
+		zeroed += send_file_chunk(state, fd, buf, buf_size, offset, chunk, &use_sendfile);
+
+		if (state->proto == DOCKET_PROTO_V2)
+			frame_end(state);
+
+		offset += chunk;
+		len -= chunk;
+	}
+
+	if (zeroed)
+		docket_log(state, "Deadline passed, %llu bytes of a file sent as zeroes", (unsigned long long)zeroed);
+}
+
+/* An entry of unknown length, it is collected in the buffer of the collector
+ * and once that is full it goes to a spool file. The header is only sent when
+ * the whole length is known.
+ */
+typedef struct spooled {
+	char *buf;
+	size_t buf_size;
+	size_t len;
+	int fd;
+	off_t spool_len;
+} spooled_t;
+
+static void spooled_init(spooled_t *sp, char *buf, size_t buf_size)
+{
+	sp->buf = buf;
+	sp->buf_size = buf_size;
+	sp->len = 0;
+	sp->fd = -1;
+	sp->spool_len = 0;
+}
+
+static uint64_t spooled_len(spooled_t *sp)
+{
+	return sp->spool_len + sp->len;
+}
+
+static int spooled_flush(docket_state_t *state, spooled_t *sp)
+{
+	if (sp->fd < 0) {
+		sp->fd = spool_open(DOCKET_SPOOL_DIR);
+		if (sp->fd < 0)
+			sp->fd = spool_open("/tmp");
+		if (sp->fd < 0) {
+			docket_log(state, "Failed to create a spool file: %m");
+			return -1;
+		}
+	}
+
+	if (spool_write(sp->fd, sp->buf, sp->len, sp->spool_len) < 0) {
+		docket_log(state, "Failed to write to the spool file: %m");
+		return -1;
+	}
+
+	sp->spool_len += sp->len;
+	sp->len = 0;
+	return 0;
+}
+
+/* Account for len bytes added at buf + len, returns -1 when no more can be
+ * taken and the entry will be truncated.
+ */
+static int spooled_commit(docket_state_t *state, spooled_t *sp, size_t len)
+{
+	sp->len += len;
+	if (sp->len < sp->buf_size)
+		return 0;
+
+	if (sp->spool_len + sp->len > SPOOL_MAX) {
+		docket_log(state, "Spooled entry is over %llu bytes, truncating it", SPOOL_MAX);
+		return -1;
+	}
+
+	return spooled_flush(state, sp);
+}
+
+static void spooled_free(spooled_t *sp)
+{
+	if (sp->fd >= 0)
+		wio_close(sp->fd);
+	sp->fd = -1;
+}
+
+static void send_spooled(docket_state_t *state, char *dir, char *filename, spooled_t *sp, const struct timespec *mtime)
+{
+	docket_stream_t stream;
+	uint64_t len;
+
+	// The buffer is needed to send the spool file, its tail goes there first
+	if (sp->fd >= 0 && sp->len > 0 && spooled_flush(state, sp) < 0)
+		sp->len = 0;
+
+	len = spooled_len(sp);
+
+	stream_open(state, &stream);
+	send_tar_header(&stream, dir, filename, len, mtime);
+	if (sp->fd >= 0)
+		send_file(&stream, sp->fd, sp->buf, sp->buf_size, 0, sp->spool_len);
+	else
+		send_buf(&stream, sp->buf, sp->len);
+	send_tar_pad(&stream, sp->buf, sp->buf_size, len);
+	stream_close(&stream);
 }
 
 static void send_log_file(docket_state_t *state)
 {
-	send_all(state, ".", "docket.log", state->log, state->log_len, sizeof(state->log));
+	docket_stream_t stream;
+	log_chunk_t *chunk;
+	char dropped[128];
+	char pad[512];
+	int dropped_len = 0;
+	uint64_t len = 0;
+
+	if (state->log_dropped)
+		dropped_len = snprintf(dropped, sizeof(dropped), "%u log records dropped, the log is limited to %d bytes\n",
+				state->log_dropped, LOG_MEM_MAX);
+
+	for (chunk = state->log_head; chunk; chunk = chunk->next)
+		len += chunk->len;
+
+	stream_open(state, &stream);
+	send_tar_header(&stream, ".", "docket.log", len + dropped_len, NULL);
+	for (chunk = state->log_head; chunk; chunk = chunk->next)
+		send_buf(&stream, chunk->data, chunk->len);
+	if (dropped_len)
+		send_buf(&stream, dropped, dropped_len);
+	send_tar_pad(&stream, pad, sizeof(pad), len + dropped_len);
+	stream_close(&stream);
 }
 
 static void render_filename(char *filename, size_t buflen, char **cmd, const char *suffix)
@@ -223,482 +856,2308 @@ static void render_filename(char *filename, size_t buflen, char **cmd, const cha
 	filename[len] = 0;
 }
 
-static void flatten_filename(char *filename, size_t buflen, char *orig_filename)
+/* A path that doesn't fit is not cut short, two deep files would end up with
+ * the same entry. Returns -1 and the caller skips the file.
+ */
+static int flatten_filename(char *filename, size_t buflen, char *orig_filename)
 {
 	char *cmd[3] = {"", orig_filename, NULL};
+
+	if (strlen(orig_filename) + 5 >= buflen)
+		return -1;
+
 	render_filename(filename, buflen, cmd, "");
+	return 0;
 }
 
-static void file_collector(docket_state_t *state, char *dir, char *filename)
+static manifest_t *manifest_new(void)
 {
-	int fd;
-	int ret;
-	struct stat stbuf;
-	int nrcvd;
-	char buf[900*1024];
-	char flat_filename[128];
-
-	docket_log(state, "Collect file %s", filename);
+	manifest_t *m = malloc(sizeof(*m));
 
-	fd = wio_open(filename, O_RDONLY, 0);
-	if (fd < 0) {
-		// TODO: Log error
-		docket_log(state, "Failed to open file %s: %m", filename);
-		return;
+	if (m && manifest_init(m) < 0) {
+		free(m);
+		m = NULL;
 	}
+	return m;
+}
 
-	ret = wio_fstat(fd, &stbuf);
-	if (ret < 0) {
-		// TODO: Log error
-		docket_log(state, "Failed to fstat file %s: %m", filename);
-		wio_close(fd);
-		return;
+static void manifest_delete(manifest_t *m)
+{
+	if (m) {
+		manifest_free(m);
+		free(m);
 	}
+}
 
-	if (!S_ISREG(stbuf.st_mode)) {
-		docket_log(state, "File %s is not a regular file", filename);
-		wio_close(fd);
-		return;
-	}
+static int manifest_name_valid(const char *name)
+{
+	const char *p;
 
-	nrcvd = wio_read(fd, buf, sizeof(buf));
-	if (nrcvd < 0) {
-		// TODO: Log error
-		docket_log(state, "Failed to read file %s: %m\n", filename);
-		wio_close(fd);
-		return;
+	if (name[0] == 0 || name[0] == '.' || strlen(name) >= 64)
+		return 0;
+
+	for (p = name; *p; p++) {
+		if (!isalnum(*p) && *p != '_' && *p != '-' && *p != '.')
+			return 0;
 	}
 
-	flatten_filename(flat_filename, sizeof(flat_filename), filename);
+	return 1;
+}
 
-	if (stbuf.st_size == 0) {
-		// Read a proc/sysfs file, unknown size, assume fitting into a fixed buffer in one read
-		send_all(state, dir, flat_filename, buf, nrcvd, sizeof(buf));
-	} else {
-		// Read a regular file, known file in advance, requires more than one read
-		int nsent = 0;
-		unsigned size = stbuf.st_size;
-		wire_lock_take(&state->write_lock);
+static void manifest_filename(char *buf, size_t buf_size, const char *name)
+{
+	snprintf(buf, buf_size, "%s/%s.manifest", DOCKET_STATE_DIR, name);
+}
 
-		if (nrcvd < sizeof(buf)) {
-			// It's possible the file size is smaller than one buffer, in which
-			// case adjust the size, this is mostly relevant for sysfs files
-			size = nrcvd;
-		}
-		send_tar_header(state, dir, flat_filename, size);
+static void cursors_filename(char *buf, size_t buf_size, const char *name)
+{
+	snprintf(buf, buf_size, "%s/%s.cursors", DOCKET_STATE_DIR, name);
+}
 
-		send_buf(state, buf, nrcvd);
-		nsent += nrcvd;
-		while (nsent < size) {
-			unsigned remaining = size - nsent;
-			unsigned toread = remaining > sizeof(buf) ? sizeof(buf) : remaining;
-			nrcvd = wio_read(fd, buf, toread);
-			if (nrcvd <= 0) {
-				wire_log(WLOG_DEBUG, "sending zeroes %u", nrcvd);
-				nsent += send_buf_zeros(state, buf, sizeof(buf), size - nsent);
-			} else {
-				wire_log(WLOG_DEBUG, "sending data %u", nrcvd);
-				send_buf(state, buf, nrcvd);
-				nsent += nrcvd;
-			}
-		}
-		send_tar_pad(state, buf, sizeof(buf), size);
+/* A regular file is considered unchanged when its inode, size and mtime are
+ * all the same as when it was last sent, this avoids reading it at all.
+ */
+static manifest_entry_t *manifest_stat_unchanged(docket_state_t *state, const char *filename, const struct stat *st)
+{
+	manifest_entry_t *e;
 
-		wire_lock_release(&state->write_lock);
-	}
+	if (!state->since || st->st_size == 0)
+		return NULL;
 
-	wio_close(fd);
+	e = manifest_find(state->since, filename);
+	if (e && e->ino == st->st_ino && e->size == st->st_size &&
+	    e->mtime == st->st_mtim.tv_sec && e->mtime_nsec == st->st_mtim.tv_nsec)
+		return e;
+
+	return NULL;
 }
 
-static void glob_collector(docket_state_t *state, char *dir, char *pattern)
+/* Pseudo files have no useful size or mtime, compare the content instead */
+static int manifest_content_unchanged(docket_state_t *state, const char *filename, off_t size, uint64_t hash)
 {
-	int ret;
-	glob_t globbuf;
-	int i;
+	manifest_entry_t *e;
 
-	memset(&globbuf, 0, sizeof(globbuf));
-	ret = wio_glob(pattern, GLOB_NOSORT, NULL, &globbuf);
-	if (ret != 0) {
-		docket_log(state, "Glob for pattern %s failed with error %d", pattern, ret);
-		return;
-	}
+	if (!state->since)
+		return 0;
 
-	for (i = 0; i < globbuf.gl_pathc; i++) {
-		// TODO: In the future we can spawn more wires here to do all the files in parallel
-		file_collector(state, dir, globbuf.gl_pathv[i]);
-	}
+	e = manifest_find(state->since, filename);
+	return e && e->size == size && e->hash == hash;
+}
 
-	wio_globfree(&globbuf);
+static void manifest_record(docket_state_t *state, const char *filename, const struct stat *st, off_t size, uint64_t hash)
+{
+	if (state->sent)
+		manifest_set(state->sent, filename, st, size, hash);
 }
 
-struct tree_args {
+static void send_unchanged(docket_state_t *state, char *dir, const char *flat_filename)
+{
+	char stub_filename[FLAT_PATH_MAX + 16];
+	char buf[1];
+
+	snprintf(stub_filename, sizeof(stub_filename), "%s.unchanged", flat_filename);
+	send_all(state, dir, stub_filename, buf, 0, sizeof(buf));
+}
+
+/* Lines of a list often overlap, a FILE under a TREE or GLOBs that match the
+ * same files. Every file is claimed before it is read so it goes out once per
+ * directory, the set reuses the manifest with just the paths.
+ */
+static int collected_claim(docket_state_t *state, const char *dir, const char *filename)
+{
+	char key[TAR_PATH_MAX + PLAN_DIR_MAX];
+	struct stat st;
+
+	// Too long to be collected anyway, the collector skips it
+	if (!state->collected || snprintf(key, sizeof(key), "%s/%s", dir, filename) >= sizeof(key))
+		return 1;
+
+	if (manifest_find(state->collected, key)) {
+		docket_log(state, "File %s is already collected", filename);
+		return 0;
+	}
+
+	memset(&st, 0, sizeof(st));
+	manifest_set(state->collected, key, &st, 0, 0);
+	return 1;
+}
+
+/* Pseudo files in /proc and /sys have no size, they are read to the end and
+ * whatever doesn't fit the buffer is spooled. A file that io_uring started
+ * has its first have bytes in buf already and the rest is read from the ring.
+ */
+static void pseudo_file_collector(docket_state_t *state, char *dir, char *filename, char *flat_filename, int fd, uring_file_t *more, struct stat *st, char *buf, size_t buf_size, size_t have)
+{
+	spooled_t sp;
+	uint64_t hash = HASH_INIT;
+	ssize_t nrcvd = 1;
+
+	spooled_init(&sp, buf, buf_size);
+
+	if (have > 0) {
+		if (state->since || state->sent)
+			hash = hash_buf(hash, sp.buf, have);
+		if (spooled_commit(state, &sp, have) < 0)
+			nrcvd = 0;
+	}
+
+	while (nrcvd > 0) {
+		if (more)
+			nrcvd = uring_read_more(more, sp.buf + sp.len, sp.buf_size - sp.len);
+		else
+			nrcvd = wio_read(fd, sp.buf + sp.len, sp.buf_size - sp.len);
+		if (nrcvd < 0) {
+			if (spooled_len(&sp) == 0) {
+				docket_log(state, "Failed to read file %s: %m", filename);
+				return;
+			}
+			docket_log(state, "Failed to read file %s, it is truncated: %m", filename);
+			break;
+		}
+
+		if (state->since || state->sent)
+			hash = hash_buf(hash, sp.buf + sp.len, nrcvd);
+		if (nrcvd > 0 && spooled_commit(state, &sp, nrcvd) < 0)
+			break;
+	}
+
+	if (manifest_content_unchanged(state, filename, spooled_len(&sp), hash)) {
+		docket_log(state, "File %s content is unchanged", filename);
+		send_unchanged(state, dir, flat_filename);
+	} else {
+		send_spooled(state, dir, flat_filename, &sp, NULL);
+	}
+
+	manifest_record(state, filename, st, spooled_len(&sp), hash);
+	spooled_free(&sp);
+}
+
+// Collect an already open file, the fd is closed when done
+static void file_collector_fd(docket_state_t *state, char *dir, char *filename, int fd)
+{
+	int ret;
+	struct stat stbuf;
+	int nrcvd;
+	uint64_t hash = 0;
+	manifest_entry_t *unchanged;
+	char *buf;
+	size_t buf_size = BUFPOOL_LARGE;
+	char flat_filename[FLAT_PATH_MAX];
+
+	ret = wio_fstat(fd, &stbuf);
+	if (ret < 0) {
+		// TODO: Log error
+		docket_log(state, "Failed to fstat file %s: %m", filename);
+		wio_close(fd);
+		return;
+	}
+
+	if (!S_ISREG(stbuf.st_mode)) {
+		docket_log(state, "File %s is not a regular file", filename);
+		wio_close(fd);
+		return;
+	}
+
+	if (flatten_filename(flat_filename, sizeof(flat_filename), filename) < 0) {
+		docket_log(state, "Path %s is too long to collect, skipping it", filename);
+		wio_close(fd);
+		return;
+	}
+
+	unchanged = manifest_stat_unchanged(state, filename, &stbuf);
+	if (unchanged) {
+		docket_log(state, "File %s is unchanged", filename);
+		manifest_record(state, filename, &stbuf, unchanged->size, unchanged->hash);
+		send_unchanged(state, dir, flat_filename);
+		wio_close(fd);
+		return;
+	}
+
+	buf = bufpool_get(buf_size);
+	if (!buf) {
+		docket_log(state, "No buffer to collect file %s", filename);
+		wio_close(fd);
+		return;
+	}
+
+	if (stbuf.st_size == 0) {
+		pseudo_file_collector(state, dir, filename, flat_filename, fd, NULL, &stbuf, buf, buf_size, 0);
+		bufpool_put(buf);
+		wio_close(fd);
+		return;
+	}
+
+	if (stbuf.st_size > buf_size) {
+		// Large regular file, it is sent without copying it through our buffer
+		nrcvd = 0;
+	} else {
+		nrcvd = wio_read(fd, buf, buf_size);
+		if (nrcvd < 0) {
+			// TODO: Log error
+			docket_log(state, "Failed to read file %s: %m\n", filename);
+			bufpool_put(buf);
+			wio_close(fd);
+			return;
+		}
+
+		if (state->since || state->sent)
+			hash = hash_buf(HASH_INIT, buf, nrcvd);
+
+		if (nrcvd < buf_size && manifest_content_unchanged(state, filename, nrcvd, hash)) {
+			docket_log(state, "File %s content is unchanged", filename);
+			manifest_record(state, filename, &stbuf, nrcvd, hash);
+			send_unchanged(state, dir, flat_filename);
+			bufpool_put(buf);
+			wio_close(fd);
+			return;
+		}
+	}
+
+	// A regular file, its size is known in advance
+	docket_stream_t stream;
+	off_t nsent = 0;
+	off_t size = stbuf.st_size;
+	stream_open(state, &stream);
+
+	if (size <= buf_size && nrcvd < buf_size) {
+		// It's possible the file size is smaller than one buffer, in which
+		// case adjust the size, this is mostly relevant for sysfs files
+		size = nrcvd;
+	}
+	send_tar_header(&stream, dir, flat_filename, size, &stbuf.st_mtim);
+
+	if (nrcvd > 0) {
+		send_buf(&stream, buf, nrcvd);
+		nsent += nrcvd;
+	}
+
+	// The rest of the file goes without copying it through our buffer
+	if (nsent < size) {
+		send_file(&stream, fd, buf, buf_size, nsent, size - nsent);
+		hash = 0; // Not hashed, only the stat info counts
+	}
+
+	send_tar_pad(&stream, buf, buf_size, size);
+
+	stream_close(&stream);
+	manifest_record(state, filename, &stbuf, size, hash);
+
+	bufpool_put(buf);
+	wio_close(fd);
+}
+
+static int pseudo_path(const char *filename)
+{
+	return strncmp(filename, "/proc/", 6) == 0 || strncmp(filename, "/sys/", 5) == 0;
+}
+
+// Send a small file that was read whole into buf
+static void small_file_send(docket_state_t *state, char *dir, char *filename, const struct stat *st, char *buf, size_t len)
+{
+	char flat_filename[FLAT_PATH_MAX];
+	manifest_entry_t *unchanged;
+	docket_stream_t stream;
+	uint64_t hash = 0;
+
+	if (flatten_filename(flat_filename, sizeof(flat_filename), filename) < 0) {
+		docket_log(state, "Path %s is too long to collect, skipping it", filename);
+		return;
+	}
+
+	unchanged = manifest_stat_unchanged(state, filename, st);
+	if (unchanged) {
+		docket_log(state, "File %s is unchanged", filename);
+		manifest_record(state, filename, st, unchanged->size, unchanged->hash);
+		send_unchanged(state, dir, flat_filename);
+		return;
+	}
+
+	if (state->since || state->sent)
+		hash = hash_buf(HASH_INIT, buf, len);
+
+	if (manifest_content_unchanged(state, filename, len, hash)) {
+		docket_log(state, "File %s content is unchanged", filename);
+		manifest_record(state, filename, st, len, hash);
+		send_unchanged(state, dir, flat_filename);
+		return;
+	}
+
+	// Like the spooled pseudo files, an mtime of 0 when there is no size
+	stream_open(state, &stream);
+	send_tar_header(&stream, dir, flat_filename, len, st->st_size == 0 ? NULL : &st->st_mtim);
+	send_buf(&stream, buf, len);
+	send_tar_pad(&stream, buf, BUFPOOL_SMALL, len);
+	stream_close(&stream);
+
+	manifest_record(state, filename, st, len, hash);
+}
+
+/* A pseudo file that goes on past the small buffer, what was read moves to a
+ * large buffer and the rest is read from where uring stopped and spooled.
+ */
+static void uring_file_rest(docket_state_t *state, char *dir, char *filename, int fd, uring_file_t *more, const struct stat *st, char *small, size_t len)
+{
+	char flat_filename[FLAT_PATH_MAX];
+	struct stat stbuf = *st;
+	manifest_entry_t *unchanged;
+	char *buf;
+
+	if (flatten_filename(flat_filename, sizeof(flat_filename), filename) < 0) {
+		docket_log(state, "Path %s is too long to collect, skipping it", filename);
+		return;
+	}
+
+	unchanged = manifest_stat_unchanged(state, filename, st);
+	if (unchanged) {
+		docket_log(state, "File %s is unchanged", filename);
+		manifest_record(state, filename, st, unchanged->size, unchanged->hash);
+		send_unchanged(state, dir, flat_filename);
+		return;
+	}
+
+	buf = bufpool_get(BUFPOOL_LARGE);
+	if (!buf) {
+		docket_log(state, "No buffer to collect file %s", filename);
+		return;
+	}
+
+	memcpy(buf, small, len);
+	pseudo_file_collector(state, dir, filename, flat_filename, fd, more, &stbuf, buf, BUFPOOL_LARGE, len);
+	bufpool_put(buf);
+}
+
+/* Small /proc and /sys files are read through io_uring, which batches the
+ * open, read and close of all the wires of the thread in one syscall instead
+ * of three trips to the I/O threads. Larger ones go on through the ring from
+ * where the first read stopped. Returns -1 to take the usual way, for errors
+ * or if io_uring isn't there.
+ */
+static int uring_file_collector(docket_state_t *state, char *dir, char *filename)
+{
+	uring_file_t more;
+	struct stat stbuf;
+	ssize_t len;
+	char *buf;
+
+	buf = bufpool_get(BUFPOOL_SMALL);
+	if (!buf)
+		return -1;
+
+	len = uring_read_file(filename, buf, BUFPOOL_SMALL, &stbuf, &more);
+	if (len < 0 || !S_ISREG(stbuf.st_mode)) {
+		uring_file_close(&more);
+		bufpool_put(buf);
+		return -1;
+	}
+
+	if (more.fd >= 0)
+		uring_file_rest(state, dir, filename, -1, &more, &stbuf, buf, len);
+	else
+		small_file_send(state, dir, filename, &stbuf, buf, len);
+	uring_file_close(&more);
+	bufpool_put(buf);
+	return 0;
+}
+
+// The same for a file a walk already opened, the fd is closed when done
+static int uring_file_collector_fd(docket_state_t *state, char *dir, char *filename, int fd, const struct stat *st)
+{
+	ssize_t len;
+	int more;
+	char *buf;
+
+	buf = bufpool_get(BUFPOOL_SMALL);
+	if (!buf)
+		return -1;
+
+	len = uring_read_fd(fd, buf, BUFPOOL_SMALL, &more);
+	if (len < 0) {
+		bufpool_put(buf);
+		// The usual way reads it again from the start
+		if (lseek(fd, 0, SEEK_SET) < 0) {
+			docket_log(state, "Failed to rewind file %s: %m", filename);
+			wio_close(fd);
+			return 0;
+		}
+		return -1;
+	}
+
+	// The fd is a plain one, the rest goes through the I/O threads
+	if (more)
+		uring_file_rest(state, dir, filename, fd, NULL, st, buf, len);
+	else
+		small_file_send(state, dir, filename, st, buf, len);
+	bufpool_put(buf);
+	wio_close(fd);
+	return 0;
+}
+
+static void file_collector(docket_state_t *state, char *dir, char *filename)
+{
+	int fd;
+
+	if (!collected_claim(state, dir, filename))
+		return;
+
+	docket_log(state, "Collect file %s", filename);
+
+	if (pseudo_path(filename) && uring_file_collector(state, dir, filename) == 0)
+		return;
+
+	fd = wio_open(filename, O_RDONLY, 0);
+	if (fd < 0) {
+		// TODO: Log error
+		docket_log(state, "Failed to open file %s: %m", filename);
+		return;
+	}
+
+	file_collector_fd(state, dir, filename, fd);
+}
+
+// docketd is built with a 64 bit off_t
+#define OFF_T_MAX ((unsigned long long)INT64_MAX)
+
+/* Parse a size with an optional K, M or G suffix, an L suffix makes it a
+ * number of lines instead of bytes.
+ */
+static int parse_window_size(const char *str, off_t *size, int *lines)
+{
+	char *end;
+	unsigned long long val;
+	unsigned shift = 0;
+
+	// strtoull takes a sign and spaces, a size is only digits
+	if (!isdigit((unsigned char)*str))
+		return -1;
+
+	errno = 0;
+	val = strtoull(str, &end, 10);
+	if (errno || end == str)
+		return -1;
+
+	*lines = 0;
+	switch (*end) {
+		case 'G': shift = 30; end++; break;
+		case 'M': shift = 20; end++; break;
+		case 'K': shift = 10; end++; break;
+		case 'L':
+			*lines = 1;
+			end++;
+			break;
+	}
+
+	if (*end != 0)
+		return -1;
+
+	// It has to fit an off_t once multiplied
+	if (val > (OFF_T_MAX >> shift))
+		return -1;
+
+	*size = val << shift;
+	return 0;
+}
+
+// A plain count, only digits and at most max
+static int parse_count(const char *str, unsigned long long max, unsigned long long *val)
+{
+	char *end;
+
+	if (!isdigit((unsigned char)*str))
+		return -1;
+
+	errno = 0;
+	*val = strtoull(str, &end, 10);
+	if (errno || *end != 0 || *val > max)
+		return -1;
+	return 0;
+}
+
+/* Find where the last lines of the file start by reading backwards from the
+ * end, a newline at the very end doesn't count as a line.
+ */
+static off_t tail_lines_offset(int fd, off_t file_size, off_t lines, char *buf, size_t buf_size)
+{
+	off_t offset = file_size;
+	off_t found = 0;
+	ssize_t ret;
+	ssize_t i;
+
+	if (lines == 0)
+		return file_size;
+
+	while (offset > 0) {
+		size_t toread = offset > buf_size ? buf_size : offset;
+
+		ret = wio_pread(fd, buf, toread, offset - toread);
+		if (ret != toread)
+			return -1;
+
+		for (i = toread - 1; i >= 0; i--) {
+			if (buf[i] != '\n' || offset - toread + i == file_size - 1)
+				continue;
+			if (++found == lines)
+				return offset - toread + i + 1;
+		}
+
+		offset -= toread;
+	}
+
+	return 0;
+}
+
+static void send_file_window(docket_state_t *state, char *dir, char *name, int fd, const struct stat *st, off_t offset, off_t len, char *buf, size_t buf_size)
+{
+	docket_stream_t stream;
+
+	stream_open(state, &stream);
+	send_tar_header(&stream, dir, name, len, &st->st_mtim);
+	send_file(&stream, fd, buf, buf_size, offset, len);
+	send_tar_pad(&stream, buf, buf_size, len);
+	stream_close(&stream);
+}
+
+/* Collect only a window of a regular file, the window is read with pread or
+ * sent with sendfile so the rest of the file is never touched.
+ */
+static void window_collector(docket_state_t *state, char *dir, char *filename, off_t offset, off_t len, int tail, int lines)
+{
+	struct stat stbuf;
+	char *buf;
+	char flat_filename[FLAT_PATH_MAX];
+	char window_filename[FLAT_PATH_MAX + 64];
+	int fd;
+
+	if (flatten_filename(flat_filename, sizeof(flat_filename), filename) < 0) {
+		docket_log(state, "Path %s is too long to collect, skipping it", filename);
+		return;
+	}
+
+	fd = wio_open(filename, O_RDONLY, 0);
+	if (fd < 0) {
+		docket_log(state, "Failed to open file %s: %m", filename);
+		return;
+	}
+
+	if (wio_fstat(fd, &stbuf) < 0) {
+		docket_log(state, "Failed to fstat file %s: %m", filename);
+		wio_close(fd);
+		return;
+	}
+
+	if (!S_ISREG(stbuf.st_mode) || stbuf.st_size == 0) {
+		docket_log(state, "File %s is not a regular file with a size, can't collect a window of it", filename);
+		wio_close(fd);
+		return;
+	}
+
+	buf = bufpool_get(BUFPOOL_SMALL);
+	if (!buf) {
+		docket_log(state, "No buffer to collect file %s", filename);
+		wio_close(fd);
+		return;
+	}
+
+	if (tail) {
+		if (lines) {
+			offset = tail_lines_offset(fd, stbuf.st_size, len, buf, BUFPOOL_SMALL);
+			if (offset < 0) {
+				docket_log(state, "Failed to read file %s: %m", filename);
+				bufpool_put(buf);
+				wio_close(fd);
+				return;
+			}
+		} else {
+			offset = stbuf.st_size > len ? stbuf.st_size - len : 0;
+		}
+		len = stbuf.st_size - offset;
+	} else {
+		if (offset > stbuf.st_size)
+			offset = stbuf.st_size;
+		if (len > stbuf.st_size - offset)
+			len = stbuf.st_size - offset;
+	}
+
+	docket_log(state, "Collect %lld bytes of file %s from offset %lld", (long long)len, filename, (long long)offset);
+
+	if (tail)
+		snprintf(window_filename, sizeof(window_filename), "%s.tail", flat_filename);
+	else
+		snprintf(window_filename, sizeof(window_filename), "%s.%lld-%lld", flat_filename, (long long)offset, (long long)(offset + len));
+
+	send_file_window(state, dir, window_filename, fd, &stbuf, offset, len, buf, BUFPOOL_SMALL);
+	bufpool_put(buf);
+	wio_close(fd);
+}
+
+static void tail_collector(docket_state_t *state, char *dir, char *filename, char *size)
+{
+	off_t len;
+	int lines;
+
+	if (parse_window_size(size, &len, &lines) < 0) {
+		docket_log(state, "Invalid size '%s' for TAIL of %s", size, filename);
+		return;
+	}
+
+	window_collector(state, dir, filename, 0, len, 1, lines);
+}
+
+static void range_collector(docket_state_t *state, char *dir, char *filename, char *offset, char *size)
+{
+	off_t off;
+	off_t len;
+	int lines;
+
+	if (parse_window_size(offset, &off, &lines) < 0 || lines ||
+	    parse_window_size(size, &len, &lines) < 0 || lines) {
+		docket_log(state, "Invalid range %s|%s for RANGE of %s", offset, size, filename);
+		return;
+	}
+
+	window_collector(state, dir, filename, off, len, 0, 0);
+}
+
+/* Collect what was appended to a log since the last time this client got it.
+ * The cursors reuse the manifest, the size is the offset we got to and the
+ * hash is the number of the last segment sent. Every collection sends a new
+ * numbered segment, an inode change or a shrinking file means the log was
+ * rotated and it is sent again from the start.
+ */
+static void log_collector(docket_state_t *state, char *dir, char *filename)
+{
+	manifest_entry_t *cursor;
+	struct stat stbuf;
+	char *buf;
+	char flat_filename[FLAT_PATH_MAX];
+	char segment_filename[FLAT_PATH_MAX + 32];
+	uint64_t segment = 1;
+	off_t offset = 0;
+	int fd;
+
+	if (!state->cursors) {
+		docket_log(state, "No CURSOR for the session, collecting all of %s", filename);
+		file_collector(state, dir, filename);
+		return;
+	}
+
+	if (flatten_filename(flat_filename, sizeof(flat_filename), filename) < 0) {
+		docket_log(state, "Path %s is too long to collect, skipping it", filename);
+		return;
+	}
+
+	fd = wio_open(filename, O_RDONLY, 0);
+	if (fd < 0) {
+		docket_log(state, "Failed to open file %s: %m", filename);
+		return;
+	}
+
+	if (wio_fstat(fd, &stbuf) < 0) {
+		docket_log(state, "Failed to fstat file %s: %m", filename);
+		wio_close(fd);
+		return;
+	}
+
+	if (!S_ISREG(stbuf.st_mode)) {
+		docket_log(state, "File %s is not a regular file", filename);
+		wio_close(fd);
+		return;
+	}
+
+	cursor = manifest_find(state->cursors, filename);
+	if (cursor) {
+		segment = cursor->hash + 1;
+		if (cursor->ino == stbuf.st_ino && cursor->size <= stbuf.st_size)
+			offset = cursor->size;
+		else
+			docket_log(state, "Log %s was rotated, collecting it from the start", filename);
+	}
+
+	if (offset == stbuf.st_size) {
+		docket_log(state, "Log %s has nothing new since offset %lld", filename, (long long)offset);
+		wio_close(fd);
+		return;
+	}
+
+	docket_log(state, "Collect log %s from offset %lld as segment %llu", filename, (long long)offset, (unsigned long long)segment);
+
+	buf = bufpool_get(BUFPOOL_SMALL);
+	if (!buf) {
+		docket_log(state, "No buffer to collect log %s", filename);
+		wio_close(fd);
+		return;
+	}
+
+	snprintf(segment_filename, sizeof(segment_filename), "%s.%06llu", flat_filename, (unsigned long long)segment);
+	send_file_window(state, dir, segment_filename, fd, &stbuf, offset, stbuf.st_size - offset, buf, BUFPOOL_SMALL);
+	bufpool_put(buf);
+
+	if (manifest_set(state->cursors, filename, &stbuf, stbuf.st_size, segment) < 0)
+		docket_log(state, "Failed to keep the cursor of %s", filename);
+
+	wio_close(fd);
+}
+
+/* The matches of a GLOB line are collected by a few wires at once, each file
+ * goes out as soon as it is read.
+ */
+struct glob_run {
+	docket_state_t *state;
+	unsigned log_id;
+	char *dir;
+	char *path;
+	unsigned running;
+	wire_wait_t wait;
+};
+
+static void task_glob_collector_file(void *arg)
+{
+	struct glob_run *run = arg;
+	char *path = run->path;
+	log_binding_t binding;
+
+	log_bind(run->state, &binding, run->log_id);
+	file_collector(run->state, run->dir, path);
+	log_unbind(run->state, &binding);
+
+	run->running--;
+	wire_wait_resume(&run->wait);
+}
+
+static void glob_wait(struct glob_run *run, unsigned running_max)
+{
+	while (run->running > running_max) {
+		wire_wait_reset(&run->wait);
+		wire_wait_single(&run->wait);
+	}
+}
+
+static void glob_collector(docket_state_t *state, char *dir, char *pattern, char **opts)
+{
+	struct glob_run run;
+	unsigned parallel = GLOB_PARALLEL_DEFAULT;
+	int ret;
+	glob_t globbuf;
+	int i;
+
+	for (i = 0; opts[i] != NULL; i++) {
+		if (strncmp(opts[i], "parallel=", 9) == 0 && atoi(opts[i] + 9) > 0) {
+			parallel = atoi(opts[i] + 9);
+		} else {
+			docket_log(state, "Invalid GLOB option %s", opts[i]);
+			return;
+		}
+	}
+	if (parallel > GLOB_PARALLEL_MAX)
+		parallel = GLOB_PARALLEL_MAX;
+
+	// Sorted so the files of a directory are read together
+	memset(&globbuf, 0, sizeof(globbuf));
+	ret = wio_glob(pattern, 0, NULL, &globbuf);
+	if (ret != 0) {
+		docket_log(state, "Glob for pattern %s failed with error %d", pattern, ret);
+		return;
+	}
+
+	run.state = state;
+	run.log_id = log_current_id(state);
+	run.dir = dir;
+	run.running = 0;
+	wire_wait_init(&run.wait);
+
+	for (i = 0; i < globbuf.gl_pathc; i++) {
+		if (session_deadline_passed(state)) {
+			docket_log(state, "Deadline passed, skipping %zu files of %s", globbuf.gl_pathc - i, pattern);
+			break;
+		}
+
+		glob_wait(&run, parallel - 1);
+
+		run.path = globbuf.gl_pathv[i];
+		run.running++;
+		if (!wire_pool_alloc_block(&exec_pool, "glob collector file", task_glob_collector_file, &run)) {
+			run.running--;
+			file_collector(state, dir, run.path);
+			continue;
+		}
+		wire_yield(); // Let it copy the arguments
+	}
+
+	// The paths and the run itself must outlive the file wires
+	glob_wait(&run, 0);
+	wio_globfree(&globbuf);
+}
+
+struct tree_args {
+	docket_state_t *state;
+	unsigned log_id;
+	char *dir;
+	char *basepath;
+	char *name;
+};
+
+static void task_tree_collector_file(void *arg)
+{
+	struct tree_args *tree_args = arg;
+	docket_state_t *state = tree_args->state;
+	log_binding_t binding;
+	char dir[PLAN_DIR_MAX];
+	char basepath[TAR_PATH_MAX];
+	int too_long;
+
+	strcpy(dir, tree_args->dir);
+	too_long = snprintf(basepath, sizeof(basepath), "%s/%s", tree_args->basepath, tree_args->name) >= sizeof(basepath);
+	log_bind(state, &binding, tree_args->log_id);
+	// At this stage we are clear to reschedule
+
+	if (too_long) {
+		docket_log(state, "Path %s is too long to collect, skipping it", tree_args->name);
+	} else if (session_deadline_passed(state)) {
+		docket_log(state, "Deadline passed, skipping file %s", basepath);
+	} else {
+		docket_log(state, "Tree collector for file %s", basepath);
+		file_collector(state, dir, basepath);
+	}
+
+	log_unbind(state, &binding);
+	remaining_dec(state);
+}
+
+struct walk_file_args {
+	docket_state_t *state;
+	unsigned log_id;
+	char *dir;
+	walk_entry_t *entry;
+};
+
+static void task_walk_collector_file(void *arg)
+{
+	struct walk_file_args *args = arg;
+	docket_state_t *state = args->state;
+	walk_entry_t *e = args->entry;
+	log_binding_t binding;
+	char dir[PLAN_DIR_MAX];
+
+	snprintf(dir, sizeof(dir), "%s", args->dir);
+	log_bind(state, &binding, args->log_id);
+	// At this stage we are clear to reschedule
+
+	if (session_deadline_passed(state)) {
+		docket_log(state, "Deadline passed, skipping file %s", e->path);
+	} else if (collected_claim(state, dir, e->path)) {
+		docket_log(state, "Collect file %s", e->path);
+		if (!pseudo_path(e->path) || uring_file_collector_fd(state, dir, e->path, e->fd, &e->st) < 0)
+			file_collector_fd(state, dir, e->path, e->fd);
+		e->fd = -1;
+	}
+
+	walk_entry_free(e);
+	log_unbind(state, &binding);
+	remaining_dec(state);
+}
+
+// Collect the files found by a walk as they come, ends the walk
+static void walk_collect(docket_state_t *state, char *dir, walk_t *walk, const char *what)
+{
+	struct walk_file_args args;
+	walk_entry_t *e;
+
+	args.state = state;
+	args.log_id = log_current_id(state);
+	args.dir = dir;
+
+	while ((e = walk_next(walk)) != NULL) {
+		if (session_deadline_passed(state)) {
+			docket_log(state, "Deadline passed, not collecting the rest of %s", what);
+			walk_entry_free(e);
+			break;
+		}
+
+		args.entry = e;
+		state->remaining++;
+		wire_pool_alloc_block(&exec_pool, "walk collector file", task_walk_collector_file, &args);
+		wire_yield(); // Let it copy the arguments
+	}
+
+	walk_end(walk);
+
+	docket_log(state, "Walk of %s went over %llu directories and found %llu files", what, walk->dirs, walk->files);
+	if (walk->errors)
+		docket_log(state, "Walk of %s had %u errors, the first: %s", what, walk->errors, walk->error);
+}
+
+/* The optional limits of a TREE line, the counters are updated from the walk
+ * threads.
+ */
+struct tree_limits {
+	unsigned max_depth;
+	unsigned long long max_files;
+	unsigned long long max_bytes;
+	unsigned long long files;
+	unsigned long long bytes;
+	int limited;
+};
+
+static int tree_filter(void *arg, const char *path, const char *name, unsigned depth, const struct stat *st)
+{
+	struct tree_limits *limits = arg;
+
+	UNUSED(path);
+
+	if (S_ISDIR(st->st_mode)) {
+		// Hidden directories are left out
+		if (depth > 0 && name[0] == '.')
+			return WALK_PRUNE;
+		if (__atomic_load_n(&limits->limited, __ATOMIC_RELAXED))
+			return WALK_PRUNE;
+		return 0;
+	}
+
+	if (!S_ISREG(st->st_mode))
+		return 0;
+
+	if (limits->max_files && __atomic_add_fetch(&limits->files, 1, __ATOMIC_RELAXED) > limits->max_files) {
+		__atomic_store_n(&limits->limited, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	if (limits->max_bytes && __atomic_add_fetch(&limits->bytes, st->st_size, __ATOMIC_RELAXED) > limits->max_bytes) {
+		__atomic_store_n(&limits->limited, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	return WALK_COLLECT;
+}
+
+/* Limits are given as depth=N, files=N and bytes=N with an optional K, M or G
+ * suffix. depth=0 takes the files directly under the path, depth=1 also those
+ * one directory further down and so on.
+ */
+static int tree_parse_limits(docket_state_t *state, struct tree_limits *limits, char **opts)
+{
+	unsigned long long val;
+	off_t size;
+	int lines;
+	int i;
+
+	memset(limits, 0, sizeof(*limits));
+	limits->max_depth = WALK_DEPTH_ANY;
+
+	for (i = 0; opts[i] != NULL; i++) {
+		if (strncmp(opts[i], "depth=", 6) == 0 && parse_count(opts[i] + 6, WALK_DEPTH_ANY - 2, &val) == 0) {
+			// The walk counts the files under the path as depth 1
+			limits->max_depth = val + 1;
+		} else if (strncmp(opts[i], "files=", 6) == 0 && parse_count(opts[i] + 6, ULLONG_MAX, &val) == 0 && val > 0) {
+			limits->max_files = val;
+		} else if (strncmp(opts[i], "bytes=", 6) == 0 && parse_window_size(opts[i] + 6, &size, &lines) == 0 && !lines) {
+			limits->max_bytes = size;
+		} else {
+			docket_log(state, "Invalid TREE limit %s", opts[i]);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void tree_collector(docket_state_t *state, char *dir, char *basepath, char **opts)
+{
+	struct tree_limits limits;
+	walk_t walk;
+
+	if (tree_parse_limits(state, &limits, opts) < 0)
+		return;
+
+	docket_log(state, "Tree collector for %s", basepath);
+
+	walk_init(&walk, limits.max_depth, tree_filter, &limits);
+	if (walk_add_root(&walk, basepath) < 0) {
+		walk_end(&walk);
+		docket_log(state, "Failed to start the walk of %s", basepath);
+		return;
+	}
+
+	walk_collect(state, dir, &walk, basepath);
+	if (limits.limited)
+		docket_log(state, "Tree collector for %s stopped at its limits", basepath);
+}
+
+//////
+struct fd_collector_args {
+	docket_state_t *state;
+	unsigned log_id;
+	int fd;
+	pid_t pid;
+	char dir[PLAN_DIR_MAX];
+	char filename[128];
+};
+
+static void task_fd_collector(void *arg)
+{
+	struct fd_collector_args args;
+	log_binding_t binding;
+	char *buf;
+	spooled_t sp;
+	size_t nrcvd;
+	int ret;
+	wire_net_t net;
+
+	// Copy the args
+	memcpy(&args, arg, sizeof(args));
+	log_bind(args.state, &binding, args.log_id);
+
+	// Prepare to read the data
+	set_nonblock(args.fd);
+	wire_net_init(&net, args.fd);
+	wire_timeout_reset(&net.tout, session_timeout_msec(args.state, 120 * 1000)); // 120 seconds
+
+	// Read all the data, what doesn't fit in the buffer is spooled
+	buf = bufpool_get(BUFPOOL_LARGE);
+	if (!buf) {
+		docket_log(args.state, "No buffer to collect %s", args.filename);
+		wire_net_close(&net);
+		wio_kill(args.pid, 9);
+		log_unbind(args.state, &binding);
+		remaining_dec(args.state);
+		return;
+	}
+	spooled_init(&sp, buf, BUFPOOL_LARGE);
+	do {
+		ret = wire_net_read_any(&net, sp.buf + sp.len, sp.buf_size - sp.len, &nrcvd);
+		if (ret >= 0 && spooled_commit(args.state, &sp, nrcvd) < 0)
+			break;
+	} while (ret >= 0 && nrcvd > 0);
+
+	if (ret < 0 && errno != ENODATA) {
+		docket_log(args.state, "Failed to read from process pipe %s: %d (%m)", args.filename, errno);
+	}
+
+	wire_net_close(&net);
+	wio_kill(args.pid, 9);
+
+	if (spooled_len(&sp) > 0)
+		send_spooled(args.state, args.dir, args.filename, &sp, NULL);
+	else
+		docket_log(args.state, "Collected from fd size zero, not emitting file %s", args.filename);
+	spooled_free(&sp);
+	bufpool_put(buf);
+
+	log_unbind(args.state, &binding);
+	remaining_dec(args.state);
+}
+
+static void exec_collector_spawn_one(docket_state_t *state, char *dir, char **cmd)
+{
+	int out_fd;
+	int err_fd;
+	pid_t pid;
+
+	pid = wio_spawn(cmd, NULL, &out_fd, &err_fd);
+	if (pid < 0) {
+		docket_log(state, "Failed to spawn command %s %s %s %s %s %s, errno=%d (%m)",
+				cmd[0], cmd[1] ?  : "", cmd[2] ? : "", cmd[3] ? : "", cmd[4] ? : "", cmd[5] ? "..." : "",
+				errno);
+		return;
+	}
+
+	state->remaining += 2;
+
+	struct fd_collector_args out_args;
+	out_args.state = state;
+	out_args.log_id = log_current_id(state);
+	out_args.pid = pid;
+	strncpy(out_args.dir, dir, sizeof(out_args.dir));
+	out_args.dir[sizeof(out_args.dir)-1] = 0;
+	out_args.fd = out_fd;
+	render_filename(out_args.filename, sizeof(out_args.filename), cmd, ".out");
+	wire_pool_alloc_block(&exec_pool, "fd processor", task_fd_collector, &out_args);
+
+	struct fd_collector_args err_args;
+	err_args.state = state;
+	err_args.log_id = log_current_id(state);
+	err_args.pid = pid;
+	strncpy(err_args.dir, dir, sizeof(err_args.dir));
+	err_args.dir[sizeof(err_args.dir)-1] = 0;
+	err_args.fd = err_fd;
+	render_filename(err_args.filename, sizeof(err_args.filename), cmd, ".err");
+	wire_pool_alloc_block(&exec_pool, "fd processor", task_fd_collector, &err_args);
+
+	// Let the collector wires grab their arguments from out stack
+	wire_yield();
+}
+
+/* Every special argument of the command is replaced by each of its values,
+ * with several of them the command runs for every combination.
+ */
+static void exec_collector(docket_state_t *state, char *dir, char **cmd)
+{
+	const special_arg_list_t *lists[MAX_ARGS];
+	unsigned pos[MAX_ARGS];
+	unsigned idx[MAX_ARGS];
+	char *orig[MAX_ARGS];
+	char values[256];
+	unsigned num_specials = 0;
+	unsigned runs = 1;
+	unsigned run;
+	unsigned i;
+	int len;
+
+	for (i = 1; i < MAX_ARGS && cmd[i] != NULL; i++) {
+		const special_arg_list_t *list = special_arg_get(&state->specials, cmd[i]);
+		if (!list)
+			continue;
+
+		if (list->count == 0) {
+			docket_log(state, "No values for %s, not running %s", cmd[i], cmd[0]);
+			return;
+		}
+
+		if (list->count > EXEC_RUNS_MAX / runs) {
+			docket_log(state, "Too many combinations of special arguments, not running %s", cmd[0]);
+			return;
+		}
+
+		lists[num_specials] = list;
+		pos[num_specials] = i;
+		idx[num_specials] = 0;
+		orig[num_specials] = cmd[i];
+		runs *= list->count;
+		num_specials++;
+	}
+
+	for (run = 0; run < runs; run++) {
+		if (session_deadline_passed(state)) {
+			docket_log(state, "Deadline passed, skipping %u runs of %s", runs - run, cmd[0]);
+			break;
+		}
+
+		len = 0;
+		values[0] = 0;
+		for (i = 0; i < num_specials; i++) {
+			cmd[pos[i]] = lists[i]->items[idx[i]];
+			if (len < sizeof(values))
+				len += snprintf(values + len, sizeof(values) - len, " %s=%s", orig[i], cmd[pos[i]]);
+		}
+
+		if (num_specials)
+			docket_log(state, "Collecting exec %s with%s", cmd[0], values);
+		exec_collector_spawn_one(state, dir, cmd);
+
+		// Step to the next combination, the last special changes fastest
+		for (i = num_specials; i > 0; i--) {
+			if (++idx[i-1] < lists[i-1]->count)
+				break;
+			idx[i-1] = 0;
+		}
+	}
+
+	for (i = 0; i < num_specials; i++)
+		cmd[pos[i]] = orig[i];
+}
+
+static size_t process_find_collector(docket_state_t *state, char *dir, char *buf, size_t buf_len)
+{
+	size_t processed = 0;
+	char *null;
+	struct tree_args tree_args;
+
+	tree_args.state = state;
+	tree_args.log_id = log_current_id(state);
+	tree_args.dir = dir;
+	tree_args.basepath = "/";
+
+	do {
+		null = memchr(buf + processed, 0, buf_len - processed);
+		if (!null)
+			return buf_len - processed;
+
+		tree_args.name = buf + processed;
+
+		docket_log(state, "Find collector for %s", buf+processed);
+		state->remaining++;
+		wire_pool_alloc_block(&exec_pool, "find collector file", task_tree_collector_file, &tree_args);
+		wire_yield(); // Let it copy the arguments
+
+		processed = null - buf + 1;
+	} while (buf_len - processed > 0);
+
+	return buf_len - processed;
+}
+
+// Lines with tests that aren't done in process still run find(1)
+static void find_exec_collector(docket_state_t *state, char *dir, char **cmd)
+{
+	char *args[MAX_ARGS+3];
+	int i, j;
+	pid_t pid;
+	int out_fd;
+	wire_net_t net;
+	size_t buf_len;
+	int ret;
+	size_t nrcvd;
+	char *buf;
+	size_t buf_size = BUFPOOL_MEDIUM;
+
+	j = 0;
+	args[j++] = "/usr/bin/find";
+	for (i = 0; i < MAX_ARGS && cmd[i] != NULL; i++)
+		args[j++] = cmd[i];
+	args[j++] = "-print0";
+	args[j] = 0;
+
+	buf = bufpool_get(buf_size);
+	if (!buf) {
+		docket_log(state, "No buffer for the find collector");
+		return;
+	}
+
+	pid = wio_spawn(args, NULL, &out_fd, NULL);
+	if (pid < 0) {
+		docket_log(state, "Error spawning Find process");
+		bufpool_put(buf);
+		return;
+	}
+
+	// Loop over stdout, split file names by a null character and run file collectors on that
+
+	// Prepare to read the data
+	set_nonblock(out_fd);
+	wire_net_init(&net, out_fd);
+	wire_timeout_reset(&net.tout, session_timeout_msec(state, 10 * 60 * 1000)); // 10 minutes
+
+	// Read all the data
+	buf_len = 0;
+	do {
+		ret = wire_net_read_any(&net, buf+buf_len, buf_size-buf_len, &nrcvd);
+		if (ret >= 0) {
+			buf_len += nrcvd;
+			size_t remaining_buf_len = process_find_collector(state, dir, buf, buf_len);
+			if (remaining_buf_len > 0 && remaining_buf_len != buf_len) {
+				// Move the buf to the start
+				memmove(buf, buf + buf_len - remaining_buf_len, remaining_buf_len);
+			}
+			buf_len = remaining_buf_len;
+		}
+	} while (ret >= 0 && nrcvd > 0 && buf_len < buf_size);
+
+	if (ret < 0 && errno != ENODATA) {
+		docket_log(state, "Failed to read from process pipe for find: %d (%m)", errno);
+	}
+
+	wire_net_close(&net);
+	wio_kill(pid, 9);
+
+	// Process any remaining data
+	if (buf_len > 0)
+		process_find_collector(state, dir, buf, buf_len);
+	bufpool_put(buf);
+}
+
+static void find_collector(docket_state_t *state, char *dir, char **cmd)
+{
+	find_expr_t find;
+	walk_t walk;
+	unsigned num_roots;
+	unsigned i;
+
+	if (find_parse(&find, cmd, &num_roots) < 0) {
+		docket_log(state, "Running find for %s, %s", cmd[0], find.error);
+		find_exec_collector(state, dir, cmd);
+		return;
+	}
+
+	walk_init(&walk, find.max_depth, find_filter, &find);
+	if (num_roots == 0) {
+		if (walk_add_root(&walk, ".") < 0)
+			goto Fallback;
+	}
+	for (i = 0; i < num_roots; i++) {
+		if (walk_add_root(&walk, cmd[i]) < 0) {
+			if (i == 0)
+				goto Fallback;
+			docket_log(state, "Failed to start the walk of %s", cmd[i]);
+		}
+	}
+
+	walk_collect(state, dir, &walk, num_roots ? cmd[0] : ".");
+	find_free(&find);
+	return;
+
+Fallback:
+	walk_end(&walk);
+	find_free(&find);
+	docket_log(state, "No walk threads, running find for %s", num_roots ? cmd[0] : ".");
+	find_exec_collector(state, dir, cmd);
+}
+
+/* A collector line waiting for its turn, lines run by priority and then in
+ * the order they came. Entries of a profile are shared with other sessions.
+ */
+typedef struct queued_line {
+	struct queued_line *next;
 	docket_state_t *state;
-	char *dir;
-	char *basepath;
+	unsigned id;
+	plan_entry_t *entry;
+	int shared;
+} queued_line_t;
+
+static void queued_line_free(queued_line_t *q)
+{
+	if (!q->shared)
+		free(q->entry);
+	free(q);
+}
+
+static void task_line_process(void *arg)
+{
+	queued_line_t *q = arg;
+	docket_state_t *state = q->state;
+	plan_entry_t *e = q->entry;
+	log_binding_t binding;
+	char *args[PLAN_ARGS_MAX + 1];
+
+	log_bind(state, &binding, q->id);
+	docket_log(state, "Collector %s", e->line);
+
+	// The collectors may swap arguments around, the entry itself is shared
+	memcpy(args, e->args, sizeof(args));
+
+	switch (e->type) {
+		case PLAN_FILE:
+			file_collector(state, args[1], args[2]);
+			break;
+		case PLAN_LOG:
+			log_collector(state, args[1], args[2]);
+			break;
+		case PLAN_TAIL:
+			tail_collector(state, args[1], args[2], args[3]);
+			break;
+		case PLAN_RANGE:
+			range_collector(state, args[1], args[2], args[3], args[4]);
+			break;
+		case PLAN_GLOB:
+			glob_collector(state, args[1], args[2], &args[3]);
+			break;
+		case PLAN_TREE:
+			tree_collector(state, args[1], args[2], &args[3]);
+			break;
+		case PLAN_EXEC:
+			exec_collector(state, args[1], &args[2]);
+			break;
+		case PLAN_FIND:
+			find_collector(state, args[1], &args[2]);
+			break;
+	}
+
+	log_unbind(state, &binding);
+	queued_line_free(q);
+	state->running--;
+	if (state->dispatch_waiting)
+		wire_wait_resume(&state->wait);
+	remaining_dec(state);
+}
+
+static void collector_queue_entry(docket_state_t *state, plan_entry_t *e, int shared)
+{
+	queued_line_t **pq;
+	queued_line_t *q;
+
+	q = malloc(sizeof(*q));
+	if (!q) {
+		docket_log(state, "Out of memory queueing '%s'", e->line);
+		if (!shared)
+			free(e);
+		return;
+	}
+
+	q->state = state;
+	q->id = ++state->next_collector_id;
+	q->entry = e;
+	q->shared = shared;
+
+	for (pq = &state->queue; *pq && (*pq)->entry->prio <= e->prio; pq = &(*pq)->next)
+		;
+	q->next = *pq;
+	*pq = q;
+
+	state->remaining++;
+}
+
+static void collector_queue(docket_state_t *state, char *line)
+{
+	plan_entry_t *e;
+	char error[128];
+
+	e = plan_entry_parse(line, error, sizeof(error));
+	if (!e) {
+		docket_log(state, "%s in line %s", error, line);
+		return;
+	}
+
+	collector_queue_entry(state, e, 0);
+}
+
+// PROFILE|<name>, queue all the lines of a profile the daemon loaded
+static void profile_queue(docket_state_t *state, const char *name)
+{
+	profile_t *p;
+	plan_entry_t *e;
+
+	if (state->num_profiles == SESSION_PROFILES_MAX) {
+		docket_log(state, "Too many profiles, skipping profile %s", name);
+		return;
+	}
+
+	p = profile_get(name);
+	if (!p) {
+		docket_log(state, "No profile %s", name);
+		return;
+	}
+
+	// Held until the session is done, a reload doesn't pull it from under us
+	state->profiles[state->num_profiles++] = p;
+	docket_log(state, "Profile %s with %u collectors", name, p->plan.num_entries);
+
+	for (e = p->plan.head; e; e = e->next)
+		collector_queue_entry(state, e, 1);
+}
+
+static void session_profiles_put(docket_state_t *state)
+{
+	unsigned i;
+
+	for (i = 0; i < state->num_profiles; i++)
+		profile_put(state->profiles[i]);
+	state->num_profiles = 0;
+}
+
+static int queued_file_cmp(const void *a, const void *b)
+{
+	const queued_line_t *qa = *(queued_line_t * const *)a;
+	const queued_line_t *qb = *(queued_line_t * const *)b;
+
+	return strcmp(qa->entry->args[2], qb->entry->args[2]);
+}
+
+/* Once the whole list is in, lines that repeat are dropped and within a
+ * priority the FILE lines are put in path order so the files of a directory
+ * are read together. Nothing touches the disk here, overlaps that only show
+ * when collecting, like a FILE under a TREE or two GLOBs, are left to
+ * collected_claim().
+ */
+static void collector_plan(docket_state_t *state)
+{
+	queued_line_t **pq;
+	queued_line_t *q;
+	queued_line_t **nodes;
+	queued_line_t **files;
+	manifest_t *lines;
+	struct stat st;
+	unsigned num_nodes = 0;
+	unsigned num_files;
+	unsigned dups = 0;
+	unsigned start;
+	unsigned end;
+	unsigned i;
+	unsigned j;
+
+	lines = manifest_new();
+	memset(&st, 0, sizeof(st));
+
+	pq = &state->queue;
+	while ((q = *pq) != NULL) {
+		if (lines && manifest_find(lines, q->entry->line)) {
+			*pq = q->next;
+			queued_line_free(q);
+			state->remaining--;
+			dups++;
+			continue;
+		}
+
+		if (lines)
+			manifest_set(lines, q->entry->line, &st, 0, 0);
+
+		num_nodes++;
+		pq = &q->next;
+	}
+	manifest_delete(lines);
+
+	if (dups)
+		docket_log(state, "Dropped %u repeated collector lines", dups);
+
+	nodes = malloc(2 * num_nodes * sizeof(*nodes));
+	if (!nodes)
+		return;
+	files = nodes + num_nodes;
+
+	for (q = state->queue, i = 0; q; q = q->next)
+		nodes[i++] = q;
+
+	// The queue is in priority order already
+	for (start = 0; start < num_nodes; start = end) {
+		num_files = 0;
+		for (end = start; end < num_nodes && nodes[end]->entry->prio == nodes[start]->entry->prio; end++) {
+			if (nodes[end]->entry->type == PLAN_FILE)
+				files[num_files++] = nodes[end];
+		}
+
+		qsort(files, num_files, sizeof(*files), queued_file_cmp);
+		for (i = start, j = 0; i < end; i++) {
+			if (nodes[i]->entry->type == PLAN_FILE)
+				nodes[i] = files[j++];
+		}
+	}
+
+	pq = &state->queue;
+	for (i = 0; i < num_nodes; i++) {
+		*pq = nodes[i];
+		pq = &nodes[i]->next;
+	}
+	*pq = NULL;
+
+	free(nodes);
+}
+
+/* Start queued lines as long as there is room, with wait it keeps at it until
+ * the queue is empty. Once the deadline passed the rest of the queue is
+ * skipped.
+ */
+static void collector_dispatch(docket_state_t *state, int wait)
+{
+	queued_line_t *q;
+
+	while (state->queue) {
+		if (state->running >= SESSION_COLLECTORS_MAX) {
+			if (!wait)
+				return;
+
+			wire_wait_reset(&state->wait);
+			state->dispatch_waiting = 1;
+			wire_wait_single(&state->wait);
+			state->dispatch_waiting = 0;
+			continue;
+		}
+
+		q = state->queue;
+		state->queue = q->next;
+
+		if (session_deadline_passed(state)) {
+			docket_log(state, "Deadline passed, skipping '%s'", q->entry->line);
+			queued_line_free(q);
+			remaining_dec(state);
+			continue;
+		}
+
+		state->running++;
+		wire_pool_alloc_block(&docket_pool, "line processor", task_line_process, q);
+	}
+}
+
+static void collector_queue_free(docket_state_t *state)
+{
+	queued_line_t *q;
+
+	while (state->queue) {
+		q = state->queue;
+		state->queue = q->next;
+		queued_line_free(q);
+		state->remaining--;
+	}
+}
+
+/* In relay mode the daemon forwards the collection list to downstream
+ * daemons and merges their output into its own, a tree of relays spreads the
+ * connections and the bandwidth of a large collection.
+ */
+typedef struct relay {
+	struct relay *next;
+	docket_state_t *state;
+	char ip[64];
+	char name[64];
+	char *lines;
+	size_t lines_len;
+	size_t lines_size;
+} relay_t;
+
+typedef struct relay_conn {
+	wire_net_t net;
+	relay_t *relay;
+	int compressed;
+	decompress_t decompress;
+} relay_conn_t;
+
+/* A downstream entry being forwarded, the output stream is only opened once
+ * the whole header is in so a broken connection never leaves half a header.
+ */
+typedef struct relay_stream {
+	struct relay_stream *next;
+	uint32_t id;
+	int opened;
+	int failed;
+	docket_stream_t out;
+	size_t meta_len;
+	uint64_t data_len;
+	uint64_t written;
+	size_t hdr_len;
+	char hdr[TAR_HEADER_MAX];
+} relay_stream_t;
+
+static int append_buf(char **buf, size_t *len, size_t *size, const char *data, size_t data_len)
+{
+	if (*len + data_len > *size) {
+		size_t new_size = *size ? *size * 2 : 4096;
+		char *new_buf;
+
+		while (new_size < *len + data_len)
+			new_size *= 2;
+
+		new_buf = realloc(*buf, new_size);
+		if (!new_buf)
+			return -1;
+		*buf = new_buf;
+		*size = new_size;
+	}
+
+	memcpy(*buf + *len, data, data_len);
+	*len += data_len;
+	return 0;
+}
+
+/* Keep the lines that a relay forwards downstream, the downstream sessions
+ * get their own protocol, compression and prefix lines.
+ */
+static void relay_list_add(docket_state_t *state, const char *line)
+{
+	if (strncmp(line, "PROTO|", 6) == 0 || strncmp(line, "COMPRESS|", 9) == 0 ||
+	    strncmp(line, "PREFIX|", 7) == 0 || strncmp(line, "RELAY|", 6) == 0)
+		return;
+
+	if (append_buf(&state->list, &state->list_len, &state->list_size, line, strlen(line)) < 0 ||
+	    append_buf(&state->list, &state->list_len, &state->list_size, "\n", 1) < 0)
+		docket_log(state, "Out of memory keeping the list for relays");
+}
+
+static relay_t *relay_find(docket_state_t *state, const char *ip)
+{
+	relay_t *relay;
+
+	for (relay = state->relays; relay; relay = relay->next) {
+		if (strcmp(relay->ip, ip) == 0)
+			return relay;
+	}
+
+	return NULL;
+}
+
+static relay_t *relay_get(docket_state_t *state, const char *ip)
+{
+	relay_t *relay = relay_find(state, ip);
+
+	if (relay)
+		return relay;
+
+	relay = calloc(1, sizeof(*relay));
+	if (!relay)
+		return NULL;
+
+	relay->state = state;
+	snprintf(relay->ip, sizeof(relay->ip), "%s", ip);
+	snprintf(relay->name, sizeof(relay->name), "%s", ip);
+	relay->next = state->relays;
+	state->relays = relay;
+	return relay;
+}
+
+/* RELAY|<ip>|<name>[|<hop ip>...], without hops the daemon at ip is collected
+ * by us, otherwise the line is passed on to our downstream daemon at the
+ * first hop which takes care of the rest of the path.
+ */
+static void relay_line_process(docket_state_t *state, char *line)
+{
+	char *ip = line + 6;
 	char *name;
-};
+	char *hop;
+	relay_t *relay;
 
-static void task_tree_collector_file(void *arg)
+	name = strchr(ip, '|');
+	if (!name || !name[1]) {
+		docket_log(state, "Not enough arguments to RELAY: %s", line);
+		return;
+	}
+	*name++ = 0;
+
+	hop = strchr(name, '|');
+	if (hop)
+		*hop++ = 0;
+
+	if (!hop || !hop[0]) {
+		relay = relay_get(state, ip);
+		if (relay)
+			snprintf(relay->name, sizeof(relay->name), "%s", name);
+	} else {
+		char *rest = strchr(hop, '|');
+		char buf[256];
+		int len;
+
+		if (rest)
+			*rest++ = 0;
+
+		relay = relay_get(state, hop);
+		if (relay) {
+			len = snprintf(buf, sizeof(buf), "RELAY|%s|%s%s%s\n", ip, name, rest ? "|" : "", rest ? rest : "");
+			if (len >= sizeof(buf) || append_buf(&relay->lines, &relay->lines_len, &relay->lines_size, buf, len) < 0)
+				relay = NULL;
+		}
+	}
+
+	if (!relay)
+		docket_log(state, "Failed to add relay for %s", ip);
+}
+
+static int relay_write(relay_conn_t *conn, const char *buf, size_t len)
 {
-	struct tree_args *tree_args = arg;
-	docket_state_t *state = tree_args->state;
-	char dir[128];
-	char basepath[128];
+	size_t nsent;
+	int ret;
+
+	ret = wire_net_write(&conn->net, buf, len, &nsent);
+	if (ret < 0 || nsent != len)
+		return -1;
+	return 0;
+}
+
+static int relay_send_list(relay_conn_t *conn)
+{
+	relay_t *relay = conn->relay;
+	docket_state_t *state = relay->state;
+	char buf[256];
+	int len;
+
+	len = snprintf(buf, sizeof(buf), "PROTO|%d\n%sPREFIX|%s\n", DOCKET_PROTO_V2,
+			state->compressing ? "COMPRESS|gzip\n" : "", relay->name);
+
+	if (relay_write(conn, buf, len) < 0 ||
+	    (relay->lines_len && relay_write(conn, relay->lines, relay->lines_len) < 0) ||
+	    (state->list_len && relay_write(conn, state->list, state->list_len) < 0) ||
+	    relay_write(conn, "EOF\n", 4) < 0)
+		return -1;
+
+	shutdown(conn->net.fd_state.fd, SHUT_WR);
+	return 0;
+}
+
+static int relay_read_full(relay_conn_t *conn, void *buf, size_t len, size_t *nrcvd)
+{
+	wire_timeout_reset(&conn->net.tout, 120*1000);
+
+	if (conn->compressed)
+		return decompress_read_full(&conn->decompress, buf, len, nrcvd);
+	return wire_net_read_full(&conn->net, buf, len, nrcvd);
+}
+
+static void relay_stream_write(docket_state_t *state, relay_stream_t *rs, const char *buf, size_t len)
+{
+	ssize_t ret;
+
+	if (rs->failed)
+		return;
+
+	if (!rs->opened) {
+		size_t hdr_len = sizeof(rs->hdr) - rs->hdr_len;
+		if (hdr_len > len)
+			hdr_len = len;
+		memcpy(rs->hdr + rs->hdr_len, buf, hdr_len);
+		rs->hdr_len += hdr_len;
+		buf += hdr_len;
+		len -= hdr_len;
+
+		ret = tar_entry_header_len(rs->hdr, rs->hdr_len, &rs->data_len);
+		if (ret == 0 && rs->hdr_len < sizeof(rs->hdr))
+			return;
+		if (ret <= 0) {
+			docket_log(state, "Invalid tar header from relay, dropping the entry");
+			rs->failed = 1;
+			return;
+		}
+
+		rs->meta_len = ret;
+		stream_open(state, &rs->out);
+		rs->opened = 1;
+		send_buf(&rs->out, rs->hdr, rs->hdr_len);
+		rs->written = rs->hdr_len;
+	}
+
+	if (len > 0) {
+		send_buf(&rs->out, buf, len);
+		rs->written += len;
+	}
+}
+
+static uint64_t relay_stream_entry_len(relay_stream_t *rs)
+{
+	return rs->meta_len + tar_padded(rs->data_len);
+}
+
+// The downstream connection broke, complete the entry with zeroes
+static void relay_stream_abort(docket_state_t *state, relay_stream_t *rs)
+{
+	char zeros[4096];
+	uint64_t entry_len;
+
+	if (!rs->opened)
+		return;
+
+	entry_len = relay_stream_entry_len(rs);
+	if (rs->written < entry_len)
+		docket_log(state, "Relayed entry %.100s is truncated, filling with zeroes", rs->hdr + rs->meta_len - 512);
+
+	while (rs->written < entry_len) {
+		uint64_t len = entry_len - rs->written;
+		if (len > SEND_FILE_CHUNK_MAX)
+			len = SEND_FILE_CHUNK_MAX;
+		rs->written += send_buf_zeros(&rs->out, zeros, sizeof(zeros), len);
+	}
+	stream_close(&rs->out);
+}
+
+static int relay_stream_copy(relay_conn_t *conn, relay_stream_t *rs, size_t len)
+{
+	docket_state_t *state = conn->relay->state;
+	char buf[16*1024];
+	size_t nrcvd;
+	int ret;
+
+	while (len > 0) {
+		size_t toread = len > sizeof(buf) ? sizeof(buf) : len;
+
+		ret = relay_read_full(conn, buf, toread, &nrcvd);
+		if (nrcvd > 0)
+			relay_stream_write(state, rs, buf, nrcvd);
+		if (ret < 0 || nrcvd != toread)
+			return -1;
+		len -= toread;
+	}
+
+	return 0;
+}
+
+static void relay_collect_tars(relay_conn_t *conn, const char *head, size_t head_len)
+{
+	docket_state_t *state = conn->relay->state;
+	relay_stream_t rs;
+
+	while (1) {
+		memset(&rs, 0, sizeof(rs));
+
+		// Headers come in blocks, read them until we have the whole of them
+		relay_stream_write(state, &rs, head, head_len);
+		if (relay_stream_copy(conn, &rs, 512 - head_len) < 0)
+			break;
+		head_len = 0;
+
+		while (!rs.opened && !rs.failed) {
+			if (relay_stream_copy(conn, &rs, 512) < 0)
+				break;
+		}
+		if (!rs.opened)
+			break;
+
+		if (relay_stream_copy(conn, &rs, relay_stream_entry_len(&rs) - rs.written) < 0)
+			break;
+
+		stream_close(&rs.out);
+	}
+
+	relay_stream_abort(state, &rs);
+}
+
+static void relay_collect_frames(relay_conn_t *conn)
+{
+	docket_state_t *state = conn->relay->state;
+	relay_stream_t *streams = NULL;
+	relay_stream_t **prs;
+	relay_stream_t *rs;
+	struct docket_frame frame;
+	uint32_t id;
+	uint32_t len;
+	size_t nrcvd;
+	int ret;
+
+	while (1) {
+		ret = relay_read_full(conn, &frame, sizeof(frame), &nrcvd);
+		if (ret < 0 || nrcvd != sizeof(frame))
+			break;
+
+		id = ntohl(frame.stream);
+		len = ntohl(frame.len);
+		if (len > DOCKET_FRAME_MAX) {
+			docket_log(state, "Frame from relay %s is too large: %u", conn->relay->ip, len);
+			break;
+		}
+
+		for (prs = &streams; *prs && (*prs)->id != id; prs = &(*prs)->next)
+			;
+		rs = *prs;
+		if (!rs) {
+			rs = calloc(1, sizeof(*rs));
+			if (!rs) {
+				docket_log(state, "Out of memory relaying from %s", conn->relay->ip);
+				break;
+			}
+			rs->id = id;
+			rs->next = streams;
+			streams = rs;
+			prs = &streams;
+		}
+
+		if (relay_stream_copy(conn, rs, len) < 0)
+			break;
+
+		if (ntohl(frame.flags) & DOCKET_FRAME_END) {
+			*prs = rs->next;
+			if (rs->opened)
+				stream_close(&rs->out);
+			free(rs);
+		}
+	}
+
+	while (streams) {
+		rs = streams;
+		streams = rs->next;
+		relay_stream_abort(state, rs);
+		free(rs);
+	}
+}
+
+static void relay_collect_stream(relay_conn_t *conn)
+{
+	docket_state_t *state = conn->relay->state;
+	struct docket_hello hello;
+	size_t nrcvd;
+	int ret;
+
+	ret = relay_read_full(conn, &hello, sizeof(hello), &nrcvd);
+	if (ret < 0 || nrcvd != sizeof(hello)) {
+		docket_log(state, "Error receiving data from relay %s: %m", conn->relay->ip);
+		return;
+	}
+
+	if (memcmp(hello.magic, DOCKET_HELLO_MAGIC, sizeof(hello.magic)) != 0) {
+		// An old daemon, this is already the tar stream
+		relay_collect_tars(conn, (char *)&hello, sizeof(hello));
+		return;
+	}
+
+	if (ntohl(hello.flags) & DOCKET_HELLO_GZIP) {
+		if (decompress_init(&conn->decompress, &conn->net) < 0) {
+			docket_log(state, "Failed to setup decompression for relay %s", conn->relay->ip);
+			return;
+		}
+		conn->compressed = 1;
+	}
 
-	strcpy(dir, tree_args->dir);
-	snprintf(basepath, sizeof(basepath), "%s/%s", tree_args->basepath, tree_args->name);
-	// At this stage we are clear to reschedule
+	switch (ntohl(hello.version)) {
+		case DOCKET_PROTO_V1:
+			relay_collect_tars(conn, NULL, 0);
+			break;
+		case DOCKET_PROTO_V2:
+			relay_collect_frames(conn);
+			break;
+		default:
+			docket_log(state, "Unknown protocol version %u from relay %s", ntohl(hello.version), conn->relay->ip);
+			break;
+	}
 
-	docket_log(state, "Tree collector for file %s", basepath);
-	file_collector(state, dir, basepath);
+	if (conn->compressed)
+		decompress_end(&conn->decompress);
 }
 
-static void tree_collector(docket_state_t *state, char *dir, char *basepath)
+static void task_relay_run(void *arg)
 {
-	DIR *dirent;
-	struct dirent *entry;
-	struct tree_args tree_args;
-	char new_basepath[128];
-
-	dirent = wio_opendir(basepath);
-	if (!dirent) {
-		docket_log(state, "Failed to open directory %s: %d (%m)", basepath, errno);
-		return;
-	}
+	relay_t *relay = arg;
+	docket_state_t *state = relay->state;
+	relay_conn_t conn;
+	char port[16];
+	int ret;
 
-	docket_log(state, "Tree collector for %s", basepath);
+	memset(&conn, 0, sizeof(conn));
+	conn.relay = relay;
 
-	tree_args.state = state;
-	tree_args.dir = dir;
-	tree_args.basepath = basepath;
+	docket_log(state, "Relaying to %s as %s", relay->ip, relay->name);
 
-	errno = 0;
-	while ( (entry = wio_readdir(dirent)) != NULL ) {
-		switch (entry->d_type) {
-			case DT_DIR:
-				if (entry->d_name[0] != '.') {
-					snprintf(new_basepath, sizeof(new_basepath), "%s/%s", basepath, entry->d_name);
-					tree_collector(state, dir, new_basepath);
-				}
-				break;
+	snprintf(port, sizeof(port), "%d", DOCKET_PORT);
+	ret = wire_net_init_tcp_connected(&conn.net, relay->ip, port, 10*1000, NULL, NULL);
+	if (ret < 0) {
+		docket_log(state, "Failed to connect to relay %s: %d (%m)", relay->ip, errno);
+		goto Exit;
+	}
 
-			case DT_REG:
-				tree_args.name = entry->d_name;
-				wire_pool_alloc_block(&exec_pool, "tree collector file", task_tree_collector_file, &tree_args);
-				wire_yield(); // Let it copy the arguments
-				break;
+	if (relay_send_list(&conn) == 0)
+		relay_collect_stream(&conn);
+	else
+		docket_log(state, "Failed to send the list to relay %s", relay->ip);
 
-			default:
-				docket_log(state, "Not collecting file %s in %s since it is not a file or directory", entry->d_name, basepath);
-				break;
-		}
-		errno = 0;
-	}
+	wire_net_close(&conn.net);
 
-	wio_closedir(dirent);
+Exit:
+	docket_log(state, "Relay %s done", relay->ip);
+	remaining_dec(state);
 }
 
-//////
-struct fd_collector_args {
-	docket_state_t *state;
-	int fd;
-	pid_t pid;
-	char dir[128];
-	char filename[128];
-};
-
-static void task_fd_collector(void *arg)
+static void relay_start_all(docket_state_t *state)
 {
-	struct fd_collector_args args;
-	char buf[900*1024];
-	unsigned buf_len = 0;
-	size_t nrcvd;
-	int ret;
-	wire_net_t net;
+	relay_t *relay;
 
-	// Copy the args
-	memcpy(&args, arg, sizeof(args));
-
-	// Prepare to read the data
-	set_nonblock(args.fd);
-	wire_net_init(&net, args.fd);
-	wire_timeout_reset(&net.tout, 120 * 1000); // 120 seconds
+	if (!state->relays)
+		return;
 
-	// Read all the data
-	do {
-		ret = wire_net_read_any(&net, buf+buf_len, sizeof(buf) - buf_len, &nrcvd);
-		if (ret >= 0)
-			buf_len += nrcvd;
-	} while (ret >= 0 && nrcvd > 0 && buf_len < sizeof(buf));
+	// Relayed entries stay open while other entries are sent, only the
+	// framed protocol allows that
+	if (state->proto != DOCKET_PROTO_V2) {
+		docket_log(state, "Relaying requires the framed protocol, not relaying");
+		return;
+	}
 
-	if (ret < 0 && errno != ENODATA) {
-		docket_log(args.state, "Failed to read from process pipe %s: %d (%m)", args.filename, errno);
+	for (relay = state->relays; relay; relay = relay->next) {
+		state->remaining++;
+		wire_pool_alloc_block(&docket_pool, "relay", task_relay_run, relay);
 	}
+}
 
-	wire_net_close(&net);
-	wio_kill(args.pid, 9);
+static void relay_free_all(docket_state_t *state)
+{
+	relay_t *relay;
 
-	if (buf_len > 0)
-		send_all(args.state, args.dir, args.filename, buf, buf_len, sizeof(buf));
-	else
-		docket_log(args.state, "Collected from fd size zero, not emitting file %s", args.filename);
+	while (state->relays) {
+		relay = state->relays;
+		state->relays = relay->next;
+		free(relay->lines);
+		free(relay);
+	}
 
-	remaining_dec(args.state);
+	free(state->list);
+	state->list = NULL;
+	state->list_len = 0;
+	state->list_size = 0;
 }
 
-static void exec_collector_spawn_one(docket_state_t *state, char *dir, char **cmd)
+static void session_start(docket_state_t *state)
 {
-	int out_fd;
-	int err_fd;
-	pid_t pid;
+	struct docket_hello hello;
+	uint32_t flags = 0;
+	size_t sent;
 
-	pid = wio_spawn(cmd, NULL, &out_fd, &err_fd);
-	if (pid < 0) {
-		docket_log(state, "Failed to spawn command %s %s %s %s %s %s, errno=%d (%m)",
-				cmd[0], cmd[1] ?  : "", cmd[2] ? : "", cmd[3] ? : "", cmd[4] ? : "", cmd[5] ? "..." : "",
-				errno);
+	if (state->started)
 		return;
-	}
+	state->started = 1;
 
-	state->remaining += 2;
+	// A client that didn't negotiate gets a plain tar stream
+	if (!state->hello)
+		return;
 
-	struct fd_collector_args out_args;
-	out_args.state = state;
-	out_args.pid = pid;
-	strncpy(out_args.dir, dir, sizeof(out_args.dir));
-	out_args.dir[sizeof(out_args.dir)-1] = 0;
-	out_args.fd = out_fd;
-	render_filename(out_args.filename, sizeof(out_args.filename), cmd, ".out");
-	wire_pool_alloc_block(&exec_pool, "fd processor", task_fd_collector, &out_args);
+	memset(&hello, 0, sizeof(hello));
+	memcpy(hello.magic, DOCKET_HELLO_MAGIC, sizeof(hello.magic));
+	hello.version = htonl(state->proto);
 
-	struct fd_collector_args err_args;
-	err_args.state = state;
-	err_args.pid = pid;
-	strncpy(err_args.dir, dir, sizeof(err_args.dir));
-	err_args.dir[sizeof(err_args.dir)-1] = 0;
-	err_args.fd = err_fd;
-	render_filename(err_args.filename, sizeof(err_args.filename), cmd, ".err");
-	wire_pool_alloc_block(&exec_pool, "fd processor", task_fd_collector, &err_args);
+	if (state->compress_level) {
+		if (compress_init(&state->compress, &state->write_net, state->compress_level) == 0)
+			flags |= DOCKET_HELLO_GZIP;
+		else
+			docket_log(state, "Failed to start compression, sending uncompressed");
+	}
+	hello.flags = htonl(flags);
 
-	// Let the collector wires grab their arguments from out stack
-	wire_yield();
+	wire_lock_take(&state->write_lock);
+	if (wire_net_write(&state->write_net, &hello, sizeof(hello), &sent) < 0)
+		state->send_failed = 1;
+	state->compressing = flags & DOCKET_HELLO_GZIP;
+	wire_lock_release(&state->write_lock);
 }
 
-static void exec_collector(docket_state_t *state, char *dir, char **cmd)
+static void session_manifest_done(docket_state_t *state, int save)
 {
-	char ritems[32][32];
-	char *items[32];
-	int num_items = 0;
-	char *param = NULL;
-	int i;
-	int special_idx;
+	if (save && state->sent && state->manifest_name[0]) {
+		char filename[256];
 
-	for (i = 0; i < 32; i++)
-		items[i] = ritems[i];
-
-	for (special_idx = 1; cmd[special_idx] != NULL; special_idx++) {
-		num_items = special_arg_match(cmd[special_idx], items, ARRAY_SIZE(items), 32);
-		// Only one special argument is supported
-		if (num_items)
-			break;
+		manifest_filename(filename, sizeof(filename), state->manifest_name);
+		if (manifest_save(state->sent, filename) < 0)
+			docket_log(state, "Failed to save manifest %s", state->manifest_name);
 	}
+	manifest_delete(state->since);
+	manifest_delete(state->sent);
+	state->since = NULL;
+	state->sent = NULL;
+}
 
-	if (num_items == 0) {
-		exec_collector_spawn_one(state, dir, cmd);
-	} else {
-		param = cmd[special_idx];
-		for (i = 0; i < num_items; i++) {
-			cmd[special_idx] = items[i];
-			docket_log(state, "Collecting exec with parameter %s value %s", param, items[i]);
-			exec_collector_spawn_one(state, dir, cmd);
-		}
+// A cursor that moved past a segment the client never got loses those bytes
+static void session_cursors_done(docket_state_t *state, int save)
+{
+	if (save && state->cursors) {
+		char filename[256];
+
+		cursors_filename(filename, sizeof(filename), state->cursor_name);
+		if (manifest_save(state->cursors, filename) < 0)
+			docket_log(state, "Failed to save cursors %s", state->cursor_name);
 	}
+	manifest_delete(state->cursors);
+	state->cursors = NULL;
 }
 
-static size_t process_find_collector(docket_state_t *state, char *dir, char *buf, size_t buf_len)
+static void session_end(docket_state_t *state)
 {
-	size_t processed = 0;
-	char *null;
-	struct tree_args tree_args;
+	if (state->compressing) {
+		wire_lock_take(&state->write_lock);
+		if (compress_finish(&state->compress) < 0)
+			state->send_failed = 1;
+		state->compressing = 0;
+		wire_lock_release(&state->write_lock);
+	}
+}
 
-	tree_args.state = state;
-	tree_args.dir = dir;
-	tree_args.basepath = "/";
+/* Session lines change how the whole output is sent, they are handled in line
+ * before any collector is started and must come before the first collector.
+ */
+static int session_line_process(docket_state_t *state, char *line)
+{
+	if (strncmp(line, "PREFIX|", 7) == 0) {
+		// Handled right away so no collector runs ahead of it
+		char *end = strchr(line + 7, '|');
+
+		if (end)
+			*end = 0;
+		strncpy(state->prefix, line + 7, sizeof(state->prefix));
+		state->prefix[sizeof(state->prefix)-1] = 0;
+		return 1;
+	}
 
-	do {
-		null = memchr(buf + processed, 0, buf_len - processed);
-		if (!null)
-			return buf_len - processed;
+	if (strncmp(line, "DEADLINE|", 9) == 0) {
+		// DEADLINE|<seconds>, whatever didn't start by then is skipped
+		int seconds = atoi(line + 9);
 
-		tree_args.name = buf + processed;
+		if (seconds <= 0) {
+			docket_log(state, "Invalid deadline: %s", line);
+			return 1;
+		}
 
-		docket_log(state, "Find collector for %s", buf+processed);
-		wire_pool_alloc_block(&exec_pool, "find collector file", task_tree_collector_file, &tree_args);
-		wire_yield(); // Let it copy the arguments
+		state->deadline = now_msec() + seconds * 1000ULL;
+		return 1;
+	}
 
-		processed = null - buf + 1;
-	} while (buf_len - processed > 0);
+	if (strncmp(line, "RELAY|", 6) == 0) {
+		relay_line_process(state, line);
+		return 1;
+	}
 
-	return buf_len - processed;
-}
+	if (strncmp(line, "PROTO|", 6) == 0) {
+		int version = atoi(line + 6);
 
-static void find_collector(docket_state_t *state, char *dir, char **cmd)
-{
-	char *args[MAX_ARGS+3];
-	int i, j;
-	pid_t pid;
-	int out_fd;
-	wire_net_t net;
-	size_t buf_len;
-	int ret;
-	size_t nrcvd;
-	char buf[500*1024];
+		if (state->started) {
+			docket_log(state, "Protocol negotiation after the first collector is ignored: %s", line);
+			return 1;
+		}
 
-	j = 0;
-	args[j++] = "/usr/bin/find";
-	for (i = 0; i < MAX_ARGS && cmd[i] != NULL; i++)
-		args[j++] = cmd[i];
-	args[j++] = "-print0";
-	args[j] = 0;
+		if (version < DOCKET_PROTO_V1) {
+			docket_log(state, "Invalid protocol version requested: %s", line);
+			return 1;
+		}
 
-	pid = wio_spawn(args, NULL, &out_fd, NULL);
-	if (pid < 0) {
-		docket_log(state, "Error spawning Find process");
-		return;
+		// Answer with the highest version we both support
+		state->proto = version > DOCKET_PROTO_V2 ? DOCKET_PROTO_V2 : version;
+		state->hello = 1;
+		return 1;
 	}
 
-	// Loop over stdout, split file names by a null character and run file collectors on that
+	if (strncmp(line, "COMPRESS|", 9) == 0) {
+		const char *method = line + 9;
+		char *level;
 
-	// Prepare to read the data
-	set_nonblock(out_fd);
-	wire_net_init(&net, out_fd);
-	wire_timeout_reset(&net.tout, 10 * 60 * 1000); // 10 minutes
+		if (state->started) {
+			docket_log(state, "Compression request after the first collector is ignored: %s", line);
+			return 1;
+		}
 
-	// Read all the data
-	buf_len = 0;
-	do {
-		ret = wire_net_read_any(&net, buf+buf_len, sizeof(buf)-buf_len, &nrcvd);
-		if (ret >= 0) {
-			buf_len += nrcvd;
-			size_t remaining_buf_len = process_find_collector(state, dir, buf, buf_len);
-			if (remaining_buf_len > 0 && remaining_buf_len != buf_len) {
-				// Move the buf to the start
-				memmove(buf, buf + buf_len - remaining_buf_len, remaining_buf_len);
-				buf_len = remaining_buf_len;
-			}
+		// The hello tells the client whether we compress or not
+		state->hello = 1;
+
+		level = strchr(method, '|');
+		if (level)
+			*level++ = 0;
+
+		if (strcmp(method, "gzip") != 0) {
+			docket_log(state, "Unsupported compression method '%s', sending uncompressed", method);
+			return 1;
 		}
-	} while (ret >= 0 && nrcvd > 0 && buf_len < sizeof(buf));
 
-	if (ret < 0 && errno != ENODATA) {
-		docket_log(state, "Failed to read from process pipe for find: %d (%m)", errno);
+		state->compress_level = level ? atoi(level) : Z_DEFAULT_COMPRESSION;
+		if (state->compress_level == 0 || state->compress_level < Z_DEFAULT_COMPRESSION || state->compress_level > Z_BEST_COMPRESSION)
+			state->compress_level = Z_DEFAULT_COMPRESSION;
+		return 1;
 	}
 
-	wire_net_close(&net);
-	wio_kill(pid, 9);
+	if (strncmp(line, "MANIFEST|", 9) == 0) {
+		// MANIFEST|<since>[|<save as>], unchanged files since <since> are
+		// sent as stubs and what we send is saved as <save as>
+		char *since = line + 9;
+		char *save = strchr(since, '|');
+		char filename[256];
 
-	// Process any remaining data
-	process_find_collector(state, dir, buf, buf_len);
-}
+		if (state->started) {
+			docket_log(state, "Manifest request after the first collector is ignored: %s", line);
+			return 1;
+		}
 
-#define ARG_LEN 64
-static void task_line_process(void *arg)
-{
-	docket_state_t *state = arg;
-	char *p;
-	char raw_args[MAX_ARGS][ARG_LEN];
-	char *args[MAX_ARGS];
-	int num_args = 0;
-	int arg_offset = 0;
-	int escaped = 0;
-
-	// Break up the line into the different arguments, seperated by the vertical line '|'
-	args[0] = &raw_args[0][0];
-	for (p = state->line; *p; p++) {
-		switch (*p) {
-			case '\\':
-				if (!escaped) {
-					escaped = 1;
-				} else {
-					escaped = 0;
-					args[num_args][arg_offset] = '\\';
-					arg_offset++;
-				}
-				break;
-			case '|':
-				if (!escaped) {
-					args[num_args][arg_offset] = 0;
-					num_args++;
-					arg_offset = 0;
-					args[num_args] = &raw_args[num_args][0];
-					if (num_args == MAX_ARGS) {
-						docket_log(state, "Too many argument in line %s", state->line);
-						state->remaining--;
-						return;
-					}
-				} else {
-					escaped = 0;
-					args[num_args][arg_offset] = '|';
-					arg_offset++;
-				}
-				break;
-			default:
-				escaped = 0;
-				args[num_args][arg_offset] = *p;
-				arg_offset++;
-				if (arg_offset >= ARG_LEN) {
-					docket_log(state, "Argument %d in line command %s is over the limit", num_args, state->line);
-					state->remaining--;
-					return;
-				}
-				break;
+		if (save)
+			*save++ = 0;
+		else
+			save = since;
+
+		if (!manifest_name_valid(since) || !manifest_name_valid(save)) {
+			docket_log(state, "Invalid manifest name in '%s|%s'", since, save);
+			return 1;
+		}
+
+		manifest_delete(state->since);
+		manifest_delete(state->sent);
+		state->since = manifest_new();
+		state->sent = manifest_new();
+
+		manifest_filename(filename, sizeof(filename), since);
+		if (state->since && manifest_load(state->since, filename) < 0) {
+			docket_log(state, "No manifest %s, collecting everything", since);
+			manifest_delete(state->since);
+			state->since = NULL;
 		}
+
+		strcpy(state->manifest_name, save);
+		return 1;
 	}
-	args[num_args][arg_offset] = 0;
-	num_args++;
-	args[num_args] = NULL;
-	state->line = NULL;
 
-	if (num_args == 0)
-		goto Exit;
+	if (strncmp(line, "CURSOR|", 7) == 0) {
+		// CURSOR|<client id>, LOG collectors only send what this client
+		// didn't get yet
+		char *id = line + 7;
+		char filename[256];
 
-	if (strcmp(args[0], "FILE") == 0) {
-		if (num_args >= 3)
-			file_collector(state, args[1], args[2]);
-		else
-			docket_log(state, "Not enough arguments to FILE collector, got %d args", num_args);
-	} else if (strcmp(args[0], "GLOB") == 0) {
-		if (num_args >= 3)
-			glob_collector(state, args[1], args[2]);
-		else
-			docket_log(state, "Not enough arguments to GLOB collector, got %d args", num_args);
-	} else if (strcmp(args[0], "TREE") == 0) {
-		if (num_args >= 3)
-			tree_collector(state, args[1], args[2]);
-		else
-			docket_log(state, "Not enough arguments to TREE collector, got %d args", num_args);
-	} else if (strcmp(args[0], "EXEC") == 0) {
-		if (num_args >= 3)
-			exec_collector(state, args[1], &args[2]);
-		else
-			docket_log(state, "Not enough arguments to EXEC collector, got %d args", num_args);
-	} else if (strcmp(args[0], "FIND") == 0) {
-		if (num_args >= 3)
-			find_collector(state, args[1], &args[2]);
-		else
-			docket_log(state, "Not enough arguments to FIND collector, got %d args", num_args);
-	} else if (strcmp(args[0], "PREFIX") == 0) {
-		if (num_args >= 2) {
-			strncpy(state->prefix, args[1], sizeof(state->prefix));
-			state->prefix[sizeof(state->prefix)-1] = 0;
-		} else {
-			docket_log(state, "Not enough arguments to PREFIX collector, got %d args", num_args);
+		if (state->started) {
+			docket_log(state, "Cursor request after the first collector is ignored: %s", line);
+			return 1;
 		}
-	} else {
-		docket_log(state, "Unknown collector requested '%s'", args[0]);
+
+		if (!manifest_name_valid(id)) {
+			docket_log(state, "Invalid cursor client id '%s'", id);
+			return 1;
+		}
+
+		manifest_delete(state->cursors);
+		state->cursors = manifest_new();
+
+		cursors_filename(filename, sizeof(filename), id);
+		if (state->cursors && manifest_load(state->cursors, filename) < 0)
+			docket_log(state, "No cursors for %s, collecting logs from the start", id);
+
+		strcpy(state->cursor_name, id);
+		return 1;
 	}
 
-Exit:
-	remaining_dec(state);
+	return 0;
 }
 
 static int launch_collectors(docket_state_t *state, char *buf, size_t buf_len, size_t *processed)
@@ -719,11 +3178,15 @@ static int launch_collectors(docket_state_t *state, char *buf, size_t buf_len, s
 		}
 
 		// Skip empty lines and comments
-		if (line[0] != 0 && line[0] != '#') {
-			state->remaining++;
-			state->line = line;
-			wire_pool_alloc_block(&docket_pool, "line processor", task_line_process, state);
-			wire_yield(); // Wait for the wire to copy the line to itself
+		if (line[0] != 0 && line[0] != '#')
+			relay_list_add(state, line);
+
+		if (line[0] != 0 && line[0] != '#' && !session_line_process(state, line)) {
+			session_start(state);
+			if (strncmp(line, "PROFILE|", 8) == 0)
+				profile_queue(state, line + 8);
+			else
+				collector_queue(state, line);
 		}
 
 		line = newline+1;
@@ -733,75 +3196,160 @@ static int launch_collectors(docket_state_t *state, char *buf, size_t buf_len, s
 	return eof_rcvd;
 }
 
+static void session_wait_collectors(docket_state_t *state)
+{
+	state->auto_close = 1;
+	while (state->remaining > 0) {
+		wire_wait_reset(&state->wait);
+		wire_wait_single(&state->wait);
+	}
+}
+
+static void session_log_usage(docket_state_t *state)
+{
+	size_t used;
+	size_t peak;
+	unsigned waits;
+
+	bufpool_usage(&used, &peak, &waits);
+	docket_log(state, "Buffer pool %zu bytes, peak %zu bytes, %u waits for a buffer", used, peak, waits);
+}
+
 static void task_docket_run(void *arg)
 {
 	int fd = (long int)arg;
 	int ret;
 	wire_net_t net;
-	char buf[32*1024];
+	char *buf;
+	size_t buf_size = BUFPOOL_SMALL;
 	size_t rcvd = 0;
 	int eof_rcvd = 0;
-	docket_state_t state;
+	docket_state_t *state;
+
+	// The state with its log is too large for the stack of the wire
+	state = malloc(sizeof(*state));
+	buf = bufpool_get(buf_size);
+	if (!state || !buf) {
+		wire_log(WLOG_ERR, "Out of memory for the collection on fd %d", fd);
+		free(state);
+		bufpool_put(buf);
+		close(fd);
+		return;
+	}
 
 	set_nonblock(fd);
 	wire_net_init(&net, fd);
 	wire_timeout_reset(&net.tout, 120*1000);
 
 	// Setup the write side of the socket
-	wire_net_init(&state.write_net, dup(fd));
-	wire_wait_init(&state.wait);
-	wire_lock_init(&state.write_lock);
-	state.remaining = 0;
-	state.auto_close = 0;
-	state.log_len = 0;
+	wire_net_init(&state->write_net, dup(fd));
+	wire_wait_init(&state->wait);
+	wire_lock_init(&state->write_lock);
+	state->remaining = 0;
+	state->auto_close = 0;
+	state->proto = DOCKET_PROTO_V1;
+	state->hello = 0;
+	state->started = 0;
+	state->compress_level = 0;
+	state->compressing = 0;
+	state->send_failed = 0;
+	state->open_streams = 0;
+	state->next_stream = 0;
+	state->since = NULL;
+	state->sent = NULL;
+	state->manifest_name[0] = 0;
+	state->queue = NULL;
+	state->running = 0;
+	state->dispatch_waiting = 0;
+	state->deadline = 0;
+	state->cursors = NULL;
+	state->cursor_name[0] = 0;
+	state->relays = NULL;
+	state->list = NULL;
+	state->list_len = 0;
+	state->list_size = 0;
+	state->next_collector_id = 0;
+	state->log_head = NULL;
+	state->log_tail = NULL;
+	state->log_size = 0;
+	state->log_dropped = 0;
+	state->log_bindings = NULL;
+	special_arg_cache_init(&state->specials);
+	state->num_profiles = 0;
+	state->collected = manifest_new();
 
 	// Do the reads
 	do {
 		// Receive new data
 		size_t nrcvd = 0;
-		ret = wire_net_read_any(&net, buf+rcvd, sizeof(buf)-rcvd, &nrcvd);
+		ret = wire_net_read_any(&net, buf+rcvd, buf_size-rcvd, &nrcvd);
 		if (ret < 0)
 			break;
 		rcvd += nrcvd;
 
 		// Process as much data as possible
-		eof_rcvd = launch_collectors(&state, buf, rcvd, &nrcvd);
+		eof_rcvd = launch_collectors(state, buf, rcvd, &nrcvd);
 
 		// Move data to beginning of buffer for next cycle
 		memmove(buf, buf+nrcvd, rcvd - nrcvd);
 		rcvd -= nrcvd;
 	} while (!eof_rcvd);
 
+	bufpool_put(buf);
+
 	// Close the read side of things
 	shutdown(fd, SHUT_RD);
 	wire_net_close(&net);
 
 	// If we got the full list of data, we wait to send it all
 	if (eof_rcvd) {
-		if (state.remaining == 0) {
-			// Nothing left to wait for, we close the write fd
-		} else {
-			state.auto_close = 1;
-			wire_wait_single(&state.wait);
-		}
-		docket_log(&state, "Docket collection done");
-		send_log_file(&state);
-		wire_net_close(&state.write_net);
+		session_start(state);
+		relay_start_all(state);
+		// Nothing runs before the whole list is in and planned
+		collector_plan(state);
+		collector_dispatch(state, 1);
+
+		// Wait for all the collectors before we close the write fd
+		session_wait_collectors(state);
+		session_log_usage(state);
+		docket_log(state, "Docket collection done");
+		send_log_file(state);
+		session_end(state);
+
+		// Only what surely went out counts as sent for the next collection
+		if (state->send_failed)
+			wire_log(WLOG_WARNING, "Sending to fd %d failed, not saving the manifest and cursors", fd);
+		session_manifest_done(state, !state->send_failed);
+		session_cursors_done(state, !state->send_failed);
+		wire_net_close(&state->write_net);
+	} else {
+		// The collectors that already started still use the state
+		collector_queue_free(state);
+		session_wait_collectors(state);
+		session_manifest_done(state, 0);
+		session_cursors_done(state, 0);
 	}
 
+	relay_free_all(state);
+	log_free(state);
+	special_arg_cache_free(&state->specials);
+	session_profiles_put(state);
+	manifest_delete(state->collected);
+	free(state);
+
 	wire_log(WLOG_INFO, "Collection for fd %d is done", fd);
 }
 
 static void task_accept_run(void *arg)
 {
-	UNUSED(arg);
-	struct sockaddr sa;
+	unsigned thread_idx = (long int)arg;
+	struct sockaddr_storage sa;
 	socklen_t salen;
 	int ret;
-	char host[32];
+	char host[INET6_ADDRSTRLEN];
 	char serv[32];
 
-	wire_log(WLOG_INFO, "docketd starting up");
+	wire_log(WLOG_INFO, "docketd thread %u starting up", thread_idx);
 
 	int fd = socket_setup(DOCKET_PORT);
 	if (fd < 0) {
@@ -818,9 +3366,9 @@ static void task_accept_run(void *arg)
 
 		memset(&sa, 0, sizeof(sa));
 		salen = sizeof(sa);
-		int new_fd = accept(fd, &sa, &salen);
+		int new_fd = accept(fd, (struct sockaddr *)&sa, &salen);
 		if (new_fd >= 0) {
-			ret = wio_getnameinfo(&sa, salen, host, sizeof(host), serv, sizeof(serv), NI_NUMERICHOST|NI_NUMERICSERV);
+			ret = wio_getnameinfo((struct sockaddr *)&sa, salen, host, sizeof(host), serv, sizeof(serv), NI_NUMERICHOST|NI_NUMERICSERV);
 			if (ret == 0) {
 				wire_log(WLOG_INFO, "New connection: fd=%d origin=%s:%s", fd, host, serv);
 			} else {
@@ -841,19 +3389,85 @@ static void task_accept_run(void *arg)
 	}
 }
 
-int main()
+static void *docket_thread_run(void *arg)
 {
-	signal(SIGCHLD, SIG_IGN);
-	signal(SIGPIPE, SIG_IGN);
+	int io_threads = DOCKET_IO_THREADS / num_threads;
+
+	if (io_threads < 1)
+		io_threads = 1;
 
 	wire_thread_init(&wire_main);
 	wire_fd_init();
-	wire_io_init(8);
-	wire_log_init_stdout();
-	wire_pool_init(&docket_pool, NULL, 32, 1024*1024);
-	wire_pool_init(&exec_pool, NULL, 32, 1024*1024);
-	wire_init(&task_accept, "accept", task_accept_run, NULL, WIRE_STACK_ALLOC(4096));
-	dev_list_init();
+	wire_io_init(io_threads);
+	compress_thread_init();
+	walk_thread_init();
+	uring_thread_init();
+	wire_pool_init(&docket_pool, NULL, DOCKET_WIRES_MAX, DOCKET_STACK_SIZE);
+	wire_pool_init(&exec_pool, NULL, DOCKET_WIRES_MAX, DOCKET_STACK_SIZE);
+	wire_init(&task_accept, "accept", task_accept_run, arg, WIRE_STACK_ALLOC(4096));
+	if (arg == NULL) {
+		dev_map_watch_start();
+		profile_watch_start();
+	}
 	wire_thread_run();
+	return NULL;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-t wire threads] [-p profile dir]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+	const char *profile_dir = PROFILE_DIR;
+	pthread_t thread;
+	long ncpus;
+	unsigned i;
+	int opt;
+
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	num_threads = ncpus > 0 ? ncpus : 1;
+
+	while ((opt = getopt(argc, argv, "t:p:h")) != -1) {
+		switch (opt) {
+			case 't':
+				num_threads = atoi(optarg);
+				break;
+			case 'p':
+				profile_dir = optarg;
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if (num_threads == 0)
+		num_threads = 1;
+	if (num_threads > DOCKET_THREADS_MAX)
+		num_threads = DOCKET_THREADS_MAX;
+
+	signal(SIGCHLD, SIG_IGN);
+	signal(SIGPIPE, SIG_IGN);
+
+	wire_log_init_stdout();
+	bufpool_init(BUFPOOL_MEM_MAX, num_threads);
+	compress_workers_init(8);
+	walk_workers_init(8);
+	mkdir(DOCKET_STATE_DIR, 0700);
+	dev_map_init();
+	profile_load(profile_dir);
+
+	// The main thread is the first wire thread
+	for (i = 1; i < num_threads; i++) {
+		if (pthread_create(&thread, NULL, docket_thread_run, (void*)(long int)i) != 0) {
+			wire_log(WLOG_ERR, "Failed to start wire thread %u: %m", i);
+			break;
+		}
+		pthread_detach(thread);
+	}
+
+	docket_thread_run((void*)(long int)0);
 	return 0;
 }
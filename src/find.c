@@ -0,0 +1,318 @@
+#include "find.h"
+#include "walk.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fnmatch.h>
+
+enum find_pred_type {
+	FIND_NAME,
+	FIND_PATH,
+	FIND_REGEX,
+	FIND_TYPE,
+	FIND_MTIME,
+	FIND_SIZE,
+};
+
+// Big enough for any regex that fits in an argument
+#define FIND_REGEX_MAX 512
+
+/* find uses emacs regexes by default, turn them into POSIX extended ones so
+ * they can be matched from several threads. The whole path has to match.
+ */
+static int find_regex_translate(char *out, size_t out_size, const char *in)
+{
+	size_t len = 0;
+	int in_bracket = 0;
+
+#define OUT(c) do { if (len + 1 >= out_size) return -1; out[len++] = (c); } while (0)
+
+	OUT('^');
+	OUT('(');
+	for (; *in; in++) {
+		if (in_bracket) {
+			OUT(*in);
+			if (*in == ']' && in_bracket > 1)
+				in_bracket = 0;
+			else
+				in_bracket++;
+			continue;
+		}
+
+		switch (*in) {
+			case '[':
+				OUT('[');
+				in_bracket = 1;
+				// A leading ^ or ] is part of the set
+				if (in[1] == '^') {
+					OUT('^');
+					in++;
+				}
+				break;
+			case '(':
+			case ')':
+			case '|':
+			case '{':
+			case '}':
+				OUT('\\');
+				OUT(*in);
+				break;
+			case '\\':
+				if (in[1] == '(' || in[1] == ')' || in[1] == '|') {
+					OUT(in[1]);
+					in++;
+				} else if (in[1]) {
+					OUT('\\');
+					OUT(in[1]);
+					in++;
+				} else {
+					OUT('\\');
+					OUT('\\');
+				}
+				break;
+			default:
+				OUT(*in);
+				break;
+		}
+	}
+	OUT(')');
+	OUT('$');
+	out[len] = 0;
+	return 0;
+#undef OUT
+}
+
+// n, +n or -n with an optional unit suffix for -size
+static int find_parse_number(find_pred_t *p, const char *str, int with_unit)
+{
+	char *end;
+
+	p->cmp = 0;
+	if (*str == '+') {
+		p->cmp = 1;
+		str++;
+	} else if (*str == '-') {
+		p->cmp = -1;
+		str++;
+	}
+
+	p->value = strtoll(str, &end, 10);
+	if (end == str)
+		return -1;
+
+	p->unit = 1;
+	if (with_unit) {
+		p->unit = 512;
+		switch (*end) {
+			case 0: break;
+			case 'b': p->unit = 512; end++; break;
+			case 'c': p->unit = 1; end++; break;
+			case 'w': p->unit = 2; end++; break;
+			case 'k': p->unit = 1024; end++; break;
+			case 'M': p->unit = 1024*1024; end++; break;
+			case 'G': p->unit = 1024*1024*1024; end++; break;
+			default: return -1;
+		}
+	}
+
+	return *end ? -1 : 0;
+}
+
+static int find_parse_pred(find_expr_t *f, find_pred_t *p, const char *name, const char *arg)
+{
+	char regex[FIND_REGEX_MAX];
+	int ret;
+
+	if (strcmp(name, "-name") == 0 || strcmp(name, "-iname") == 0) {
+		p->type = FIND_NAME;
+		p->pattern = arg;
+		p->flags = name[1] == 'i' ? FNM_CASEFOLD : 0;
+	} else if (strcmp(name, "-path") == 0 || strcmp(name, "-ipath") == 0 || strcmp(name, "-wholename") == 0) {
+		p->type = FIND_PATH;
+		p->pattern = arg;
+		p->flags = name[1] == 'i' ? FNM_CASEFOLD : 0;
+	} else if (strcmp(name, "-regex") == 0 || strcmp(name, "-iregex") == 0) {
+		if (find_regex_translate(regex, sizeof(regex), arg) < 0) {
+			snprintf(f->error, sizeof(f->error), "regex %s is too long", arg);
+			return -1;
+		}
+		ret = regcomp(&p->re, regex, REG_EXTENDED|REG_NOSUB|(name[1] == 'i' ? REG_ICASE : 0));
+		if (ret != 0) {
+			snprintf(f->error, sizeof(f->error), "bad regex %s", arg);
+			return -1;
+		}
+		p->type = FIND_REGEX;
+	} else if (strcmp(name, "-type") == 0) {
+		p->type = FIND_TYPE;
+		switch (arg[0]) {
+			case 'f': p->value = S_IFREG; break;
+			case 'd': p->value = S_IFDIR; break;
+			case 'l': p->value = S_IFLNK; break;
+			case 'b': p->value = S_IFBLK; break;
+			case 'c': p->value = S_IFCHR; break;
+			case 'p': p->value = S_IFIFO; break;
+			case 's': p->value = S_IFSOCK; break;
+			default:
+				snprintf(f->error, sizeof(f->error), "unknown type %s", arg);
+				return -1;
+		}
+	} else if (strcmp(name, "-mtime") == 0 || strcmp(name, "-mmin") == 0) {
+		p->type = FIND_MTIME;
+		if (find_parse_number(p, arg, 0) < 0) {
+			snprintf(f->error, sizeof(f->error), "bad time %s", arg);
+			return -1;
+		}
+		p->unit = name[2] == 't' ? 24*60*60 : 60;
+	} else if (strcmp(name, "-size") == 0) {
+		p->type = FIND_SIZE;
+		if (find_parse_number(p, arg, 1) < 0) {
+			snprintf(f->error, sizeof(f->error), "bad size %s", arg);
+			return -1;
+		}
+	} else {
+		snprintf(f->error, sizeof(f->error), "%s is not supported", name);
+		return -1;
+	}
+
+	return 0;
+}
+
+// Only digits, a depth that is too big for the walk is taken as no limit
+static int find_parse_depth(const char *arg, unsigned *depth)
+{
+	unsigned long long val;
+	char *end;
+
+	if (!isdigit((unsigned char)*arg))
+		return -1;
+
+	errno = 0;
+	val = strtoull(arg, &end, 10);
+	if (*end != 0 || (errno && errno != ERANGE))
+		return -1;
+
+	*depth = val < WALK_DEPTH_ANY ? val : WALK_DEPTH_ANY;
+	return 0;
+}
+
+int find_parse(find_expr_t *f, char **args, unsigned *num_roots)
+{
+	find_pred_t *p;
+	int negate = 0;
+	unsigned i;
+
+	memset(f, 0, sizeof(*f));
+	f->max_depth = WALK_DEPTH_ANY;
+	f->now = time(NULL);
+
+	for (i = 0; args[i] && args[i][0] != '-' && strcmp(args[i], "!") != 0 && strcmp(args[i], "(") != 0; i++)
+		;
+	*num_roots = i;
+
+	for (; args[i]; i++) {
+		if (strcmp(args[i], "!") == 0 || strcmp(args[i], "-not") == 0) {
+			negate = !negate;
+			continue;
+		}
+
+		if (strcmp(args[i], "-a") == 0 || strcmp(args[i], "-and") == 0 || strcmp(args[i], "-print") == 0 || strcmp(args[i], "-print0") == 0)
+			continue;
+
+		if (strcmp(args[i], "-maxdepth") == 0 || strcmp(args[i], "-mindepth") == 0) {
+			if (!args[i+1]) {
+				snprintf(f->error, sizeof(f->error), "%s needs an argument", args[i]);
+				goto Error;
+			}
+			if (find_parse_depth(args[i+1], args[i][2] == 'a' ? &f->max_depth : &f->min_depth) < 0) {
+				snprintf(f->error, sizeof(f->error), "bad depth %s for %s", args[i+1], args[i]);
+				goto Error;
+			}
+			i++;
+			continue;
+		}
+
+		if (args[i][0] != '-' || !args[i+1] || f->num_preds == FIND_PREDS_MAX) {
+			snprintf(f->error, sizeof(f->error), "%s is not supported", args[i]);
+			goto Error;
+		}
+
+		p = &f->preds[f->num_preds];
+		p->negate = negate;
+		if (find_parse_pred(f, p, args[i], args[i+1]) < 0)
+			goto Error;
+		f->num_preds++;
+		negate = 0;
+		i++;
+	}
+
+	if (negate) {
+		snprintf(f->error, sizeof(f->error), "nothing to negate");
+		goto Error;
+	}
+
+	return 0;
+
+Error:
+	find_free(f);
+	return -1;
+}
+
+void find_free(find_expr_t *f)
+{
+	unsigned i;
+
+	for (i = 0; i < f->num_preds; i++) {
+		if (f->preds[i].type == FIND_REGEX)
+			regfree(&f->preds[i].re);
+	}
+	f->num_preds = 0;
+}
+
+static int find_cmp(const find_pred_t *p, long long value)
+{
+	if (p->cmp > 0)
+		return value > p->value;
+	if (p->cmp < 0)
+		return value < p->value;
+	return value == p->value;
+}
+
+static int find_pred_match(const find_expr_t *f, const find_pred_t *p, const char *path, const char *name, const struct stat *st)
+{
+	switch (p->type) {
+		case FIND_NAME:
+			return fnmatch(p->pattern, name, p->flags) == 0;
+		case FIND_PATH:
+			return fnmatch(p->pattern, path, p->flags) == 0;
+		case FIND_REGEX:
+			return regexec(&p->re, path, 0, NULL, 0) == 0;
+		case FIND_TYPE:
+			return (st->st_mode & S_IFMT) == p->value;
+		case FIND_MTIME:
+			return find_cmp(p, (f->now - st->st_mtime) / p->unit);
+		case FIND_SIZE:
+			// Like find, the size is rounded up to whole units
+			return find_cmp(p, (st->st_size + p->unit - 1) / p->unit);
+	}
+
+	return 0;
+}
+
+int find_filter(void *arg, const char *path, const char *name, unsigned depth, const struct stat *st)
+{
+	const find_expr_t *f = arg;
+	unsigned i;
+
+	if (depth < f->min_depth)
+		return 0;
+
+	for (i = 0; i < f->num_preds; i++) {
+		if (find_pred_match(f, &f->preds[i], path, name, st) == f->preds[i].negate)
+			return 0;
+	}
+
+	return WALK_COLLECT;
+}
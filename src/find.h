@@ -0,0 +1,46 @@
+#ifndef DOCKET_FIND_H
+#define DOCKET_FIND_H
+
+#include <regex.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/* The common find(1) tests done in process: -name, -iname, -path, -regex,
+ * -iregex, -type, -mtime, -mmin and -size, negated with ! or -not, and the
+ * -maxdepth and -mindepth options. The tests are all and-ed, like find does
+ * without -o.
+ */
+#define FIND_PREDS_MAX 20
+
+typedef struct find_pred {
+	int type;
+	int negate;
+	int cmp;
+	long long value;
+	long long unit;
+	const char *pattern;
+	int flags;
+	regex_t re;
+} find_pred_t;
+
+typedef struct find_expr {
+	unsigned num_preds;
+	find_pred_t preds[FIND_PREDS_MAX];
+	unsigned min_depth;
+	unsigned max_depth;
+	time_t now;
+	char error[128];
+} find_expr_t;
+
+/* Parse the arguments of a find command line, the start points come first
+ * and num_roots is set to their count. Returns -1 with the reason in error if
+ * the line uses anything not supported.
+ */
+int find_parse(find_expr_t *f, char **args, unsigned *num_roots);
+void find_free(find_expr_t *f);
+
+// A walk_filter_t
+int find_filter(void *arg, const char *path, const char *name, unsigned depth, const struct stat *st);
+
+#endif
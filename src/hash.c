@@ -0,0 +1,15 @@
+#include "hash.h"
+
+// FNV-1a, good enough to tell apart file contents and cheap to compute
+uint64_t hash_buf(uint64_t hash, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
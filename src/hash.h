@@ -0,0 +1,11 @@
+#ifndef DOCKET_HASH_H
+#define DOCKET_HASH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define HASH_INIT 0xcbf29ce484222325ULL
+
+uint64_t hash_buf(uint64_t hash, const void *buf, size_t len);
+
+#endif
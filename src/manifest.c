@@ -0,0 +1,274 @@
+#include "manifest.h"
+#include "hash.h"
+
+#include "wire_io.h"
+#include "wire_log.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+
+#define MANIFEST_INIT_BUCKETS 1024
+
+static unsigned path_bucket(const char *path, unsigned num_buckets)
+{
+	return hash_buf(HASH_INIT, path, strlen(path)) % num_buckets;
+}
+
+int manifest_init(manifest_t *m)
+{
+	m->count = 0;
+	m->num_buckets = MANIFEST_INIT_BUCKETS;
+	m->buckets = calloc(m->num_buckets, sizeof(*m->buckets));
+	return m->buckets ? 0 : -1;
+}
+
+void manifest_free(manifest_t *m)
+{
+	manifest_entry_t *e;
+	manifest_entry_t *next;
+	unsigned i;
+
+	for (i = 0; i < m->num_buckets; i++) {
+		for (e = m->buckets[i]; e; e = next) {
+			next = e->next;
+			free(e);
+		}
+	}
+
+	free(m->buckets);
+	m->buckets = NULL;
+	m->num_buckets = 0;
+	m->count = 0;
+}
+
+static void manifest_grow(manifest_t *m)
+{
+	manifest_entry_t **buckets;
+	manifest_entry_t *e;
+	manifest_entry_t *next;
+	unsigned num_buckets = m->num_buckets * 2;
+	unsigned i;
+
+	buckets = calloc(num_buckets, sizeof(*buckets));
+	if (!buckets)
+		return; // Keep working with longer chains
+
+	for (i = 0; i < m->num_buckets; i++) {
+		for (e = m->buckets[i]; e; e = next) {
+			unsigned b = path_bucket(e->path, num_buckets);
+			next = e->next;
+			e->next = buckets[b];
+			buckets[b] = e;
+		}
+	}
+
+	free(m->buckets);
+	m->buckets = buckets;
+	m->num_buckets = num_buckets;
+}
+
+manifest_entry_t *manifest_find(manifest_t *m, const char *path)
+{
+	manifest_entry_t *e;
+
+	for (e = m->buckets[path_bucket(path, m->num_buckets)]; e; e = e->next) {
+		if (strcmp(e->path, path) == 0)
+			return e;
+	}
+
+	return NULL;
+}
+
+static manifest_entry_t *manifest_add(manifest_t *m, const char *path)
+{
+	manifest_entry_t *e;
+	unsigned b;
+
+	e = manifest_find(m, path);
+	if (e)
+		return e;
+
+	if (m->count >= m->num_buckets * 2)
+		manifest_grow(m);
+
+	e = calloc(1, sizeof(*e) + strlen(path) + 1);
+	if (!e)
+		return NULL;
+	strcpy(e->path, path);
+
+	b = path_bucket(path, m->num_buckets);
+	e->next = m->buckets[b];
+	m->buckets[b] = e;
+	m->count++;
+	return e;
+}
+
+int manifest_set(manifest_t *m, const char *path, const struct stat *st, off_t size, uint64_t hash)
+{
+	manifest_entry_t *e;
+
+	// The file format is line based
+	if (strchr(path, '\n'))
+		return -1;
+
+	e = manifest_add(m, path);
+	if (!e)
+		return -1;
+
+	e->ino = st->st_ino;
+	e->mtime = st->st_mtim.tv_sec;
+	e->mtime_nsec = st->st_mtim.tv_nsec;
+	e->size = size;
+	e->hash = hash;
+	return 0;
+}
+
+static void manifest_parse_line(manifest_t *m, char *line)
+{
+	unsigned long long ino;
+	long long mtime;
+	long mtime_nsec;
+	long long size;
+	uint64_t hash;
+	manifest_entry_t *e;
+	int path_offset = 0;
+
+	if (sscanf(line, "%llu %lld %ld %lld %" SCNx64 " %n", &ino, &mtime, &mtime_nsec, &size, &hash, &path_offset) != 5 || path_offset == 0) {
+		wire_log(WLOG_WARNING, "Skipping bad manifest line '%s'", line);
+		return;
+	}
+
+	e = manifest_add(m, line + path_offset);
+	if (!e)
+		return;
+
+	e->ino = ino;
+	e->mtime = mtime;
+	e->mtime_nsec = mtime_nsec;
+	e->size = size;
+	e->hash = hash;
+}
+
+int manifest_load(manifest_t *m, const char *filename)
+{
+	struct stat stbuf;
+	char *buf;
+	char *line;
+	char *eol;
+	ssize_t nrcvd;
+	size_t len = 0;
+	int fd;
+
+	fd = wio_open(filename, O_RDONLY, 0);
+	if (fd < 0)
+		return -1;
+
+	if (wio_fstat(fd, &stbuf) < 0) {
+		wio_close(fd);
+		return -1;
+	}
+
+	buf = malloc(stbuf.st_size + 1);
+	if (!buf) {
+		wio_close(fd);
+		return -1;
+	}
+
+	while (len < stbuf.st_size) {
+		nrcvd = wio_read(fd, buf + len, stbuf.st_size - len);
+		if (nrcvd <= 0)
+			break;
+		len += nrcvd;
+	}
+	buf[len] = 0;
+	wio_close(fd);
+
+	for (line = buf; (eol = strchr(line, '\n')) != NULL; line = eol + 1) {
+		*eol = 0;
+		if (line[0])
+			manifest_parse_line(m, line);
+	}
+
+	free(buf);
+	return 0;
+}
+
+static int write_full(int fd, const char *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = wio_write(fd, buf, len);
+		if (ret <= 0)
+			return -1;
+		buf += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static int manifest_format_entry(char *buf, size_t buf_size, manifest_entry_t *e)
+{
+	return snprintf(buf, buf_size, "%llu %lld %ld %lld %016" PRIx64 " %s\n",
+			(unsigned long long)e->ino, (long long)e->mtime, e->mtime_nsec, (long long)e->size, e->hash, e->path);
+}
+
+// Keeps the temporary files of concurrent saves apart
+static unsigned save_seq;
+
+int manifest_save(manifest_t *m, const char *filename)
+{
+	char tmp_filename[256];
+	char buf[16*1024];
+	size_t len = 0;
+	manifest_entry_t *e;
+	unsigned i;
+	int ret = 0;
+	int fd;
+
+	// Sessions on other threads may save the same manifest at the same time
+	snprintf(tmp_filename, sizeof(tmp_filename), "%s.%d.%u", filename, (int)getpid(),
+			__atomic_add_fetch(&save_seq, 1, __ATOMIC_RELAXED));
+
+	fd = wio_open(tmp_filename, O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC, 0600);
+	if (fd < 0) {
+		wire_log(WLOG_ERR, "Failed to create manifest %s: %m", tmp_filename);
+		return -1;
+	}
+
+	for (i = 0; i < m->num_buckets && ret == 0; i++) {
+		for (e = m->buckets[i]; e && ret == 0; e = e->next) {
+			int n = manifest_format_entry(buf + len, sizeof(buf) - len, e);
+
+			if (n >= sizeof(buf) - len) {
+				ret = write_full(fd, buf, len);
+				len = 0;
+				n = manifest_format_entry(buf, sizeof(buf), e);
+				if (n >= sizeof(buf))
+					continue; // Path is too long to remember
+			}
+
+			len += n;
+		}
+	}
+
+	if (ret == 0 && len > 0)
+		ret = write_full(fd, buf, len);
+	if (ret == 0)
+		ret = wio_fsync(fd);
+	wio_close(fd);
+
+	if (ret == 0)
+		ret = rename(tmp_filename, filename);
+
+	if (ret < 0) {
+		wire_log(WLOG_ERR, "Failed to save manifest %s: %m", filename);
+		unlink(tmp_filename);
+	}
+
+	return ret;
+}
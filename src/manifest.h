@@ -0,0 +1,34 @@
+#ifndef DOCKET_MANIFEST_H
+#define DOCKET_MANIFEST_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/* A manifest remembers what was sent for every collected path so a later
+ * collection can skip files that didn't change since.
+ */
+typedef struct manifest_entry {
+	struct manifest_entry *next;
+	ino_t ino;
+	time_t mtime;
+	long mtime_nsec;
+	off_t size;
+	uint64_t hash;
+	char path[];
+} manifest_entry_t;
+
+typedef struct manifest {
+	manifest_entry_t **buckets;
+	unsigned num_buckets;
+	unsigned count;
+} manifest_t;
+
+int manifest_init(manifest_t *m);
+void manifest_free(manifest_t *m);
+int manifest_load(manifest_t *m, const char *filename);
+int manifest_save(manifest_t *m, const char *filename);
+manifest_entry_t *manifest_find(manifest_t *m, const char *path);
+int manifest_set(manifest_t *m, const char *path, const struct stat *st, off_t size, uint64_t hash);
+
+#endif
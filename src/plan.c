@@ -0,0 +1,154 @@
+#include "plan.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+static const struct {
+	const char *name;
+	int type;
+	unsigned min_args;
+} plan_types[] = {
+	{ "FILE", PLAN_FILE, 3 },
+	{ "LOG", PLAN_LOG, 3 },
+	{ "TAIL", PLAN_TAIL, 4 },
+	{ "RANGE", PLAN_RANGE, 5 },
+	{ "GLOB", PLAN_GLOB, 3 },
+	{ "TREE", PLAN_TREE, 3 },
+	{ "EXEC", PLAN_EXEC, 3 },
+	{ "FIND", PLAN_FIND, 3 },
+};
+
+/* Break up the line into the different arguments, seperated by the vertical
+ * line '|'. A backslash escapes the next character.
+ */
+static int plan_split(plan_entry_t *e, char *out, const char *line, char *error, size_t error_size)
+{
+	const char *p;
+	int escaped = 0;
+
+	e->num_args = 0;
+	e->args[e->num_args] = out;
+	for (p = line; *p; p++) {
+		if (*p == '\\' && !escaped) {
+			escaped = 1;
+			continue;
+		}
+
+		if (*p == '|' && !escaped) {
+			*out++ = 0;
+			e->num_args++;
+			if (e->num_args == PLAN_ARGS_MAX) {
+				snprintf(error, error_size, "Too many arguments");
+				return -1;
+			}
+			e->args[e->num_args] = out;
+			continue;
+		}
+
+		escaped = 0;
+		*out++ = *p;
+	}
+	*out = 0;
+	e->num_args++;
+	e->args[e->num_args] = NULL;
+	return 0;
+}
+
+plan_entry_t *plan_entry_parse(const char *line, char *error, size_t error_size)
+{
+	plan_entry_t *e;
+	size_t len;
+	int prio = PLAN_PRIO_DEFAULT;
+	unsigned i;
+
+	// PRIO|<n>|<collector line>, 0 runs first and 9 last
+	if (strncmp(line, "PRIO|", 5) == 0) {
+		const char *rest = strchr(line + 5, '|');
+
+		if (!rest) {
+			snprintf(error, error_size, "No collector after the priority");
+			return NULL;
+		}
+
+		if (rest != line + 6 || line[5] < '0' || line[5] > '9') {
+			snprintf(error, error_size, "Invalid priority, expected 0-9");
+			return NULL;
+		}
+
+		prio = line[5] - '0';
+		line = rest + 1;
+	}
+
+	// The line as given and then its split up arguments
+	len = strlen(line) + 1;
+	e = malloc(sizeof(*e) + 2 * len);
+	if (!e) {
+		snprintf(error, error_size, "Out of memory");
+		return NULL;
+	}
+
+	e->next = NULL;
+	e->prio = prio;
+	memcpy(e->line, line, len);
+	if (plan_split(e, e->line + len, line, error, error_size) < 0)
+		goto Error;
+
+	for (i = 0; i < sizeof(plan_types) / sizeof(plan_types[0]); i++) {
+		if (strcmp(e->args[0], plan_types[i].name) == 0)
+			break;
+	}
+
+	if (i == sizeof(plan_types) / sizeof(plan_types[0])) {
+		snprintf(error, error_size, "Unknown collector requested '%s'", e->args[0]);
+		goto Error;
+	}
+
+	if (e->num_args < plan_types[i].min_args) {
+		snprintf(error, error_size, "Not enough arguments to %s collector, got %u args", plan_types[i].name, e->num_args);
+		goto Error;
+	}
+
+	// The directory goes into every entry name and is copied into fixed buffers
+	if (strlen(e->args[1]) >= PLAN_DIR_MAX) {
+		snprintf(error, error_size, "Directory '%s' is too long", e->args[1]);
+		goto Error;
+	}
+
+	e->type = plan_types[i].type;
+	return e;
+
+Error:
+	free(e);
+	return NULL;
+}
+
+void plan_init(plan_t *plan)
+{
+	plan->head = NULL;
+	plan->tail = NULL;
+	plan->num_entries = 0;
+}
+
+void plan_add(plan_t *plan, plan_entry_t *e)
+{
+	e->next = NULL;
+	if (plan->tail)
+		plan->tail->next = e;
+	else
+		plan->head = e;
+	plan->tail = e;
+	plan->num_entries++;
+}
+
+void plan_free(plan_t *plan)
+{
+	plan_entry_t *e;
+
+	while (plan->head) {
+		e = plan->head;
+		plan->head = e->next;
+		free(e);
+	}
+	plan_init(plan);
+}
@@ -0,0 +1,50 @@
+#ifndef DOCKET_PLAN_H
+#define DOCKET_PLAN_H
+
+#include <stddef.h>
+
+/* A collector line parsed once into its type and arguments, so it can be kept
+ * and run many times without parsing it again. A plan is a list of them.
+ */
+#define PLAN_ARGS_MAX 20
+#define PLAN_DIR_MAX 128
+#define PLAN_PRIO_DEFAULT 5
+
+enum plan_type {
+	PLAN_FILE,
+	PLAN_LOG,
+	PLAN_TAIL,
+	PLAN_RANGE,
+	PLAN_GLOB,
+	PLAN_TREE,
+	PLAN_EXEC,
+	PLAN_FIND,
+};
+
+typedef struct plan_entry {
+	struct plan_entry *next;
+	int type;
+	int prio;
+	// All the parts of the line, the type and the directory first
+	unsigned num_args;
+	char *args[PLAN_ARGS_MAX + 1];
+	// The line without the priority, for the log
+	char line[];
+} plan_entry_t;
+
+typedef struct plan {
+	plan_entry_t *head;
+	plan_entry_t *tail;
+	unsigned num_entries;
+} plan_t;
+
+/* Parse a collector line, optionally prefixed with PRIO|<n>|. Returns NULL
+ * with the reason in error if it isn't a valid collector line.
+ */
+plan_entry_t *plan_entry_parse(const char *line, char *error, size_t error_size);
+
+void plan_init(plan_t *plan);
+void plan_add(plan_t *plan, plan_entry_t *e);
+void plan_free(plan_t *plan);
+
+#endif
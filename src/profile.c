@@ -0,0 +1,342 @@
+#include "profile.h"
+
+#include "wire.h"
+#include "wire_fd.h"
+#include "wire_stack.h"
+#include "wire_log.h"
+#include "wire_io.h"
+#include "macros.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+
+#define PROFILE_SUFFIX ".list"
+#define PROFILE_SIZE_MAX (1024*1024)
+
+// Sessions take profiles from all the wire threads, reloads swap the whole set
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static profile_t *profiles;
+
+// Only used by the watcher after the first load
+static char profile_dir[256];
+static wire_t watch_wire;
+static int hup_fd = -1;
+
+/* The first load runs in main before there are any wires, reloads run on the
+ * watcher wire and go through wio so a slow disk doesn't stall its thread.
+ */
+static int on_wire;
+
+static DIR *profile_opendir(const char *dir)
+{
+	return on_wire ? wio_opendir(dir) : opendir(dir);
+}
+
+static struct dirent *profile_readdir(DIR *d)
+{
+	return on_wire ? wio_readdir(d) : readdir(d);
+}
+
+static void profile_closedir(DIR *d)
+{
+	if (on_wire)
+		wio_closedir(d);
+	else
+		closedir(d);
+}
+
+// Read the whole file into a NUL terminated buffer that the caller frees
+static char *profile_read_file(const char *path)
+{
+	char *buf = NULL;
+	ssize_t ret;
+	size_t len = 0;
+	int fd;
+
+	fd = on_wire ? wio_open(path, O_RDONLY|O_CLOEXEC, 0) : open(path, O_RDONLY|O_CLOEXEC);
+	if (fd < 0) {
+		wire_log(WLOG_ERR, "Failed to open profile %s: %m", path);
+		return NULL;
+	}
+
+	buf = malloc(PROFILE_SIZE_MAX + 1);
+	if (!buf) {
+		wire_log(WLOG_ERR, "Out of memory for profile %s", path);
+		goto Done;
+	}
+
+	while (len < PROFILE_SIZE_MAX) {
+		ret = on_wire ? wio_read(fd, buf + len, PROFILE_SIZE_MAX - len) : read(fd, buf + len, PROFILE_SIZE_MAX - len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0) {
+			wire_log(WLOG_ERR, "Failed to read profile %s: %m", path);
+			free(buf);
+			buf = NULL;
+			goto Done;
+		}
+		if (ret == 0)
+			break;
+		len += ret;
+	}
+
+	if (len == PROFILE_SIZE_MAX)
+		wire_log(WLOG_WARNING, "Profile %s is larger than %d bytes, only its start is used", path, PROFILE_SIZE_MAX);
+	buf[len] = 0;
+
+Done:
+	if (on_wire)
+		wio_close(fd);
+	else
+		close(fd);
+	return buf;
+}
+
+static int profile_name_valid(const char *name, size_t len)
+{
+	size_t i;
+
+	if (len == 0 || len >= sizeof(((profile_t *)0)->name) || name[0] == '.')
+		return 0;
+
+	for (i = 0; i < len; i++) {
+		if (!isalnum(name[i]) && name[i] != '_' && name[i] != '-' && name[i] != '.')
+			return 0;
+	}
+
+	return 1;
+}
+
+static void profile_free(profile_t *p)
+{
+	plan_free(&p->plan);
+	free(p);
+}
+
+static void profile_free_all(profile_t *p)
+{
+	profile_t *next;
+
+	for (; p; p = next) {
+		next = p->next;
+		profile_put(p);
+	}
+}
+
+// Lines are the same as a list a client sends, only collector lines go in it
+// The name is the file name without the suffix
+static profile_t *profile_read(const char *dir, const char *filename, size_t name_len)
+{
+	char path[512];
+	char error[128];
+	char *data;
+	char *line;
+	char *eol;
+	unsigned lineno = 0;
+	plan_entry_t *e;
+	profile_t *p;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, filename);
+	data = profile_read_file(path);
+	if (!data)
+		return NULL;
+
+	p = malloc(sizeof(*p));
+	if (!p) {
+		wire_log(WLOG_ERR, "Out of memory for profile %s", path);
+		free(data);
+		return NULL;
+	}
+
+	p->next = NULL;
+	p->refs = 1;
+	plan_init(&p->plan);
+	memcpy(p->name, filename, name_len);
+	p->name[name_len] = 0;
+
+	for (line = data; *line; line = eol) {
+		lineno++;
+		eol = strchr(line, '\n');
+		if (eol)
+			*eol++ = 0;
+		else
+			eol = line + strlen(line);
+
+		if (strcmp(line, "EOF") == 0)
+			break;
+
+		// Skip empty lines and comments
+		if (line[0] == 0 || line[0] == '#')
+			continue;
+
+		e = plan_entry_parse(line, error, sizeof(error));
+		if (!e) {
+			wire_log(WLOG_WARNING, "Profile %s line %u skipped: %s", path, lineno, error);
+			continue;
+		}
+		plan_add(&p->plan, e);
+	}
+
+	free(data);
+	return p;
+}
+
+static int profile_load_dir(const char *dir)
+{
+	profile_t *new_profiles = NULL;
+	profile_t *old_profiles;
+	profile_t *p;
+	struct dirent *ent;
+	size_t name_len;
+	unsigned count = 0;
+	DIR *d;
+
+	d = profile_opendir(dir);
+	if (!d) {
+		// Not having any profiles is fine, they are optional
+		if (errno != ENOENT)
+			wire_log(WLOG_ERR, "Failed to open the profile directory %s: %m", dir);
+	} else {
+		while ((ent = profile_readdir(d)) != NULL) {
+			name_len = strlen(ent->d_name);
+			if (name_len <= strlen(PROFILE_SUFFIX) || strcmp(ent->d_name + name_len - strlen(PROFILE_SUFFIX), PROFILE_SUFFIX) != 0)
+				continue;
+
+			name_len -= strlen(PROFILE_SUFFIX);
+			if (!profile_name_valid(ent->d_name, name_len)) {
+				wire_log(WLOG_WARNING, "Invalid profile name %s in %s", ent->d_name, dir);
+				continue;
+			}
+
+			p = profile_read(dir, ent->d_name, name_len);
+			if (!p)
+				continue;
+
+			p->next = new_profiles;
+			new_profiles = p;
+			count++;
+		}
+		profile_closedir(d);
+	}
+
+	pthread_mutex_lock(&lock);
+	old_profiles = profiles;
+	profiles = new_profiles;
+	pthread_mutex_unlock(&lock);
+
+	// Sessions that still hold an old profile free it when they are done
+	profile_free_all(old_profiles);
+
+	wire_log(WLOG_INFO, "Loaded %u profiles from %s", count, dir);
+	return d ? (int)count : -1;
+}
+
+int profile_load(const char *dir)
+{
+	snprintf(profile_dir, sizeof(profile_dir), "%s", dir);
+	return profile_load_dir(profile_dir);
+}
+
+profile_t *profile_get(const char *name)
+{
+	profile_t *p;
+
+	pthread_mutex_lock(&lock);
+	for (p = profiles; p; p = p->next) {
+		if (strcmp(p->name, name) == 0) {
+			p->refs++;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&lock);
+
+	return p;
+}
+
+void profile_put(profile_t *p)
+{
+	int refs;
+
+	pthread_mutex_lock(&lock);
+	refs = --p->refs;
+	pthread_mutex_unlock(&lock);
+
+	if (refs == 0)
+		profile_free(p);
+}
+
+/* SIGHUP can land on any thread, the handler only wakes the watcher. The
+ * signal is never blocked so the commands we spawn get the default mask.
+ */
+static void profile_sighup(int sig)
+{
+	uint64_t one = 1;
+	int saved_errno = errno;
+	ssize_t ret;
+
+	UNUSED(sig);
+
+	// Only fails when the counter is full, a reload is pending then anyway
+	ret = write(hup_fd, &one, sizeof(one));
+	UNUSED(ret);
+	errno = saved_errno;
+}
+
+static void profile_watch(void *arg)
+{
+	wire_fd_state_t fd_state;
+	uint64_t count;
+	ssize_t len;
+
+	UNUSED(arg);
+
+	on_wire = 1;
+	wire_fd_mode_init(&fd_state, hup_fd);
+	wire_fd_mode_read(&fd_state);
+
+	while (1) {
+		wire_fd_wait(&fd_state);
+
+		len = read(hup_fd, &count, sizeof(count));
+		if (len < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			wire_log(WLOG_ERR, "Failed to read the SIGHUP count: %m");
+			break;
+		}
+
+		wire_log(WLOG_INFO, "Got SIGHUP, reloading profiles");
+		profile_load_dir(profile_dir);
+	}
+
+	wire_fd_mode_none(&fd_state);
+}
+
+void profile_watch_start(void)
+{
+	struct sigaction sa;
+
+	hup_fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	if (hup_fd < 0) {
+		wire_log(WLOG_ERR, "Failed to watch for SIGHUP, profiles will not be reloaded: %m");
+		return;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = profile_sighup;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGHUP, &sa, NULL);
+
+	wire_init(&watch_wire, "profile watch", profile_watch, NULL, WIRE_STACK_ALLOC(32*1024));
+}
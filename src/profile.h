@@ -0,0 +1,34 @@
+#ifndef DOCKET_PROFILE_H
+#define DOCKET_PROFILE_H
+
+#include "plan.h"
+
+/* Named collection lists kept by the daemon, a client asks for one with
+ * PROFILE|<name> instead of sending all its lines. Every <name>.list file in
+ * the profile directory is parsed into a plan at startup and again on SIGHUP,
+ * the profiles are shared by all the wire threads.
+ */
+#define PROFILE_DIR "/etc/docket/profiles"
+
+typedef struct profile {
+	struct profile *next;
+	int refs;
+	plan_t plan;
+	char name[64];
+} profile_t;
+
+// Load the profiles from dir, replacing the ones loaded before
+int profile_load(const char *dir);
+
+/* Reload on SIGHUP from a wire on the current wire thread, only one thread
+ * should do it. The reloads read the files through wio.
+ */
+void profile_watch_start(void);
+
+/* Find a profile by name and hold it, it stays valid until it is put back
+ * even if a reload replaces it.
+ */
+profile_t *profile_get(const char *name);
+void profile_put(profile_t *p);
+
+#endif
@@ -1,30 +1,67 @@
 #include "special_arg.h"
-#include "dev_list.h"
+#include "dev_map.h"
 
 #include "wire_io.h"
 #include "wire_log.h"
 
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 
 #define ARRAY_SIZE(a) (sizeof(a)/sizeof(a[0]))
 
-static int special_arg_net(char **items, unsigned items_size, unsigned item_size)
+// A sanity cap, no host has more of any kind
+#define SPECIAL_ARG_ITEMS_MAX 4096
+
+static int special_arg_add(special_arg_list_t *list, const char *value)
+{
+	char **items;
+	unsigned size;
+
+	if (list->count == SPECIAL_ARG_ITEMS_MAX)
+		return -1;
+
+	if (list->count == list->size) {
+		size = list->size ? list->size * 2 : 16;
+		items = realloc(list->items, size * sizeof(*items));
+		if (!items)
+			return -1;
+		list->items = items;
+		list->size = size;
+	}
+
+	list->items[list->count] = strdup(value);
+	if (!list->items[list->count])
+		return -1;
+	list->count++;
+	return 0;
+}
+
+static int special_arg_has(special_arg_list_t *list, const char *value)
+{
+	unsigned i;
+
+	for (i = 0; i < list->count; i++) {
+		if (strcmp(list->items[i], value) == 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+static void special_arg_net(special_arg_list_t *list)
 {
 	struct ifaddrs *ifaddr;
 	struct ifaddrs *ifa;
 	int ret;
-	int n;
-	int items_len = 0;
-	int item_idx;
 
 	ret = wio_getifaddrs(&ifaddr);
 	if (ret < 0) {
 		wire_log(WLOG_ERR, "Failed to get interface address info: %d (%m)", errno);
-		return 0;
+		return;
 	}
 
-	for (ifa = ifaddr, n = 0; items_len < items_size && ifa != NULL; ifa = ifa->ifa_next, n++) {
+	for (ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next) {
 		if (ifa->ifa_addr == NULL)
 			continue;
 
@@ -36,27 +73,14 @@ static int special_arg_net(char **items, unsigned items_size, unsigned item_size
 		if (colon)
 			*colon = 0;
 
-		int found = 0;
-		for (item_idx = 0; item_idx < items_len; item_idx++) {
-			if (strcmp(ifa->ifa_name, items[item_idx]) == 0) {
-				found = 1;
-				break;
-			}
-		}
-
-		if (!found) {
-			strncpy(items[items_len], ifa->ifa_name, item_size);
-			items[items_len][item_size-1] = 0;
-			items_len++;
-		}
+		if (!special_arg_has(list, ifa->ifa_name) && special_arg_add(list, ifa->ifa_name) < 0)
+			break;
 	}
 
 	freeifaddrs(ifaddr);
-
-	return items_len;
 }
 
-static int find_dev_path(char *dev_path, unsigned dev_path_sz, const char *dev_name)
+static int find_dev_path(char *dev_path, unsigned dev_path_sz, const char *dev_name, int is_blk)
 {
 	int ret;
 	char dev_num[32];
@@ -77,71 +101,120 @@ static int find_dev_path(char *dev_path, unsigned dev_path_sz, const char *dev_n
 		return -1;
 	}
 
-	dev_list_t *dev_list = dev_list_get();
-	dev_list_t *n;
-	ret = -1;
-
-	for (n = dev_list; n; n = n->next) {
-		if (n->major == dev_major && n->minor == dev_minor) {
-			strncpy(dev_path, n->name, dev_path_sz);
-			dev_path[dev_path_sz-1] = 0;
-			ret = 0;
-			break;
-		}
-	}
-
-	dev_list_release(dev_list);
-	return ret;
+	return dev_map_find(dev_major, dev_minor, is_blk, dev_path, dev_path_sz);
 }
 
-static int special_arg_block(char **items, unsigned items_size, unsigned item_size)
+// The device nodes of the sysfs dev files matching pattern
+static void special_arg_devs(special_arg_list_t *list, const char *pattern, const char *skip, int is_blk)
 {
-#define BASE_PATH "/sys/block"
-	int num_items = 0;
+	char dev_path[128];
+	glob_t globbuf;
 	int ret;
 	int i;
-	glob_t globbuf;
 
-	ret = wio_glob(BASE_PATH "/*/dev", GLOB_NOSORT, NULL, &globbuf);
-	if (ret < 0) {
-		wire_log(WLOG_ERR, "Failed to list files in " BASE_PATH ": %d (%m)", errno);
-		return 0;
+	ret = wio_glob(pattern, 0, NULL, &globbuf);
+	if (ret == GLOB_NOMATCH)
+		return;
+	if (ret != 0) {
+		wire_log(WLOG_ERR, "Failed to list files in %s: %d (%m)", pattern, errno);
+		return;
 	}
 
-	for (i = 0; i < globbuf.gl_pathc && num_items < items_size; i++) {
-		if (strncmp(globbuf.gl_pathv[i], BASE_PATH "/loop", strlen(BASE_PATH "/loop")) == 0)
-			continue; // Skip loopback devices
+	for (i = 0; i < globbuf.gl_pathc; i++) {
+		if (skip && strncmp(globbuf.gl_pathv[i], skip, strlen(skip)) == 0)
+			continue;
 
-		ret = find_dev_path(items[num_items], item_size, globbuf.gl_pathv[i]);
-		if (ret == 0)
-			num_items++;
+		ret = find_dev_path(dev_path, sizeof(dev_path), globbuf.gl_pathv[i], is_blk);
+		if (ret == 0 && special_arg_add(list, dev_path) < 0)
+			break;
 	}
 
 	wio_globfree(&globbuf);
-	return num_items;
 }
 
-int special_arg_match(const char *name, char **items, unsigned items_size, unsigned item_size)
+static void special_arg_block(special_arg_list_t *list)
 {
-	static const struct {
-		const char *name;
-		int (*func)(char **items, unsigned items_size, unsigned item_size);
-	} specials[] = {
-		{"%BLOCK", special_arg_block},
-//TODO:		{"%SES", special_arg_ses},
-//TODO:		{"%SCSI", special_arg_scsi},
-		{"%NET", special_arg_net},
-	};
+	// Skip loopback devices
+	special_arg_devs(list, "/sys/block/*/dev", "/sys/block/loop", 1);
+}
 
-	if (name[0] != '%')
-		return 0;
+static void special_arg_scsi(special_arg_list_t *list)
+{
+	special_arg_devs(list, "/sys/class/scsi_generic/*/dev", NULL, 0);
+}
+
+// The SCSI generic nodes of the enclosures, for sg_ses
+static void special_arg_ses(special_arg_list_t *list)
+{
+	special_arg_devs(list, "/sys/class/enclosure/*/device/scsi_generic/*/dev", NULL, 0);
+}
+
+static const struct {
+	const char *name;
+	void (*func)(special_arg_list_t *list);
+} specials[] = {
+	{"%BLOCK", special_arg_block},
+	{"%SES", special_arg_ses},
+	{"%SCSI", special_arg_scsi},
+	{"%NET", special_arg_net},
+};
+
+void special_arg_cache_init(special_arg_cache_t *cache)
+{
+	cache->lists = NULL;
+	wire_lock_init(&cache->lock);
+}
 
+void special_arg_cache_free(special_arg_cache_t *cache)
+{
+	special_arg_list_t *list;
+	unsigned i;
+
+	while (cache->lists) {
+		list = cache->lists;
+		cache->lists = list->next;
+		for (i = 0; i < list->count; i++)
+			free(list->items[i]);
+		free(list->items);
+		free(list);
+	}
+}
+
+const special_arg_list_t *special_arg_get(special_arg_cache_t *cache, const char *name)
+{
+	special_arg_list_t *list;
 	int j;
+
+	if (name[0] != '%')
+		return NULL;
+
 	for (j = 0; j < ARRAY_SIZE(specials); j++) {
-		if (strcmp(name, specials[j].name) == 0) {
-			return specials[j].func(items, items_size, item_size);
-		}
+		if (strcmp(name, specials[j].name) == 0)
+			break;
 	}
+	if (j == ARRAY_SIZE(specials))
+		return NULL;
 
-	return 0;
+	// Enumeration yields, the other collectors of the session wait for it
+	wire_lock_take(&cache->lock);
+
+	for (list = cache->lists; list; list = list->next) {
+		if (list->name == specials[j].name)
+			goto Exit;
+	}
+
+	list = calloc(1, sizeof(*list));
+	if (!list) {
+		wire_log(WLOG_ERR, "Out of memory for special argument %s", name);
+		goto Exit;
+	}
+
+	list->name = specials[j].name;
+	specials[j].func(list);
+	list->next = cache->lists;
+	cache->lists = list;
+
+Exit:
+	wire_lock_release(&cache->lock);
+	return list;
 }
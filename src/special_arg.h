@@ -1,6 +1,31 @@
 #ifndef DOCKET_SPECIAL_ARG_H
 #define DOCKET_SPECIAL_ARG_H
 
-int special_arg_match(const char *name, char **items, unsigned items_size, unsigned item_size);
+#include "wire_lock.h"
+
+/* Special arguments like %BLOCK stand for all the values of a kind on the
+ * system. The values are enumerated the first time a session asks for them
+ * and kept for the rest of the session.
+ */
+typedef struct special_arg_list {
+	struct special_arg_list *next;
+	const char *name;
+	unsigned count;
+	unsigned size;
+	char **items;
+} special_arg_list_t;
+
+typedef struct special_arg_cache {
+	special_arg_list_t *lists;
+	wire_lock_t lock;
+} special_arg_cache_t;
+
+void special_arg_cache_init(special_arg_cache_t *cache);
+void special_arg_cache_free(special_arg_cache_t *cache);
+
+/* The values of name, NULL if it isn't a special argument. The list stays
+ * valid until the cache is freed.
+ */
+const special_arg_list_t *special_arg_get(special_arg_cache_t *cache, const char *name);
 
 #endif
@@ -0,0 +1,39 @@
+#include "spool.h"
+
+#include "wire_io.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+int spool_open(const char *dir)
+{
+	char filename[256];
+	int fd;
+
+	snprintf(filename, sizeof(filename), "%s/docket-spool-XXXXXX", dir);
+	fd = mkostemp(filename, O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	// Nobody else needs to see it and it goes away with us
+	unlink(filename);
+	return fd;
+}
+
+int spool_write(int fd, const char *buf, size_t len, off_t offset)
+{
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = wio_pwrite(fd, buf, len, offset);
+		if (ret <= 0)
+			return -1;
+		buf += ret;
+		len -= ret;
+		offset += ret;
+	}
+
+	return 0;
+}
@@ -0,0 +1,13 @@
+#ifndef DOCKET_SPOOL_H
+#define DOCKET_SPOOL_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/* Spool files hold data that doesn't fit in memory until it can be sent, they
+ * are unlinked right away so they go away with the process.
+ */
+int spool_open(const char *dir);
+int spool_write(int fd, const char *buf, size_t len, off_t offset);
+
+#endif
@@ -5,34 +5,209 @@
 #include <memory.h>
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #define DEFAULT_MODE "0000666"
 #define DEFAULT_UID  "0000000"
 #define DEFAULT_USTAR "ustar"
 
-void tar_set_header(struct tar *hdr, const char *prefix, const char *dir, const char *filename, unsigned filesize, unsigned timestamp)
+static void tar_set_checksum(struct tar *hdr)
+{
+	int i;
+	unsigned checksum = 0;
+
+	memset(hdr->checksum, ' ', sizeof(hdr->checksum));
+	for (i = 0; i < sizeof(hdr->pad); i++)
+		checksum += hdr->pad[i];
+	snprintf(hdr->checksum, sizeof(hdr->checksum), "%07o", checksum);
+}
+
+// Sizes from 8GB on don't fit the octal field
+#define TAR_OCTAL_SIZE_MAX 077777777777ULL
+
+static void tar_set_filesize(struct tar *hdr, uint64_t filesize)
+{
+	int i;
+
+	if (filesize <= TAR_OCTAL_SIZE_MAX) {
+		snprintf(hdr->filesize, sizeof(hdr->filesize), "%011llo", (unsigned long long)filesize);
+		return;
+	}
+
+	// Base-256 for readers that don't know PAX, the PAX size overrides it
+	memset(hdr->filesize, 0, sizeof(hdr->filesize));
+	for (i = sizeof(hdr->filesize) - 1; i > 0 && filesize; i--) {
+		hdr->filesize[i] = filesize & 0xff;
+		filesize >>= 8;
+	}
+	hdr->filesize[0] = (char)0x80;
+}
+
+static void tar_set_ustar(struct tar *hdr, const char *filename, uint64_t filesize, time_t timestamp, char filetype)
 {
 	assert(sizeof(*hdr) == 512);
 	memset(hdr, 0, sizeof(*hdr));
 
-	wire_log(WLOG_DEBUG, "tar header for ./%s/%s/%s file size %u timestamp %u", prefix, dir, filename, filesize, timestamp);
-
-	snprintf(hdr->filename, sizeof(hdr->filename), "./%s/%s/%s", prefix, dir, filename);
+	snprintf(hdr->filename, sizeof(hdr->filename), "%s", filename);
 	memcpy(hdr->mode, DEFAULT_MODE, sizeof(DEFAULT_MODE)); assert(sizeof(DEFAULT_MODE) == sizeof(hdr->mode));
 	memcpy(hdr->uid, DEFAULT_UID, sizeof(DEFAULT_UID)); assert(sizeof(DEFAULT_UID) == sizeof(hdr->uid));
 	memcpy(hdr->gid, DEFAULT_UID, sizeof(DEFAULT_UID)); assert(sizeof(DEFAULT_UID) == sizeof(hdr->gid));
-    snprintf(hdr->filesize, sizeof(hdr->filesize), "%011o", filesize);
-	snprintf(hdr->timestamp, sizeof(hdr->timestamp), "%011o", timestamp);
-	hdr->filetype = TAR_NORMAL;
+	tar_set_filesize(hdr, filesize);
+	snprintf(hdr->timestamp, sizeof(hdr->timestamp), "%011llo", (unsigned long long)timestamp);
+	hdr->filetype = filetype;
 	memcpy(hdr->ustar, DEFAULT_USTAR, sizeof(DEFAULT_USTAR)); assert(sizeof(DEFAULT_USTAR) == sizeof(hdr->ustar));
 	hdr->ver[0] = '0';
 	hdr->ver[1] = '0';
 
-	// Calculate and set the checksum
-	memset(hdr->checksum, ' ', sizeof(hdr->checksum));
+	tar_set_checksum(hdr);
+}
+
+/* A PAX record is "<len> <key>=<value>\n" where len counts the whole record,
+ * including its own digits.
+ */
+static size_t tar_pax_record(char *buf, size_t buf_size, const char *key, const char *value)
+{
+	size_t base = strlen(key) + strlen(value) + 3;
+	size_t len = base + 1;
+	char digits[24];
+
+	while (base + snprintf(digits, sizeof(digits), "%zu", len) != len)
+		len = base + strlen(digits);
+
+	if (len >= buf_size)
+		return 0;
+
+	snprintf(buf, buf_size, "%zu %s=%s\n", len, key, value);
+	return len;
+}
+
+size_t tar_build_header(void *buf, size_t buf_size, const char *prefix, const char *dir, const char *filename, uint64_t filesize, const struct timespec *mtime)
+{
+	char path[TAR_PATH_MAX];
+	char value[32];
+	char *pax;
+	size_t pax_len = 0;
+	size_t pax_size;
+	int path_len;
+
+	assert(buf_size >= TAR_HEADER_MAX);
+
+	// The callers bound the prefix, the directory and the name to fit
+	path_len = snprintf(path, sizeof(path), "./%s/%s/%s", prefix, dir, filename);
+	assert(path_len < sizeof(path));
+
+	wire_log(WLOG_DEBUG, "tar header for %s file size %llu timestamp %lld", path, (unsigned long long)filesize, (long long)mtime->tv_sec);
+
+	if (filesize <= TAR_OCTAL_SIZE_MAX && path_len < sizeof(((struct tar *)0)->filename)) {
+		tar_set_ustar(buf, path, filesize, mtime->tv_sec, TAR_NORMAL);
+		return sizeof(struct tar);
+	}
+
+	// The records go in the blocks after the extended header
+	pax = (char *)buf + sizeof(struct tar);
+	pax_size = buf_size - 2 * sizeof(struct tar);
+
+	snprintf(value, sizeof(value), "%llu", (unsigned long long)filesize);
+	pax_len += tar_pax_record(pax + pax_len, pax_size - pax_len, "size", value);
+	pax_len += tar_pax_record(pax + pax_len, pax_size - pax_len, "path", path);
+	snprintf(value, sizeof(value), "%lld.%09ld", (long long)mtime->tv_sec, mtime->tv_nsec);
+	pax_len += tar_pax_record(pax + pax_len, pax_size - pax_len, "mtime", value);
+
+	memset(pax + pax_len, 0, tar_padded(pax_len) - pax_len);
+
+	tar_set_ustar(buf, "././@PaxHeader", pax_len, mtime->tv_sec, TAR_PAX_HEADER);
+	tar_set_ustar((struct tar *)(pax + tar_padded(pax_len)), path, filesize, mtime->tv_sec, TAR_NORMAL);
+	return 2 * sizeof(struct tar) + tar_padded(pax_len);
+}
+
+/* Turn the header of a regular file into a hard link to an earlier entry of
+ * the archive, the link has no data of its own.
+ */
+int tar_set_hardlink(struct tar *hdr, const char *target)
+{
+	if (strlen(target) > sizeof(hdr->linked_file))
+		return -1;
+
+	memset(hdr->linked_file, 0, sizeof(hdr->linked_file));
+	memcpy(hdr->linked_file, target, strlen(target));
+	snprintf(hdr->filesize, sizeof(hdr->filesize), "%011o", 0);
+	hdr->filetype = TAR_HARDLINK;
+	tar_set_checksum(hdr);
+	return 0;
+}
+
+uint64_t tar_get_filesize(const struct tar *hdr)
+{
+	const unsigned char *field = (const unsigned char *)hdr->filesize;
+	uint64_t file_len = 0;
 	int i;
-	unsigned checksum = 0;
-	for (i = 0; i < sizeof(hdr->pad); i++)
-		checksum += hdr->pad[i];
-	snprintf(hdr->checksum, sizeof(hdr->checksum), "%07o", checksum);
+
+	if (field[0] & 0x80) {
+		// Base-256, the first byte only carries the marker
+		for (i = 1; i < sizeof(hdr->filesize); i++)
+			file_len = (file_len << 8) | field[i];
+		return file_len;
+	}
+
+	for (i = 0; i < sizeof(hdr->filesize) && hdr->filesize[i] >= '0' && hdr->filesize[i] <= '7'; i++) {
+		unsigned digit = hdr->filesize[i] - '0';
+		file_len *= 8;
+		file_len += digit;
+	}
+
+	return file_len;
+}
+
+static int tar_pax_size(const char *pax, size_t pax_len, uint64_t *size)
+{
+	const char *end = pax + pax_len;
+	unsigned long long rec_len;
+	char *p;
+
+	while (pax < end && *pax) {
+		rec_len = strtoull(pax, &p, 10);
+		if (rec_len == 0 || rec_len > end - pax || *p != ' ')
+			return -1;
+
+		if (strncmp(p + 1, "size=", 5) == 0)
+			*size = strtoull(p + 6, NULL, 10);
+
+		pax += rec_len;
+	}
+
+	return 0;
+}
+
+ssize_t tar_entry_header_len(const void *buf, size_t len, uint64_t *data_len)
+{
+	const struct tar *hdr = buf;
+	uint64_t pax_len;
+	uint64_t size;
+
+	if (len < sizeof(*hdr))
+		return 0;
+
+	// The end of archive marker or garbage
+	if (hdr->filename[0] == 0)
+		return -1;
+
+	if (hdr->filetype != TAR_PAX_HEADER) {
+		*data_len = tar_get_filesize(hdr);
+		return sizeof(*hdr);
+	}
+
+	pax_len = tar_get_filesize(hdr);
+	if (pax_len > TAR_HEADER_MAX - 2 * sizeof(*hdr))
+		return -1;
+	if (len < 2 * sizeof(*hdr) + tar_padded(pax_len))
+		return 0;
+
+	hdr = (const struct tar *)((const char *)buf + sizeof(*hdr) + tar_padded(pax_len));
+	size = tar_get_filesize(hdr);
+	if (tar_pax_size((const char *)buf + sizeof(*hdr), pax_len, &size) < 0)
+		return -1;
+
+	*data_len = size;
+	return 2 * sizeof(*hdr) + tar_padded(pax_len);
 }
@@ -1,6 +1,10 @@
 #ifndef DOCKET_TAR_H
 #define DOCKET_TAR_H
 
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
 #pragma pack(1)
 struct tar {
 	union {
@@ -36,8 +40,33 @@ enum tar_file_type {
 	TAR_DIRECTORY = '5',
 	TAR_FIFO = '6',
 	TAR_CONTIG_FILE = '7',
+	TAR_PAX_HEADER = 'x',
 };
 
-void tar_set_header(struct tar *hdr, const char *prefix, const char *dir, const char *filename, unsigned filesize, unsigned timestamp);
+/* Room for the headers of any entry we build, a PAX extended header with its
+ * records and the ustar header that follows it. Paths are never cut short,
+ * the collectors skip a file whose entry name would not fit.
+ */
+#define TAR_PATH_MAX 4096
+#define TAR_HEADER_MAX (3*512 + TAR_PATH_MAX + 512)
+
+/* Build the header of an entry into buf and return its length, a multiple of
+ * 512. A PAX extended header goes in front of the ustar header when the size
+ * or the path don't fit in it, it also carries the mtime at full precision.
+ */
+size_t tar_build_header(void *buf, size_t buf_size, const char *prefix, const char *dir, const char *filename, uint64_t filesize, const struct timespec *mtime);
+uint64_t tar_get_filesize(const struct tar *hdr);
+int tar_set_hardlink(struct tar *hdr, const char *target);
+
+/* Parse the headers at the start of an entry. Returns the length of the
+ * headers and sets data_len to the size of the data that follows them, 0 if
+ * more than len bytes are needed to tell or -1 if it isn't a valid entry.
+ */
+ssize_t tar_entry_header_len(const void *buf, size_t len, uint64_t *data_len);
+
+static inline uint64_t tar_padded(uint64_t len)
+{
+	return (len + 511) & ~(uint64_t)511;
+}
 
 #endif
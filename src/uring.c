@@ -0,0 +1,613 @@
+#include "uring.h"
+
+#include "wire.h"
+#include "wire_fd.h"
+#include "wire_wait.h"
+#include "wire_stack.h"
+#include "wire_log.h"
+#include "macros.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <linux/io_uring.h>
+
+// Files read at once per thread, each one holds a direct descriptor slot
+#define URING_FILES 64
+#define URING_ENTRIES 512
+
+enum uring_op {
+	URING_OP_STATX,
+	URING_OP_OPEN,
+	URING_OP_READ,
+	URING_OP_PROBE,
+	URING_OP_CLOSE,
+	URING_OPS,
+};
+
+/* user_data carries the request and the op in its low bits, a close isn't
+ * waited for and carries its slot instead of a request.
+ */
+#define URING_OP_BITS 3
+#define URING_OP_MASK 7
+
+typedef struct uring_req {
+	wire_wait_t wait;
+	int pending;
+	int res[URING_OPS];
+	struct statx stx;
+	char probe[1];
+} __attribute__((aligned(8))) uring_req_t;
+
+typedef struct uring {
+	int fd;
+	int event_fd;
+	int disabled;
+
+	void *ring_map;
+	size_t ring_map_size;
+	size_t sqes_size;
+
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned sq_entries;
+	unsigned to_submit;
+
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	unsigned free_slots[URING_FILES];
+	unsigned num_free;
+	wire_wait_t slot_wait;
+
+	wire_wait_t submit_wait;
+	wire_t submit_wire;
+	wire_t reap_wire;
+} uring_t;
+
+static __thread uring_t *ring;
+
+// Freeing a slot is an update of the file table to no file
+static const int no_file = -1;
+
+static int uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned to_submit)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, 0, 0, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// Caller made sure there is room, the kernel only looks at it on the next submit
+static struct io_uring_sqe *uring_get_sqe(uring_t *r)
+{
+	unsigned tail = *r->sq_tail;
+	unsigned idx = tail & *r->sq_mask;
+	struct io_uring_sqe *sqe = &r->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	r->sq_array[idx] = idx;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	r->to_submit++;
+	return sqe;
+}
+
+// A free slot also means there is room in the rings for the request
+static unsigned uring_slot_get(uring_t *r)
+{
+	while (r->num_free == 0) {
+		wire_wait_reset(&r->slot_wait);
+		wire_wait_single(&r->slot_wait);
+	}
+
+	return r->free_slots[--r->num_free];
+}
+
+static void uring_slot_put(uring_t *r, unsigned slot)
+{
+	r->free_slots[r->num_free++] = slot;
+	wire_wait_resume(&r->slot_wait);
+}
+
+/* The kernel didn't take what is still queued and never will, fail those
+ * requests so their wires go on through the I/O threads.
+ */
+static void uring_fail_queued(uring_t *r)
+{
+	unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+	unsigned tail = *r->sq_tail;
+	struct io_uring_sqe *sqe;
+	uring_req_t *req;
+
+	for (; head != tail; head++) {
+		sqe = &r->sqes[r->sq_array[head & *r->sq_mask]];
+		if ((sqe->user_data & URING_OP_MASK) == URING_OP_CLOSE) {
+			uring_slot_put(r, sqe->user_data >> URING_OP_BITS);
+			continue;
+		}
+		req = (uring_req_t *)(uintptr_t)(sqe->user_data & ~(uint64_t)URING_OP_MASK);
+		req->res[sqe->user_data & URING_OP_MASK] = -EIO;
+		if (--req->pending == 0)
+			wire_wait_resume(&req->wait);
+	}
+
+	r->to_submit = 0;
+}
+
+/* Submits everything the wires queued since it last ran, so a burst of small
+ * files costs one syscall.
+ */
+static void uring_submit_run(void *arg)
+{
+	uring_t *r = arg;
+	int ret;
+
+	while (1) {
+		wire_wait_reset(&r->submit_wait);
+
+		while (r->to_submit > 0) {
+			ret = uring_enter(r->fd, r->to_submit);
+			if (ret < 0) {
+				if (errno == EINTR)
+					continue;
+				if (errno == EAGAIN || errno == EBUSY) {
+					// Let the completions drain first
+					wire_yield();
+					continue;
+				}
+				wire_log(WLOG_ERR, "io_uring submit failed, reading files through the I/O threads: %m");
+				r->disabled = 1;
+				uring_fail_queued(r);
+				break;
+			}
+			r->to_submit -= ret;
+		}
+
+		wire_wait_single(&r->submit_wait);
+	}
+}
+
+static void uring_reap(uring_t *r)
+{
+	unsigned head = *r->cq_head;
+	unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+	struct io_uring_cqe *cqe;
+	uring_req_t *req;
+
+	for (; head != tail; head++) {
+		cqe = &r->cqes[head & *r->cq_mask];
+		if ((cqe->user_data & URING_OP_MASK) == URING_OP_CLOSE) {
+			// Nobody waits on a close, the slot is free once it is done
+			uring_slot_put(r, cqe->user_data >> URING_OP_BITS);
+			continue;
+		}
+		req = (uring_req_t *)(uintptr_t)(cqe->user_data & ~(uint64_t)URING_OP_MASK);
+		req->res[cqe->user_data & URING_OP_MASK] = cqe->res;
+		if (--req->pending == 0)
+			wire_wait_resume(&req->wait);
+	}
+
+	__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static void uring_reap_run(void *arg)
+{
+	uring_t *r = arg;
+	wire_fd_state_t fd_state;
+	uint64_t count;
+	ssize_t ret;
+
+	wire_fd_mode_init(&fd_state, r->event_fd);
+	wire_fd_mode_read(&fd_state);
+
+	while (1) {
+		wire_fd_wait(&fd_state);
+
+		ret = read(r->event_fd, &count, sizeof(count));
+		if (ret < 0 && errno != EAGAIN)
+			continue;
+
+		uring_reap(r);
+	}
+}
+
+static int uring_map(uring_t *r, struct io_uring_params *p)
+{
+	size_t sq_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+	size_t cq_size = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+	char *sq;
+	char *cq;
+
+	// Both rings share one mapping on every kernel that has direct descriptors
+	if (!(p->features & IORING_FEAT_SINGLE_MMAP))
+		return -1;
+
+	if (cq_size > sq_size)
+		sq_size = cq_size;
+
+	sq = mmap(NULL, sq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		return -1;
+	cq = sq;
+
+	r->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) {
+		r->sqes = NULL;
+		munmap(sq, sq_size);
+		return -1;
+	}
+	r->ring_map = sq;
+	r->ring_map_size = sq_size;
+
+	r->sq_head = (unsigned *)(sq + p->sq_off.head);
+	r->sq_tail = (unsigned *)(sq + p->sq_off.tail);
+	r->sq_mask = (unsigned *)(sq + p->sq_off.ring_mask);
+	r->sq_array = (unsigned *)(sq + p->sq_off.array);
+	r->sq_entries = p->sq_entries;
+
+	r->cq_head = (unsigned *)(cq + p->cq_off.head);
+	r->cq_tail = (unsigned *)(cq + p->cq_off.tail);
+	r->cq_mask = (unsigned *)(cq + p->cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq + p->cq_off.cqes);
+	return 0;
+}
+
+/* Kernels before 5.15 ignore the slot of an open and hand out a plain fd, the
+ * setup checks all pass on them so try an open into a slot once.
+ */
+static int uring_probe_direct_open(uring_t *r)
+{
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	struct io_uring_files_update up;
+	unsigned head;
+	int res;
+
+	sqe = uring_get_sqe(r);
+	sqe->opcode = IORING_OP_OPENAT;
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (uintptr_t)"/";
+	sqe->open_flags = O_RDONLY|O_DIRECTORY;
+	sqe->file_index = 1;
+
+	if (syscall(__NR_io_uring_enter, r->fd, 1, 1, IORING_ENTER_GETEVENTS, NULL, 0) != 1)
+		return -1;
+	r->to_submit = 0;
+
+	head = *r->cq_head;
+	if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+		return -1;
+	cqe = &r->cqes[head & *r->cq_mask];
+	res = cqe->res;
+	__atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+
+	if (res > 0) {
+		close(res);
+		return -1;
+	}
+	if (res < 0)
+		return -1;
+
+	memset(&up, 0, sizeof(up));
+	up.fds = (uintptr_t)&no_file;
+	uring_register(r->fd, IORING_REGISTER_FILES_UPDATE, &up, 1);
+	return 0;
+}
+
+int uring_thread_init(void)
+{
+	struct io_uring_params p;
+	int files[URING_FILES];
+	uring_t *r;
+	unsigned i;
+
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		return -1;
+	r->event_fd = -1;
+
+	memset(&p, 0, sizeof(p));
+	r->fd = uring_setup(URING_ENTRIES, &p);
+	if (r->fd < 0) {
+		wire_log(WLOG_INFO, "io_uring is not available (%m), reading files through the I/O threads");
+		goto Error;
+	}
+
+	if (!(p.features & IORING_FEAT_RW_CUR_POS) || uring_map(r, &p) < 0) {
+		wire_log(WLOG_INFO, "io_uring is too old, reading files through the I/O threads");
+		goto Error;
+	}
+
+	for (i = 0; i < URING_FILES; i++) {
+		files[i] = -1;
+		r->free_slots[i] = i;
+	}
+	r->num_free = URING_FILES;
+
+	if (uring_register(r->fd, IORING_REGISTER_FILES, files, URING_FILES) < 0) {
+		wire_log(WLOG_INFO, "io_uring has no sparse file table (%m), reading files through the I/O threads");
+		goto Error;
+	}
+
+	if (uring_probe_direct_open(r) < 0) {
+		wire_log(WLOG_INFO, "io_uring can't open into direct descriptors, reading files through the I/O threads");
+		goto Error;
+	}
+
+	r->event_fd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+	if (r->event_fd < 0 || uring_register(r->fd, IORING_REGISTER_EVENTFD, &r->event_fd, 1) < 0) {
+		wire_log(WLOG_ERR, "Failed to set up the io_uring eventfd: %m");
+		goto Error;
+	}
+
+	wire_wait_init(&r->slot_wait);
+	wire_wait_init(&r->submit_wait);
+	wire_init(&r->submit_wire, "uring submit", uring_submit_run, r, WIRE_STACK_ALLOC(4096));
+	wire_init(&r->reap_wire, "uring reap", uring_reap_run, r, WIRE_STACK_ALLOC(4096));
+	ring = r;
+	return 0;
+
+Error:
+	if (r->event_fd >= 0)
+		close(r->event_fd);
+	if (r->sqes)
+		munmap(r->sqes, r->sqes_size);
+	if (r->ring_map)
+		munmap(r->ring_map, r->ring_map_size);
+	if (r->fd >= 0)
+		close(r->fd);
+	free(r);
+	return -1;
+}
+
+static void uring_stat(struct stat *st, const struct statx *stx)
+{
+	memset(st, 0, sizeof(*st));
+	st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+	st->st_ino = stx->stx_ino;
+	st->st_mode = stx->stx_mode;
+	st->st_nlink = stx->stx_nlink;
+	st->st_uid = stx->stx_uid;
+	st->st_gid = stx->stx_gid;
+	st->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+	st->st_size = stx->stx_size;
+	st->st_blksize = stx->stx_blksize;
+	st->st_blocks = stx->stx_blocks;
+	st->st_atim.tv_sec = stx->stx_atime.tv_sec;
+	st->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+	st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+	st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+	st->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+	st->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+
+static void uring_sqe_data(struct io_uring_sqe *sqe, uring_req_t *req, enum uring_op op)
+{
+	sqe->user_data = (uint64_t)(uintptr_t)req | op;
+}
+
+static void uring_req_wait(uring_t *r, uring_req_t *req)
+{
+	wire_wait_resume(&r->submit_wait);
+	while (req->pending > 0)
+		wire_wait_single(&req->wait);
+}
+
+// Free the slot, it only goes back to the free list once the kernel is done
+static void uring_queue_close(uring_t *r, unsigned slot)
+{
+	struct io_uring_sqe *sqe;
+
+	// Not a close, that would take fd 0 on a kernel that mistook the slot
+	sqe = uring_get_sqe(r);
+	sqe->opcode = IORING_OP_FILES_UPDATE;
+	sqe->fd = -1;
+	sqe->addr = (uintptr_t)&no_file;
+	sqe->len = 1;
+	sqe->off = slot;
+	sqe->user_data = (uint64_t)slot << URING_OP_BITS | URING_OP_CLOSE;
+	wire_wait_resume(&r->submit_wait);
+}
+
+/* The read and the probe read that tells if it got to the end, the read
+ * leaves room in buf for the byte the probe may get.
+ */
+static void uring_queue_reads(uring_t *r, uring_req_t *req, int fd, int fixed, void *buf, size_t buf_size)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe(r);
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = buf_size - 1;
+	sqe->off = (uint64_t)-1;
+	sqe->flags = IOSQE_IO_HARDLINK | (fixed ? IOSQE_FIXED_FILE : 0);
+	uring_sqe_data(sqe, req, URING_OP_READ);
+
+	// Pseudo files may be short on one read, only an empty read tells the end
+	sqe = uring_get_sqe(r);
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)req->probe;
+	sqe->len = sizeof(req->probe);
+	sqe->off = (uint64_t)-1;
+	sqe->flags = fixed ? IOSQE_FIXED_FILE : 0;
+	uring_sqe_data(sqe, req, URING_OP_PROBE);
+}
+
+// Sets more when the probe got a byte, the file goes on after it
+static ssize_t uring_read_result(uring_req_t *req, char *buf, int *more)
+{
+	ssize_t len = req->res[URING_OP_READ];
+
+	*more = 0;
+	if (len < 0) {
+		errno = -len;
+		return -1;
+	}
+
+	if (req->res[URING_OP_PROBE] < 0) {
+		errno = -req->res[URING_OP_PROBE];
+		return -1;
+	}
+
+	if (req->res[URING_OP_PROBE] > 0) {
+		buf[len++] = req->probe[0];
+		*more = 1;
+	}
+
+	return len;
+}
+
+ssize_t uring_read_file(const char *path, void *buf, size_t buf_size, struct stat *st, uring_file_t *more)
+{
+	uring_t *r = ring;
+	struct io_uring_sqe *sqe;
+	uring_req_t req;
+	unsigned slot;
+	ssize_t len;
+	int is_more;
+
+	more->fd = -1;
+
+	if (!r || r->disabled) {
+		errno = ENOSYS;
+		return -1;
+	}
+
+	slot = uring_slot_get(r);
+	wire_wait_init(&req.wait);
+	// All but the close, which is only queued once we know if the file goes on
+	req.pending = URING_OPS - 1;
+
+	sqe = uring_get_sqe(r);
+	sqe->opcode = IORING_OP_STATX;
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (uintptr_t)path;
+	sqe->len = STATX_BASIC_STATS;
+	sqe->addr2 = (uintptr_t)&req.stx;
+	uring_sqe_data(sqe, &req, URING_OP_STATX);
+
+	// The reads are chained to the open through the slot
+	sqe = uring_get_sqe(r);
+	sqe->opcode = IORING_OP_OPENAT;
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (uintptr_t)path;
+	sqe->open_flags = O_RDONLY|O_NOCTTY;
+	sqe->file_index = slot + 1;
+	sqe->flags = IOSQE_IO_HARDLINK;
+	uring_sqe_data(sqe, &req, URING_OP_OPEN);
+
+	uring_queue_reads(r, &req, slot, 1, buf, buf_size);
+
+	uring_req_wait(r, &req);
+
+	if (req.res[URING_OP_STATX] < 0) {
+		uring_queue_close(r, slot);
+		errno = -req.res[URING_OP_STATX];
+		return -1;
+	}
+	uring_stat(st, &req.stx);
+
+	if (req.res[URING_OP_OPEN] < 0) {
+		uring_queue_close(r, slot);
+		errno = -req.res[URING_OP_OPEN];
+		return -1;
+	}
+
+	len = uring_read_result(&req, buf, &is_more);
+	if (len < 0 || !is_more) {
+		uring_queue_close(r, slot);
+		return len;
+	}
+
+	// The slot stays taken until the rest is read
+	more->fd = slot;
+	return len;
+}
+
+ssize_t uring_read_fd(int fd, void *buf, size_t buf_size, int *more)
+{
+	uring_t *r = ring;
+	uring_req_t req;
+	unsigned slot;
+
+	if (!r || r->disabled) {
+		errno = ENOSYS;
+		return -1;
+	}
+
+	// Only the reads, the slot just bounds the requests in flight
+	slot = uring_slot_get(r);
+	wire_wait_init(&req.wait);
+	req.pending = 2;
+
+	uring_queue_reads(r, &req, fd, 0, buf, buf_size);
+
+	uring_req_wait(r, &req);
+	uring_slot_put(r, slot);
+
+	return uring_read_result(&req, buf, more);
+}
+
+ssize_t uring_read_more(uring_file_t *f, void *buf, size_t buf_size)
+{
+	uring_t *r = ring;
+	struct io_uring_sqe *sqe;
+	uring_req_t req;
+
+	if (!r || r->disabled) {
+		errno = ENOSYS;
+		return -1;
+	}
+
+	wire_wait_init(&req.wait);
+	req.pending = 1;
+
+	sqe = uring_get_sqe(r);
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = f->fd;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = buf_size;
+	sqe->off = (uint64_t)-1;
+	sqe->flags = IOSQE_FIXED_FILE;
+	uring_sqe_data(sqe, &req, URING_OP_READ);
+
+	// The file holds its slot, which leaves room in the rings for the read
+	uring_req_wait(r, &req);
+
+	if (req.res[URING_OP_READ] < 0) {
+		errno = -req.res[URING_OP_READ];
+		return -1;
+	}
+
+	return req.res[URING_OP_READ];
+}
+
+void uring_file_close(uring_file_t *f)
+{
+	if (f->fd >= 0 && ring)
+		uring_queue_close(ring, f->fd);
+	f->fd = -1;
+}
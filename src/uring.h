@@ -0,0 +1,40 @@
+#ifndef DOCKET_URING_H
+#define DOCKET_URING_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/* Reads of small files through io_uring. The statx, open and read of a file
+ * are queued together and its close goes with the next submission, the
+ * requests of all the wires of a thread go to the kernel in one submission and
+ * the completions come back through an eventfd. The opens use direct
+ * descriptors, which need Linux 5.15.
+ */
+
+/* A file that was read up to the end of the buffer and goes on. It stays open
+ * so the rest is read from where the first read stopped, fd is -1 when there
+ * is nothing more. A file uring opened is a slot in the ring.
+ */
+typedef struct uring_file {
+	int fd;
+} uring_file_t;
+
+// Every wire thread has its own ring, -1 if io_uring isn't usable
+int uring_thread_init(void);
+
+/* Read a file into buf. Returns the length or -1 with errno set, ENOSYS when
+ * the ring isn't usable. If there is more to the file than fits in buf, buf is
+ * filled and more is left open, it must then be closed with uring_file_close.
+ */
+ssize_t uring_read_file(const char *path, void *buf, size_t buf_size, struct stat *st, uring_file_t *more);
+
+/* The same for a file that is already open, read from its current position.
+ * Returns 1 in more when it goes on, the caller reads the rest from the fd.
+ */
+ssize_t uring_read_fd(int fd, void *buf, size_t buf_size, int *more);
+
+// Read on from where the last read of a file uring opened stopped, 0 at the end
+ssize_t uring_read_more(uring_file_t *f, void *buf, size_t buf_size);
+void uring_file_close(uring_file_t *f);
+
+#endif
@@ -0,0 +1,558 @@
+#include "walk.h"
+
+#include "wire.h"
+#include "wire_fd.h"
+#include "wire_stack.h"
+#include "wire_log.h"
+#include "macros.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+
+#define WALK_BUF_SIZE (32*1024)
+
+// Files opened but not yet taken by the wire, bounds the open fds of a walk
+#define WALK_PENDING_MAX 64
+
+struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+/* A directory to list. It stays around, with its fd open, until it was
+ * listed and all of its subdirectories were opened relative to it.
+ */
+struct walk_task {
+	walk_task_t *next;
+	walk_t *w;
+	walk_task_t *parent;
+	unsigned refs;
+	unsigned depth;
+	int fd;
+	const char *name;
+	char path[];
+};
+
+static unsigned num_workers;
+
+// Shared with the walk threads, protects the tasks and everything in the walks they touch
+static pthread_mutex_t walk_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t walk_cond = PTHREAD_COND_INITIALIZER;
+static walk_task_t *task_stack;
+
+// The walks of every wire thread are woken by its own completion wire
+static __thread walk_t *walks;
+static __thread int notify_fd = -1;
+static __thread wire_t completion_wire;
+
+// Only the root directory itself ends with a slash
+static const char *walk_sep(const char *path)
+{
+	return strcmp(path, "/") == 0 ? "" : "/";
+}
+
+static walk_task_t *walk_task_new(walk_t *w, walk_task_t *parent, const char *name, unsigned depth)
+{
+	size_t prefix_len = parent ? strlen(parent->path) + strlen(walk_sep(parent->path)) : 0;
+	size_t name_len = strlen(name);
+	walk_task_t *t;
+
+	// A root given as dir/ would give dir//file paths
+	if (!parent) {
+		while (name_len > 1 && name[name_len - 1] == '/')
+			name_len--;
+	}
+
+	t = malloc(sizeof(*t) + prefix_len + name_len + 1);
+	if (!t)
+		return NULL;
+
+	if (parent)
+		sprintf(t->path, "%s%s%s", parent->path, walk_sep(parent->path), name);
+	else
+		sprintf(t->path, "%.*s", (int)name_len, name);
+
+	t->next = NULL;
+	t->w = w;
+	t->parent = parent;
+	t->refs = 1;
+	t->depth = depth;
+	t->fd = -1;
+	t->name = t->path + prefix_len;
+	return t;
+}
+
+// Push a task for the threads, called with the lock held
+static void walk_task_push(walk_task_t *t)
+{
+	t->next = task_stack;
+	task_stack = t;
+	pthread_cond_signal(&walk_cond);
+}
+
+// Drop a reference to a task, called with the lock held
+static void walk_task_put(walk_task_t *t)
+{
+	walk_task_t *parent;
+
+	while (t && --t->refs == 0) {
+		parent = t->parent;
+		if (t->fd >= 0)
+			close(t->fd);
+		free(t);
+		t = parent;
+	}
+}
+
+// Wake the wire of the walk, called with the lock held
+static void walk_notify(walk_t *w)
+{
+	uint64_t one = 1;
+	ssize_t ret;
+
+	if (w->ready)
+		return;
+
+	w->ready = 1;
+	ret = write(w->notify_fd, &one, sizeof(one));
+	UNUSED(ret);
+}
+
+// The task is listed, called with the lock held
+static void walk_task_done(walk_task_t *t)
+{
+	walk_t *w = t->w;
+
+	walk_task_put(t);
+	if (--w->tasks == 0)
+		walk_notify(w);
+}
+
+static void walk_error(walk_t *w, const char *path)
+{
+	int err = errno;
+
+	pthread_mutex_lock(&walk_lock);
+	if (w->errors++ == 0) {
+		errno = err;
+		snprintf(w->error, sizeof(w->error), "%s: %m", path);
+	}
+	pthread_mutex_unlock(&walk_lock);
+}
+
+/* Hand an open file to the wire. Returns 1 if the walk has enough files
+ * waiting and the task should pause, -1 if the walk was stopped.
+ */
+static int walk_emit(walk_t *w, int fd, const char *path, unsigned depth, const struct stat *st)
+{
+	walk_entry_t *e;
+	int ret;
+
+	e = malloc(sizeof(*e) + strlen(path) + 1);
+	if (!e) {
+		close(fd);
+		walk_error(w, path);
+		return 0;
+	}
+
+	e->next = NULL;
+	e->fd = fd;
+	e->depth = depth;
+	e->st = *st;
+	strcpy(e->path, path);
+
+	pthread_mutex_lock(&walk_lock);
+	if (w->stopped) {
+		pthread_mutex_unlock(&walk_lock);
+		walk_entry_free(e);
+		return -1;
+	}
+
+	if (w->tail)
+		w->tail->next = e;
+	else
+		w->head = e;
+	w->tail = e;
+	w->pending++;
+	w->files++;
+	walk_notify(w);
+	ret = w->pending >= WALK_PENDING_MAX;
+	pthread_mutex_unlock(&walk_lock);
+
+	return ret;
+}
+
+static int walk_open_file(walk_t *w, int dir_fd, const char *name, const char *path, unsigned depth, const struct stat *st)
+{
+	int fd;
+
+	fd = openat(dir_fd, name, O_RDONLY|O_CLOEXEC|O_NOFOLLOW|O_NOCTTY);
+	if (fd < 0) {
+		walk_error(w, path);
+		return 0;
+	}
+
+	return walk_emit(w, fd, path, depth, st);
+}
+
+// Make room for a path in the buffer of the thread
+static char *walk_path(char **path, size_t *path_size, size_t len)
+{
+	char *p;
+
+	if (len > *path_size) {
+		p = realloc(*path, len);
+		if (!p)
+			return NULL;
+		*path = p;
+		*path_size = len;
+	}
+
+	return *path;
+}
+
+/* The start of a walk is checked like any entry and listed if it is a
+ * directory. Returns 0 to list it.
+ */
+static int walk_task_root(walk_task_t *t)
+{
+	walk_t *w = t->w;
+	const char *name;
+	struct stat st;
+	int ret;
+
+	if (stat(t->path, &st) < 0) {
+		walk_error(w, t->path);
+		return -1;
+	}
+
+	name = strrchr(t->path, '/');
+	name = name && name[1] ? name + 1 : t->path;
+
+	ret = w->filter(w->filter_arg, t->path, name, 0, &st);
+	if ((ret & WALK_COLLECT) && S_ISREG(st.st_mode))
+		walk_open_file(w, AT_FDCWD, t->path, t->path, 0, &st);
+
+	if (!S_ISDIR(st.st_mode) || (ret & WALK_PRUNE) || w->max_depth == 0)
+		return -1;
+
+	return 0;
+}
+
+static void walk_task_run(walk_task_t *t, char *buf, char **path, size_t *path_size)
+{
+	walk_t *w = t->w;
+	struct linux_dirent64 *d;
+	walk_task_t *child;
+	struct stat st;
+	unsigned depth = t->depth + 1;
+	long nread;
+	long off;
+	int ret;
+
+	if (t->fd < 0) {
+		if (!t->parent && walk_task_root(t) < 0)
+			goto Done;
+
+		t->fd = openat(t->parent ? t->parent->fd : AT_FDCWD, t->parent ? t->name : t->path,
+				O_RDONLY|O_DIRECTORY|O_CLOEXEC|(t->parent ? O_NOFOLLOW : 0));
+
+		// The subdirectory is open, the parent isn't needed for it anymore
+		pthread_mutex_lock(&walk_lock);
+		walk_task_put(t->parent);
+		t->parent = NULL;
+		if (t->fd >= 0)
+			w->dirs++;
+		pthread_mutex_unlock(&walk_lock);
+
+		if (t->fd < 0) {
+			walk_error(w, t->path);
+			goto Done;
+		}
+	}
+
+	while ((nread = syscall(SYS_getdents64, t->fd, buf, WALK_BUF_SIZE)) > 0) {
+		for (off = 0; off < nread; off += d->d_reclen) {
+			d = (struct linux_dirent64 *)(buf + off);
+
+			if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
+				continue;
+
+			// Entries in /proc and /sys come and go, a vanished one is skipped
+			if (fstatat(t->fd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+				continue;
+
+			if (!walk_path(path, path_size, strlen(t->path) + strlen(d->d_name) + 2)) {
+				walk_error(w, t->path);
+				continue;
+			}
+			sprintf(*path, "%s%s%s", t->path, walk_sep(t->path), d->d_name);
+
+			ret = w->filter(w->filter_arg, *path, d->d_name, depth, &st);
+
+			if (S_ISDIR(st.st_mode) && !(ret & WALK_PRUNE) && depth < w->max_depth) {
+				child = walk_task_new(w, t, d->d_name, depth);
+				if (!child) {
+					walk_error(w, *path);
+					continue;
+				}
+
+				pthread_mutex_lock(&walk_lock);
+				t->refs++;
+				w->tasks++;
+				walk_task_push(child);
+				pthread_mutex_unlock(&walk_lock);
+			}
+
+			if (!(ret & WALK_COLLECT) || !S_ISREG(st.st_mode))
+				continue;
+
+			ret = walk_open_file(w, t->fd, d->d_name, *path, depth, &st);
+			if (ret < 0)
+				goto Done;
+			if (ret > 0) {
+				// Continue from the next entry once the wire caught up
+				lseek(t->fd, d->d_off, SEEK_SET);
+				pthread_mutex_lock(&walk_lock);
+				if (w->pending > WALK_PENDING_MAX / 2 && !w->stopped) {
+					t->next = w->parked;
+					w->parked = t;
+				} else {
+					// The wire already took most of them
+					walk_task_push(t);
+				}
+				pthread_mutex_unlock(&walk_lock);
+				return;
+			}
+		}
+	}
+
+	if (nread < 0)
+		walk_error(w, t->path);
+
+Done:
+	pthread_mutex_lock(&walk_lock);
+	walk_task_done(t);
+	pthread_mutex_unlock(&walk_lock);
+}
+
+static void *walk_worker(void *arg)
+{
+	walk_task_t *t;
+	char *buf;
+	char *path = NULL;
+	size_t path_size = 0;
+
+	UNUSED(arg);
+
+	buf = malloc(WALK_BUF_SIZE);
+	if (!buf)
+		return NULL;
+
+	while (1) {
+		pthread_mutex_lock(&walk_lock);
+		while (task_stack == NULL)
+			pthread_cond_wait(&walk_cond, &walk_lock);
+		t = task_stack;
+		task_stack = t->next;
+
+		if (t->w->stopped) {
+			walk_task_done(t);
+			pthread_mutex_unlock(&walk_lock);
+			continue;
+		}
+		pthread_mutex_unlock(&walk_lock);
+
+		walk_task_run(t, buf, &path, &path_size);
+	}
+
+	return NULL;
+}
+
+static void walk_completion(void *arg)
+{
+	wire_fd_state_t fd_state;
+	uint64_t count;
+	walk_t *w;
+	ssize_t ret;
+
+	UNUSED(arg);
+
+	wire_fd_mode_init(&fd_state, notify_fd);
+	wire_fd_mode_read(&fd_state);
+
+	while (1) {
+		wire_fd_wait(&fd_state);
+
+		ret = read(notify_fd, &count, sizeof(count));
+		if (ret < 0)
+			continue;
+
+		pthread_mutex_lock(&walk_lock);
+		for (w = walks; w; w = w->next) {
+			if (w->ready) {
+				w->ready = 0;
+				wire_wait_resume(&w->wait);
+			}
+		}
+		pthread_mutex_unlock(&walk_lock);
+	}
+}
+
+int walk_workers_init(unsigned max_threads)
+{
+	pthread_t thread;
+	long ncpus;
+	unsigned i;
+
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	num_workers = ncpus > 0 && ncpus < max_threads ? ncpus : max_threads;
+	if (num_workers == 0)
+		num_workers = 1;
+
+	for (i = 0; i < num_workers; i++) {
+		if (pthread_create(&thread, NULL, walk_worker, NULL) != 0) {
+			wire_log(WLOG_ERR, "Failed to start walk thread %u: %m", i);
+			break;
+		}
+		pthread_detach(thread);
+	}
+
+	num_workers = i;
+	return i > 0 ? 0 : -1;
+}
+
+int walk_thread_init(void)
+{
+	if (num_workers == 0)
+		return -1;
+
+	notify_fd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+	if (notify_fd < 0) {
+		wire_log(WLOG_ERR, "Failed to create walk eventfd: %m");
+		return -1;
+	}
+
+	wire_init(&completion_wire, "walk completion", walk_completion, NULL, WIRE_STACK_ALLOC(4096));
+	return 0;
+}
+
+void walk_init(walk_t *w, unsigned max_depth, walk_filter_t filter, void *filter_arg)
+{
+	memset(w, 0, sizeof(*w));
+	w->filter = filter;
+	w->filter_arg = filter_arg;
+	w->max_depth = max_depth;
+	w->notify_fd = notify_fd;
+	wire_wait_init(&w->wait);
+
+	pthread_mutex_lock(&walk_lock);
+	w->next = walks;
+	walks = w;
+	pthread_mutex_unlock(&walk_lock);
+}
+
+int walk_add_root(walk_t *w, const char *path)
+{
+	walk_task_t *t;
+
+	if (w->notify_fd < 0)
+		return -1;
+
+	t = walk_task_new(w, NULL, path, 0);
+	if (!t)
+		return -1;
+
+	pthread_mutex_lock(&walk_lock);
+	w->tasks++;
+	walk_task_push(t);
+	pthread_mutex_unlock(&walk_lock);
+	return 0;
+}
+
+// Give the parked tasks back to the threads, called with the lock held
+static void walk_unpark(walk_t *w)
+{
+	walk_task_t *t;
+
+	while (w->parked) {
+		t = w->parked;
+		w->parked = t->next;
+		walk_task_push(t);
+	}
+}
+
+walk_entry_t *walk_next(walk_t *w)
+{
+	walk_entry_t *e;
+	int done;
+
+	while (1) {
+		wire_wait_reset(&w->wait);
+
+		pthread_mutex_lock(&walk_lock);
+		e = w->head;
+		if (e) {
+			w->head = e->next;
+			if (!w->head)
+				w->tail = NULL;
+			w->pending--;
+			if (w->pending <= WALK_PENDING_MAX / 2)
+				walk_unpark(w);
+		}
+		done = w->tasks == 0;
+		pthread_mutex_unlock(&walk_lock);
+
+		if (e)
+			return e;
+		if (done)
+			return NULL;
+
+		wire_wait_single(&w->wait);
+	}
+}
+
+void walk_entry_free(walk_entry_t *e)
+{
+	if (e->fd >= 0)
+		close(e->fd);
+	free(e);
+}
+
+void walk_stop(walk_t *w)
+{
+	pthread_mutex_lock(&walk_lock);
+	w->stopped = 1;
+	walk_unpark(w);
+	pthread_mutex_unlock(&walk_lock);
+}
+
+void walk_end(walk_t *w)
+{
+	walk_entry_t *e;
+	walk_t **pw;
+
+	walk_stop(w);
+	while ((e = walk_next(w)) != NULL)
+		walk_entry_free(e);
+
+	pthread_mutex_lock(&walk_lock);
+	for (pw = &walks; *pw; pw = &(*pw)->next) {
+		if (*pw == w) {
+			*pw = w->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&walk_lock);
+}
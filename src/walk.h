@@ -0,0 +1,74 @@
+#ifndef DOCKET_WALK_H
+#define DOCKET_WALK_H
+
+#include "wire_wait.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/* Directory walks done by a pool of threads. The threads list directories
+ * with getdents64 relative to the fd of their parent so paths of any length
+ * work, the subdirectories of a walk are spread over all the threads. Files
+ * that pass the filter are opened by the threads and handed back to the wire
+ * that runs the walk.
+ */
+typedef struct walk_task walk_task_t;
+
+typedef struct walk_entry {
+	struct walk_entry *next;
+	int fd;
+	unsigned depth;
+	struct stat st;
+	char path[];
+} walk_entry_t;
+
+#define WALK_COLLECT 1
+#define WALK_PRUNE 2
+
+/* Called from the walk threads for every entry, returns WALK_COLLECT to hand
+ * a regular file to the wire and WALK_PRUNE to not descend into a directory.
+ */
+typedef int (*walk_filter_t)(void *arg, const char *path, const char *name, unsigned depth, const struct stat *st);
+
+typedef struct walk {
+	struct walk *next;
+	walk_filter_t filter;
+	void *filter_arg;
+	unsigned max_depth;
+	int notify_fd;
+	int ready;
+	int stopped;
+	unsigned tasks;
+	unsigned pending;
+	walk_entry_t *head;
+	walk_entry_t *tail;
+	walk_task_t *parked;
+	wire_wait_t wait;
+
+	unsigned long long dirs;
+	unsigned long long files;
+	unsigned errors;
+	char error[256];
+} walk_t;
+
+#define WALK_DEPTH_ANY (~0U)
+
+int walk_workers_init(unsigned max_threads);
+int walk_thread_init(void);
+
+void walk_init(walk_t *w, unsigned max_depth, walk_filter_t filter, void *filter_arg);
+int walk_add_root(walk_t *w, const char *path);
+
+/* Wait for the next file of the walk, NULL once the walk is over. The entry
+ * and its fd belong to the caller.
+ */
+walk_entry_t *walk_next(walk_t *w);
+void walk_entry_free(walk_entry_t *e);
+
+// Don't start on new directories, walk_next drains what was already found
+void walk_stop(walk_t *w);
+
+// Wait for the threads to be done with the walk and free what is left of it
+void walk_end(walk_t *w);
+
+#endif